@@ -45,12 +45,22 @@
  *
  * The encoding always success, thus there is no software fallback.
  *
- * This version of library supports only NV12/NV16 pixel format. When
- * YUV420 profile is passed to the library, it automatically decode in
- * NV12 pixel format. When YUV422 profile or YUV444 profile is passed,
- * it automatically decode in NV16 pixel format.
- *
- * Encoding can only be from/to NV12/NV16 pixel format.
+ * JPU works with NV12/NV16 pixel format, and VEU converts them from
+ * and to RGB16/RGB24/RGB32. When YUV420 profile is passed to the
+ * library, it automatically decode in NV12 pixel format. When YUV422
+ * profile or YUV444 profile is passed, it automatically decode in NV16
+ * pixel format.
+ *
+ * The other pixel formats (YUYV, UYVY, NV21, NV61, I420, BGR24, BGR32
+ * and ARGB32) are converted by CPU from or to the closest of them, in
+ * the memory of the image when decoding, and in the contiguous memory
+ * of the library when encoding. shjpeg_get_pixelformat_info() tells
+ * the layout of each format, and whether it needs such a pass.
+ *
+ * GRAY8 writes or reads only the Y plane. Grayscale (single
+ * component) JPEG images are decoded by libjpeg, as JPU handles only
+ * YCbCr images. Encoding from GRAY8 gives a YCbCr 4:2:0 image with
+ * neutral chroma.
  */
 
 /**
@@ -111,6 +121,30 @@ int shjpeg_get_frame_buffer(shjpeg_context_t	 *context,
 			    void		**buffer,
 			    size_t		 *size );
 
+/**
+ * \brief Get pixel format information.
+ *
+ * \param format [in] a pixel format.
+ *
+ * \return the description of the format, or NULL if not supported.
+ */
+
+const shjpeg_pixelformat_info_t *
+shjpeg_get_pixelformat_info(shjpeg_pixelformat format);
+
+/**
+ * \brief Get the size of a frame.
+ *
+ * \param format [in] a pixel format.
+ * \param pitch [in] pitch of the first plane in bytes.
+ * \param height [in] height of the frame.
+ *
+ * \return bytes needed to hold a frame of all planes, or -1 if the
+ *	   format is not supported.
+ */
+
+int shjpeg_get_frame_size(shjpeg_pixelformat format, int pitch, int height);
+
 /**
  * \brief Open JPEG file.
  *
@@ -118,7 +152,9 @@ int shjpeg_get_frame_buffer(shjpeg_context_t	 *context,
  * for decompression. Subsequently after calling this function,
  * shjpeg_decode_run() can be called.
  *
- * Width and height of the JPEG image is returned in the context.
+ * Width and height of the JPEG image is returned in the context. If
+ * scale_denom is set in the context, the returned size is the one of
+ * the scaled image. The size is not affected by the orientation.
  *
  * \param [in,out] context a pointer to the JPEG image context to be returned.
  *
@@ -136,10 +172,28 @@ int shjpeg_decode_init(shjpeg_context_t *context);
  * Start decoding JPEG file. This could be called only after
  * shjpeg_decode_init() is called.
  *
+ * The bytes consumed by shjpeg_decode_init() are kept by the library
+ * and replayed to the JPU, thus the JPEG stream is read only once
+ * from the beginning to the end. If the JPU fails after reading
+ * beyond the header, the stream is rewound with the init method of
+ * shjpeg_sops for the software fallback.
+ *
+ * If the JPU stops with an error in the middle of an image that has
+ * restart markers, only the lines after the last restart interval
+ * known to be decoded are decoded again by libjpeg.
+ *
+ * Images wider than 2560 pixels, the line buffer of the JPU, are
+ * decoded by the JPU in vertical strips if each MCU row consists of
+ * whole restart intervals, and the image is neither cropped, resized
+ * nor rotated. Otherwise they are decoded by libjpeg, unless written
+ * directly by the JPU.
+ *
  * \param context [in] a pointer to the JPEG image context to be
  *        decoded. Pass the value set by shjpeg_open().
  *
- * \param format [in] desired pixelformat of the decoded image.  
+ * \param format [in] desired pixelformat of the decoded image. Formats
+ *	 that VEU can't write are decoded to the closest one, and
+ *	 converted in place.
  *
  * \param phys [in] physical memory address for decoded image. If the value
  *       is set to 0L, then memory allocated by the kernel will be
@@ -152,6 +206,20 @@ int shjpeg_decode_init(shjpeg_context_t *context);
  *
  * \param pitch [in] pitch of the frame buffer.
  *
+ * If resize_width or resize_height is set in the context, the image
+ * is resized while decoded. JPU decodes at the original size and VEU
+ * resizes the line buffers into the frame buffer. libjpeg decodes
+ * with the closest scaled IDCT and resamples the rest.
+ *
+ * If crop is set in the context, only the region is written at
+ * (dst_x, dst_y) in the frame buffer. VEU converts only the line
+ * buffers inside the region, and libjpeg skips the MCUs outside of
+ * it where possible.
+ *
+ * If orientation is set in the context, VEU mirrors and rotates the
+ * line buffers while converting them. libjpeg writes the decoded
+ * lines in bands of 16 lines to the rotated position.
+ *
  * \retval 0 success
  * \retval -1 failed
  *
@@ -164,6 +232,157 @@ int shjpeg_decode_run(shjpeg_context_t		*context,
 		      int			 height,
 		      int                    	 pitch);
 
+/**
+ * \brief Decode JPEG stream to a frame with separate planes.
+ *
+ * Same as shjpeg_decode_run(), but the CbCr plane of NV12 and NV16
+ * may be placed anywhere, e.g. in another plane of a V4L2 buffer. The
+ * JPU and VEU write both planes in place, and libjpeg maps them one by
+ * one, thus no copy is made.
+ *
+ * \param context [in] a pointer to the JPEG image context to be
+ *        decoded. Pass the value set by shjpeg_open().
+ *
+ * \param format [in] desired pixelformat of the decoded image.
+ *
+ * \param frame [in] planes of the destination frame buffer. The
+ *	 buffer of shjpeg_get_frame_buffer() can't be used implicitly.
+ *
+ * \param width [in] width of the destination frame buffer.
+ *
+ * \param height [in] height of the destination frame buffer.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_decode_run().
+ */
+int shjpeg_decode_frame(shjpeg_context_t	*context,
+			shjpeg_pixelformat	 format,
+			const shjpeg_frame_t	*frame,
+			int			 width,
+			int			 height);
+
+/**
+ * \brief Decode JPEG stream to several outputs at once.
+ *
+ * Same as shjpeg_decode_frame(), but the stream is decoded only once
+ * for all the outputs, each in its own format, size and place, e.g.
+ * a frame for the display and a thumbnail. The crop region and
+ * scale_denom in the context apply to all the outputs, and dst_x,
+ * dst_y, resize_width and resize_height are taken from each output
+ * instead.
+ *
+ * When decoded by the JPU, VEU converts each line buffer once for
+ * each output before the JPU reuses it. libjpeg decodes the image at
+ * the size of the largest output, and writes each line to all the
+ * outputs.
+ *
+ * The image can't be rotated or mirrored, and only the formats the
+ * VEU writes natively are supported.
+ *
+ * \param context [in] a pointer to the JPEG image context to be
+ *        decoded. Pass the value set by shjpeg_open().
+ *
+ * \param outputs [in] outputs to write the decoded image to.
+ *
+ * \param num_outputs [in] number of outputs.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_decode_frame().
+ */
+int shjpeg_decode_multi(shjpeg_context_t		*context,
+			const shjpeg_decode_output_t	*outputs,
+			int				 num_outputs);
+
+/**
+ * \brief Transcode JPEG stream to another JPEG stream.
+ *
+ * Decodes the stream of the context into the buffer of
+ * shjpeg_get_frame_buffer(), and encodes it again to the stream of
+ * output, all in one call. The JPU is locked across both, and the
+ * decoded image stays in the contiguous memory, thus the JPU and VEU
+ * do all the work unless libjpeg has to decode the stream.
+ *
+ * The crop region, scale_denom, resize_width, resize_height and
+ * orientation of the context apply to the decoded image, and the
+ * encoding settings of the context apply to the encoded one, except
+ * encode_crop. width and height of output resize the image again
+ * when encoding, and are usually 0.
+ *
+ * If save_markers was set for shjpeg_decode_init(), the saved APPn
+ * and COM markers are written to the encoded stream as well, unless
+ * encode_markers is set.
+ *
+ * Call shjpeg_decode_init() before, and shjpeg_decode_shutdown()
+ * after, as for decoding.
+ *
+ * \param context [in] a pointer to the JPEG image context to be
+ *        transcoded. Pass the value set by shjpeg_open().
+ *
+ * \param format [in] pixelformat of the decoded image, which decides
+ *	 the sampling of the encoded one. Only NV12, NV16 and GRAY8 are
+ *	 supported.
+ *
+ * \param output [in,out] stream and size of the encoded image.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_decode_run(), and shjpeg_encode_multi().
+ */
+int shjpeg_transcode(shjpeg_context_t		*context,
+		     shjpeg_pixelformat		 format,
+		     shjpeg_encode_output_t	*output);
+
+/**
+ * \brief Decode JPEG stream in bands.
+ *
+ * Same as shjpeg_decode_run(), but the decoded image is passed to the
+ * callback from the top in bands of a few lines, instead of being
+ * written to a frame buffer. Only the memory for two bands is needed,
+ * thus images larger than the buffer of shjpeg_get_frame_buffer() can
+ * be decoded, e.g. to be written to a file or to a tiled surface.
+ *
+ * When decoded by the JPU, VEU converts each line buffer of 16 lines
+ * into a band in the buffer of shjpeg_get_frame_buffer(), and the
+ * band has a physical address. The number of lines varies when the
+ * image is resized. libjpeg passes bands of 16 lines in memory
+ * allocated by the library.
+ *
+ * If the JPU fails in the middle of the image, libjpeg decodes the
+ * image again, and passes only the lines after the bands already
+ * passed.
+ *
+ * dst_x and dst_y in the context are ignored, and the image can't be
+ * rotated or mirrored vertically.
+ *
+ * \param context [in] a pointer to the JPEG image context to be
+ *        decoded. Pass the value set by shjpeg_open().
+ *
+ * \param format [in] pixelformat of the bands. Only the formats the
+ *	 hardware handles natively are supported.
+ *
+ * \param pitch [in] pitch of the bands, or 0 for the minimum.
+ *
+ * \param func [in] callback called for each band. If it returns a
+ *	 non-zero value, no more bands are passed and decoding fails.
+ *
+ * \param private [in] user data passed to func.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_decode_init(), shjpeg_decode_run().
+ */
+int shjpeg_decode_bands(shjpeg_context_t	*context,
+			shjpeg_pixelformat	 format,
+			int			 pitch,
+			shjpeg_band_func	 func,
+			void			*private);
+
 /**
  * \brief Close JPEG stream context.
  *
@@ -188,8 +407,12 @@ void shjpeg_decode_shutdown(shjpeg_context_t *context);
  * \param context [in] a pointer to the JPEG image context to be
  *        encoded. Pass the value set by shjpeg_open().
  *
- * \param format pixelformat of the image. Only NV12 and NV16 are
- *	  supported.
+ * \param format pixelformat of the image. All formats are supported,
+ *	  GRAY8 can't be resized, and is read in bands of 16 lines: the
+ *	  image must be padded to the end of the last band, unless it's
+ *	  in the buffer of the library. Formats that VEU can't read are
+ *	  converted into the buffer of shjpeg_get_frame_buffer() first,
+ *	  after the image if it's placed there.
  *
  * \param phys physical memory address for input image. If the value
  *       is set to 0L, then memory allocated by the kernel will be
@@ -202,6 +425,24 @@ void shjpeg_decode_shutdown(shjpeg_context_t *context);
  *
  * \param pitch pitch of the input image buffer.
  *
+ * If encode_crop is set in the context, only the region of the input
+ * image is encoded. If encode_width or encode_height is set, the
+ * image is resized to the size by VEU while encoded.
+ *
+ * encode_quality scales the quantization tables. If encode_target_size
+ * or encode_bitrate is set, the quality is chosen for each image
+ * instead, and the chosen one is stored in encode_last_quality.
+ *
+ * encode_restart_interval selects the restart interval. If
+ * encode_restart_offsets is set, the offsets of the scan and of each
+ * RST marker in the written image are stored there.
+ *
+ * Images wider than 2560 pixels, the line buffer of the JPU, are
+ * encoded in vertical strips unless read directly by the JPU, and
+ * can't be resized. The strips are stitched into a single image in
+ * memory, with the largest restart interval that divides both the
+ * MCU row and the strips and doesn't exceed the one selected.
+ *
  * \retval 0 success
  * \retval -1 failed
  *
@@ -214,4 +455,353 @@ int shjpeg_encode(shjpeg_context_t	*context,
 		  int           	 height,
 		  int                    pitch);
 
+/**
+ * \brief Encode the image in a frame with separate planes to JPEG file.
+ *
+ * Same as shjpeg_encode(), but the CbCr plane of NV12 and NV16 may be
+ * placed anywhere, e.g. in another plane of a V4L2 buffer or a DRM
+ * dumb buffer. The JPU and VEU read both planes in place, thus no copy
+ * is made.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param format pixelformat of the image.
+ *
+ * \param frame planes of the input image.
+ *
+ * \param width width of the input image.
+ *
+ * \param height height of the input image.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode().
+ */
+int shjpeg_encode_frame(shjpeg_context_t	*context,
+			shjpeg_pixelformat	 format,
+			const shjpeg_frame_t	*frame,
+			int			 width,
+			int			 height);
+
+/**
+ * \brief Encode the image to JPEG files of different sizes.
+ *
+ * Same as shjpeg_encode(), but the image is encoded once for each of
+ * the outputs, e.g. a full size image and thumbnails. The JPU is
+ * locked only once for all of them, and VEU resizes the input image
+ * for each output size, thus no scaled copy of the image is made.
+ * encode_width and encode_height in the context are ignored.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param format pixelformat of the image.
+ *
+ * \param phys physical memory address for input image.
+ *
+ * \param width width of the input image. 
+ *
+ * \param height height of the input image.
+ *
+ * \param pitch pitch of the input image buffer.
+ *
+ * \param outputs sizes and streams of the images to encode.
+ *
+ * \param num_outputs number of the outputs.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode().
+ */
+int shjpeg_encode_multi(shjpeg_context_t	*context,
+			shjpeg_pixelformat	 format,
+			unsigned long		 phys,
+			int			 width,
+			int			 height,
+			int			 pitch,
+			shjpeg_encode_output_t	*outputs,
+			int			 num_outputs);
+
+/**
+ * \brief Encode the image to JPEG file from bands.
+ *
+ * Same as shjpeg_encode(), but the image is read from the top in bands
+ * of 16 lines filled by the callback, instead of from a frame buffer.
+ * Each band is asked for when the JPU or VEU is done with the band
+ * buffer it goes to, thus the callback may wait for the lines to be
+ * captured or rendered, while the lines before are encoded. Only the
+ * memory for two bands is needed, in the buffer of
+ * shjpeg_get_frame_buffer(), and each band has a physical address.
+ *
+ * encode_crop, encode_width and encode_height in the context are
+ * ignored, and rate control isn't applied: the image is encoded with
+ * encode_quality.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param format [in] pixelformat of the bands. Only the formats the
+ *	 hardware handles natively are supported.
+ *
+ * \param width [in] width of the image, at most 2560 pixels unless
+ *	 GRAY8.
+ *
+ * \param height [in] height of the image.
+ *
+ * \param pitch [in] pitch of the bands, or 0 for the minimum.
+ *
+ * \param func [in] callback called for each band to fill height lines
+ *	 from y at addr, and for NV12 and NV16 the CbCr lines at
+ *	 c_addr. If it returns a non-zero value, encoding fails.
+ *
+ * \param private [in] user data passed to func.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_encode().
+ */
+int shjpeg_encode_bands(shjpeg_context_t	*context,
+			shjpeg_pixelformat	 format,
+			int			 width,
+			int			 height,
+			int			 pitch,
+			shjpeg_band_func	 func,
+			void			*private);
+
+/**
+ * \brief Open a Motion JPEG encoder.
+ *
+ * Frames of a stream, e.g. captured by V4L2, are encoded with the
+ * same format, size and settings. The JPU is programmed for the first
+ * frame, and then only the source address is written for each frame,
+ * as long as nothing else runs the JPU in between. The quality is
+ * chosen by encode_quality or rate control of the context for each
+ * frame, and the other encoding settings of the context are taken
+ * when opened and must not be changed until closed. Rate control
+ * starts over for the session, apart from the images encoded with the
+ * context.
+ *
+ * With SHJPEG_MJPEG_LOCK_SESSION, the JPU is locked until closed, and
+ * other processes can't use it. With SHJPEG_MJPEG_LOCK_FRAME, it's
+ * locked for each frame, and programmed again for each frame.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param format pixelformat of the frames. Only NV12 and NV16 are
+ *	 supported, as the JPU reads them directly.
+ *
+ * \param width width of the frames.
+ *
+ * \param height height of the frames.
+ *
+ * \param pitch pitch of the frames, a multiple of 8.
+ *
+ * \param lock how the JPU is locked.
+ *
+ * \retval NULL failed
+ *
+ * \sa shjpeg_mjpeg_close().
+ */
+shjpeg_mjpeg_t *shjpeg_mjpeg_open(shjpeg_context_t	*context,
+				  shjpeg_pixelformat	 format,
+				  int			 width,
+				  int			 height,
+				  int			 pitch,
+				  shjpeg_mjpeg_lock	 lock);
+
+/**
+ * \brief Encode a frame of Motion JPEG.
+ *
+ * The encoded image is held by the encoder in one of two buffers in
+ * turn, instead of being written to the stream of the context.
+ *
+ * \param mjpeg encoder returned by shjpeg_mjpeg_open().
+ *
+ * \param phys physical address of the frame. The CbCr plane follows
+ *	 the Y plane. If SHJPEG_USE_DEFAULT_BUFFER is passed, the
+ *	 default buffer is used.
+ *
+ * \param timestamp passed to frame as is, e.g. the capture time.
+ *
+ * \param frame [out] the encoded image and its size are set.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ */
+int shjpeg_mjpeg_encode_frame(shjpeg_mjpeg_t		*mjpeg,
+			      unsigned long		 phys,
+			      int64_t			 timestamp,
+			      shjpeg_mjpeg_frame_t	*frame);
+
+/**
+ * \brief Close the Motion JPEG encoder.
+ *
+ * The images of the frames are freed, and the JPU is unlocked.
+ */
+void shjpeg_mjpeg_close(shjpeg_mjpeg_t *mjpeg);
+
+/**
+ * \brief Optimize an encoded JPEG image losslessly.
+ *
+ * The DCT coefficients of the image are read by libjpeg, and written
+ * again with Huffman tables computed for the image, and optionally as
+ * a progressive JPEG. The decoded image does not change. COM and APP1
+ * markers are kept.
+ *
+ * This doesn't use the JPU, and may be called from any thread.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param src encoded image, e.g. the one written by shjpeg_encode().
+ *
+ * \param src_size size of the encoded image.
+ *
+ * \param dst the optimized image is set. Free it by free(3).
+ *
+ * \param dst_size size of the optimized image is set.
+ *
+ * \param flags shjpeg_optimize_flags.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_optimizer_create().
+ */
+int shjpeg_optimize(shjpeg_context_t	 *context,
+		    const void		 *src,
+		    size_t		  src_size,
+		    void		**dst,
+		    size_t		 *dst_size,
+		    int			  flags);
+
+/**
+ * \brief Rotate, mirror or crop an encoded JPEG image losslessly.
+ *
+ * The DCT coefficients of the image are read by libjpeg, moved and
+ * transformed as jpegtran does, and written through sops, e.g. to
+ * rotate an image by its EXIF orientation before serving it. Nothing
+ * is decoded or quantized again, thus the image is not degraded, and
+ * it's much cheaper than decoding and encoding. COM and APP1 markers
+ * are kept.
+ *
+ * This doesn't use the JPU, and may be called from any thread.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param src encoded image.
+ *
+ * \param src_size size of the encoded image.
+ *
+ * \param transform transform to apply.
+ *
+ * \param flags shjpeg_optimize_flags applied to the transformed image.
+ *
+ * \param sops stream operations to write the transformed image. Only
+ *	 init and write are used.
+ *
+ * \param private user data passed to sops.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ *
+ * \sa shjpeg_optimizer_submit_transform().
+ */
+int shjpeg_transform(shjpeg_context_t		*context,
+		     const void			*src,
+		     size_t			 src_size,
+		     const shjpeg_transform_t	*transform,
+		     int			 flags,
+		     shjpeg_sops		*sops,
+		     void			*private);
+
+/**
+ * \brief Create a background optimizer.
+ *
+ * Images submitted by shjpeg_optimizer_submit() are optimized by
+ * shjpeg_optimize() on num_threads worker threads, while the JPU
+ * encodes the next ones.
+ *
+ * \param context [in] a pointer to the JPEG image context.
+ *
+ * \param num_threads number of worker threads.
+ *
+ * \retval NULL failed
+ *
+ * \sa shjpeg_optimizer_destroy().
+ */
+shjpeg_optimizer_t *shjpeg_optimizer_create(shjpeg_context_t *context,
+					    int		      num_threads);
+
+/**
+ * \brief Queue an image for background optimization.
+ *
+ * The image must be kept until done is called. done is called from a
+ * worker thread, thus it must be thread safe.
+ *
+ * \param opt optimizer returned by shjpeg_optimizer_create().
+ *
+ * \param data encoded image.
+ *
+ * \param size size of the encoded image.
+ *
+ * \param flags shjpeg_optimize_flags.
+ *
+ * \param done called with the optimized image.
+ *
+ * \param private user data passed to done.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ */
+int shjpeg_optimizer_submit(shjpeg_optimizer_t	  *opt,
+			    const void		  *data,
+			    size_t		   size,
+			    int			   flags,
+			    shjpeg_optimize_done_t done,
+			    void		  *private);
+
+/**
+ * \brief Queue an image for background lossless transform.
+ *
+ * Same as shjpeg_optimizer_submit(), but the image is transformed as
+ * by shjpeg_transform(), and passed to done in memory.
+ *
+ * \param opt optimizer returned by shjpeg_optimizer_create().
+ *
+ * \param data encoded image.
+ *
+ * \param size size of the encoded image.
+ *
+ * \param transform transform to apply, copied when queued.
+ *
+ * \param flags shjpeg_optimize_flags.
+ *
+ * \param done called with the transformed image.
+ *
+ * \param private user data passed to done.
+ *
+ * \retval 0 success
+ * \retval -1 failed
+ */
+int shjpeg_optimizer_submit_transform(shjpeg_optimizer_t	    *opt,
+				      const void		    *data,
+				      size_t			     size,
+				      const shjpeg_transform_t	    *transform,
+				      int			     flags,
+				      shjpeg_optimize_done_t	     done,
+				      void			    *private);
+
+/**
+ * \brief Wait until all the submitted images are optimized.
+ */
+void shjpeg_optimizer_wait(shjpeg_optimizer_t *opt);
+
+/**
+ * \brief Destroy the background optimizer.
+ *
+ * Images already submitted are optimized before the workers quit.
+ */
+void shjpeg_optimizer_destroy(shjpeg_optimizer_t *opt);
+
 #endif /* !__shjpeg_h__ */
@@ -40,7 +40,9 @@
 /**
  * \brief Encodes pixelformat
  *
- * A macro to encode pixelformat. Internal purpose only.
+ * A macro to encode pixelformat. Internal purpose only. The decoding
+ * macros below are kept for compatibility, shjpeg_get_pixelformat_info()
+ * describes the layout of every format.
  *
  * \param id  unique identifier for the pixelformat
  * \param pitch a pitch multiplier
@@ -84,7 +86,7 @@
  * \param height the height of the plane.
  */
 #define SHJPEG_PF_PLANE_MULTIPLY(format, height) \
-    (((format) & 0xff) * (height) / 2)
+    ((((format) & 0xff) * (height) + 1) / 2)
 
 /**
  * \brief Pixel format
@@ -98,8 +100,279 @@ typedef enum {
     SHJPEG_PF_RGB32 = SHJPEG_PIXELFORMAT(3, 4, 32, 2),		/*!< RGB32 pixel format. */
     SHJPEG_PF_NV12  = SHJPEG_PIXELFORMAT(4, 1, 12, 3),		/*!< NV12 pixel format. */
     SHJPEG_PF_NV16  = SHJPEG_PIXELFORMAT(5, 1, 16, 4),		/*!< NV16 pixel format. */
+    SHJPEG_PF_GRAY8 = SHJPEG_PIXELFORMAT(6, 1,  8, 2),		/*!< Y plane only. */
+    SHJPEG_PF_YUYV  = SHJPEG_PIXELFORMAT(7, 2, 16, 2),		/*!< packed 4:2:2, Y0 Cb Y1 Cr. */
+    SHJPEG_PF_UYVY  = SHJPEG_PIXELFORMAT(8, 2, 16, 2),		/*!< packed 4:2:2, Cb Y0 Cr Y1. */
+    SHJPEG_PF_NV21  = SHJPEG_PIXELFORMAT(9, 1, 12, 3),		/*!< NV12 with CrCb order. */
+    SHJPEG_PF_NV61  = SHJPEG_PIXELFORMAT(10, 1, 16, 4),	/*!< NV16 with CrCb order. */
+    SHJPEG_PF_I420  = SHJPEG_PIXELFORMAT(11, 1, 12, 3),	/*!< planar 4:2:0, Y, Cb and Cr planes. */
+    SHJPEG_PF_BGR24 = SHJPEG_PIXELFORMAT(12, 3, 24, 2),	/*!< RGB24 in B, G, R byte order. */
+    SHJPEG_PF_BGR32 = SHJPEG_PIXELFORMAT(13, 4, 32, 2),	/*!< 32 bit 0x00BBGGRR. */
+    SHJPEG_PF_ARGB32 = SHJPEG_PIXELFORMAT(14, 4, 32, 2),	/*!< 32 bit 0xAARRGGBB, opaque when decoded. */
 } shjpeg_pixelformat;
 
+/**
+ * \brief Pixel format description
+ *
+ * Layout of a pixel format, see shjpeg_get_pixelformat_info(). The
+ * first plane is at the given address with the given pitch. The
+ * CbCr plane of semi-planar formats follows it with the same pitch.
+ * The Cb and Cr planes of planar formats follow it in this order,
+ * with the pitch divided by the horizontal subsampling.
+ */
+
+typedef struct {
+    shjpeg_pixelformat	format;		/*!< the pixel format. */
+    const char	       *name;		/*!< name, e.g. "NV12". */
+    int			planes;		/*!< 1 (packed), 2 (Y, CbCr) or 3 (Y, Cb, Cr). */
+    int			bytes_per_pixel;/*!< bytes per pixel of the first plane. */
+    int			bits_per_pixel;	/*!< bits per pixel of all planes. */
+    int			h_shift;	/*!< log2 of horizontal chroma subsampling. */
+    int			v_shift;	/*!< log2 of vertical chroma subsampling. */
+    bool		yuv;		/*!< true for YCbCr, false for RGB. */
+    bool		native;		/*!< handled by the hardware without a CPU pass. */
+} shjpeg_pixelformat_info_t;
+
+/**
+ * \brief Rectangle
+ *
+ * A rectangle in an image, in pixels.
+ */
+
+typedef struct {
+    int		x;	/*!< left edge. */
+    int		y;	/*!< top edge. */
+    int		w;	/*!< width. */
+    int		h;	/*!< height. */
+} shjpeg_rect_t;
+
+/**
+ * \brief Orientation
+ *
+ * Orientation of the decoded image. The image is mirrored first, and
+ * then rotated clockwise. A rotation and flips may be combined.
+ */
+
+typedef enum {
+    SHJPEG_ROTATE_0	    = 0x00,	/*!< no rotation. */
+    SHJPEG_ROTATE_90	    = 0x01,	/*!< rotate 90 degrees. */
+    SHJPEG_ROTATE_180	    = 0x02,	/*!< rotate 180 degrees. */
+    SHJPEG_ROTATE_270	    = 0x03,	/*!< rotate 270 degrees. */
+    SHJPEG_FLIP_H	    = 0x04,	/*!< mirror horizontally. */
+    SHJPEG_FLIP_V	    = 0x08,	/*!< mirror vertically. */
+    SHJPEG_ORIENTATION_EXIF = 0x10,	/*!< use the orientation in EXIF. */
+} shjpeg_orientation;
+
+/**
+ * \brief Special restart intervals for encoding.
+ *
+ * Positive values of encode_restart_interval are the number of MCUs
+ * between restart markers.
+ */
+typedef enum {
+    SHJPEG_RESTART_NONE	   = -2,	//!< No restart markers.
+    SHJPEG_RESTART_MCU_ROW = -1,	//!< A restart marker per MCU row.
+    SHJPEG_RESTART_DEFAULT = 0,		//!< Every 512 MCUs.
+} shjpeg_restart_interval;
+
+/**
+ * \brief Flags for lossless optimization of encoded images.
+ */
+typedef enum {
+    SHJPEG_OPTIMIZE_HUFFMAN	= 0x1,	//!< Huffman tables for the image.
+    SHJPEG_OPTIMIZE_PROGRESSIVE = 0x2,	//!< Progressive JPEG (implies HUFFMAN).
+} shjpeg_optimize_flags;
+
+/**
+ * \brief Background optimizer, see shjpeg_optimizer_create().
+ */
+typedef struct shjpeg_optimizer_struct shjpeg_optimizer_t;
+
+/**
+ * \brief How a Motion JPEG encoder locks the JPU.
+ */
+typedef enum {
+    SHJPEG_MJPEG_LOCK_FRAME   = 0,	//!< Lock for each frame, and program JPU again.
+    SHJPEG_MJPEG_LOCK_SESSION = 1,	//!< Hold the lock until closed, and program JPU once.
+} shjpeg_mjpeg_lock;
+
+/**
+ * \brief Motion JPEG encoder, see shjpeg_mjpeg_open().
+ */
+typedef struct shjpeg_mjpeg_struct shjpeg_mjpeg_t;
+
+/**
+ * \brief Called when a background optimization is done.
+ *
+ * \param private user data passed to shjpeg_optimizer_submit().
+ * \param result 0 if success, otherwise -1.
+ * \param data optimized image, to be freed by free(3). NULL on failure.
+ * \param size size of the optimized image.
+ */
+typedef void (*shjpeg_optimize_done_t)(void	*private,
+				       int	 result,
+				       void	*data,
+				       size_t	 size);
+
+/**
+ * \brief Lossless transform of an encoded image
+ *
+ * Passed to shjpeg_transform(). The DCT blocks are moved rather than
+ * decoded, thus the crop region starts at an iMCU boundary, i.e. 8 or
+ * 16 pixels. Partial iMCUs at the right and bottom edges are dropped
+ * if the transform would move them into the image.
+ */
+
+typedef struct {
+    //! Orientation of the transformed image.
+    /*!
+      Mirroring and rotation as in decoding. SHJPEG_ORIENTATION_EXIF
+      uses the orientation in EXIF, which is reset to top left in the
+      transformed image.
+     */
+    shjpeg_orientation orientation;
+
+    //! Region of the transformed image to keep.
+    /*!
+      w or h of 0 keeps the whole image. x and y are rounded down to
+      the iMCU boundary, and the region grows to keep its right and
+      bottom edges.
+     */
+    shjpeg_rect_t crop;
+} shjpeg_transform_t;
+
+/**
+ * \brief Marker segment
+ *
+ * APPn or COM marker segment saved by decoding, or written by encoding
+ * right after SOI, e.g. EXIF or ICC profile.
+ */
+
+typedef struct {
+    //! Marker code, JPEG_APP0 to JPEG_APP0 + 15, or JPEG_COM.
+    int		 marker;
+
+    //! Data of the segment following the length field.
+    const void	*data;
+
+    //! Length of data in bytes, at most 65533.
+    unsigned int length;
+} shjpeg_marker_t;
+
+/**
+ * \brief Band of an image
+ *
+ * Describes the lines passed to the callback of shjpeg_decode_bands(),
+ * or the lines the callback of shjpeg_encode_bands() fills. The memory
+ * is owned by libshjpeg, and valid only during the call.
+ */
+
+typedef struct {
+    //! Pixel format of the band.
+    shjpeg_pixelformat format;
+
+    //! First line of the band in the image.
+    int		 y;
+
+    //! Width of the band in pixels.
+    int		 width;
+
+    //! Number of lines in the band.
+    int		 height;
+
+    //! Pitch of the band in bytes.
+    int		 pitch;
+
+    //! First line of the Y or RGB plane.
+    void	*addr;
+
+    //! First line of the CbCr plane for NV12 and NV16, otherwise NULL.
+    /*!
+      For NV12, the CbCr line of the first line of the band. The band
+      always starts on an even line.
+     */
+    void	*c_addr;
+
+    //! Physical address of addr, or 0 if the band is not contiguous memory.
+    unsigned long phys;
+
+    //! Physical address of c_addr, or 0.
+    unsigned long c_phys;
+} shjpeg_band_t;
+
+/**
+ * \brief Callback to receive or to fill the bands of an image
+ *
+ * \param [in] private user data passed to shjpeg_decode_bands() or
+ *	 shjpeg_encode_bands().
+ * \param [in] band lines decoded, or lines to fill for encoding.
+ * \return should return 0 to continue, otherwise non-zero value to abort.
+ */
+
+typedef int (*shjpeg_band_func)(void *private, const shjpeg_band_t *band);
+
+/**
+ * \brief Planes of a frame in physical memory
+ *
+ * Describes the frame passed to shjpeg_encode_frame() and
+ * shjpeg_decode_frame(), when the planes are not allocated back to
+ * back, e.g. V4L2 multi-planar buffers and DRM dumb buffers.
+ */
+
+typedef struct {
+    //! Physical address of the Y or RGB plane.
+    unsigned long phys;
+
+    //! Pitch of the Y or RGB plane in bytes.
+    int		 pitch;
+
+    //! Physical address of the CbCr plane, or 0 if it follows the Y plane.
+    /*!
+      Only NV12 and NV16 can have the CbCr plane elsewhere, other
+      formats must set 0.
+     */
+    unsigned long c_phys;
+
+    //! Pitch of the CbCr plane in bytes, or 0 for the pitch of the Y plane.
+    /*!
+      The JPU and VEU access both planes with one pitch, thus any other
+      value must be the pitch of the Y plane.
+     */
+    int		 c_pitch;
+} shjpeg_frame_t;
+
+/**
+ * \brief Output of shjpeg_decode_multi()
+ *
+ * One of the images written from a single decoding pass, e.g. a
+ * full size NV12 frame for the display and an RGB16 thumbnail.
+ */
+
+typedef struct {
+    //! Pixelformat of the output.
+    /*!
+      Only NV12, NV16, RGB16, RGB24 and RGB32 are supported.
+     */
+    shjpeg_pixelformat format;
+
+    //! Planes of the destination frame buffer.
+    shjpeg_frame_t frame;
+
+    //! Width of the destination frame buffer.
+    int		 width;
+
+    //! Height of the destination frame buffer.
+    int		 height;
+
+    //! Position of the image in the frame buffer.
+    int		 dst_x;
+    int		 dst_y;
+
+    //! Size of the image, or 0 for the size of the decoded region.
+    int		 resize_width;
+    int		 resize_height;
+} shjpeg_decode_output_t;
+
 /**
  * \brief a type definition for shjpeg_context_struct.
  */
@@ -115,6 +388,11 @@ typedef struct shjpeg_stream_ops_struct shjpeg_sops;
 struct shjpeg_stream_ops_struct {
     //! A method to init JPEG stream.
     /*!
+      Called once before the JPEG stream is read, and again only when
+      the software fallback has to restart from the beginning of the
+      stream. May be NULL for streams that cannot be rewound, e.g.
+      pipes or sockets.
+
       \param [in] private user data.
       \return should return 0 if success, otherwise non-zero value.
      */
@@ -145,6 +423,73 @@ struct shjpeg_stream_ops_struct {
     void (*finalize)(void *private);
 };
 
+/**
+ * \brief Encoded image
+ *
+ * Describes one of the images encoded by shjpeg_encode_multi().
+ */
+
+typedef struct {
+    //! Width of the encoded image. 0 means the width of the source region.
+    int		 width;
+
+    //! Height of the encoded image. 0 means the height of the source region.
+    int		 height;
+
+    //! Stream operations to write the image. NULL means the ones in the context.
+    shjpeg_sops	*sops;
+
+    //! User defined private data passed to sops.
+    void	*private;
+
+    //! Array to store the restart index of the image, or NULL.
+    /*!
+      restart_offsets[0] is the offset of the first byte of entropy
+      coded data, and restart_offsets[n] is the offset of the RSTn
+      marker starting the n-th restart interval. Offsets are counted
+      from the beginning of the image written to sops.
+     */
+    unsigned long *restart_offsets;
+
+    //! Number of entries restart_offsets can hold.
+    int		 max_restarts;
+
+    //! libshjpeg sets the number of entries in the restart index.
+    /*!
+      May exceed max_restarts, in which case only the first
+      max_restarts entries are stored.
+     */
+    int		 num_restarts;
+} shjpeg_encode_output_t;
+
+/**
+ * \brief Frame encoded by shjpeg_mjpeg_encode_frame()
+ */
+
+typedef struct {
+    //! Encoded image.
+    /*!
+      Owned by the encoder, and valid until the second next frame is
+      encoded, so that it can be sent while the next one is encoded.
+     */
+    const void	*data;
+
+    //! Size of the encoded image in bytes.
+    size_t	 size;
+
+    //! Timestamp passed to shjpeg_mjpeg_encode_frame().
+    int64_t	 timestamp;
+
+    //! Time taken to encode the frame in microseconds.
+    int64_t	 encode_time;
+
+    //! Number of the frame, counted from 0.
+    unsigned int sequence;
+
+    //! Quality the frame was encoded with.
+    int		 quality;
+} shjpeg_mjpeg_frame_t;
+
 /**
  * \brief a type definition for shjpeg_context_struct.
  */
@@ -186,8 +531,170 @@ struct shjpeg_context_struct {
     //! libshjpeg set this to non-zero, if decoding falled back to libjpeg.
     int		 libjpeg_used;
 
+    //! Scale denominator for decoding (1, 2, 4 or 8, 0 is same as 1).
+    /*!
+      The image is decoded at 1/scale_denom of its size by libjpeg
+      with reduced IDCT. Must be set before shjpeg_decode_init().
+     */
+    int		 scale_denom;
+
+    //! Width of the decoded image. 0 means the width of the image.
+    /*!
+      If resize_width or resize_height is set, the image is resized to
+      the given size while decoded. VEU resizes the output of JPU, thus
+      the full size image is never written to memory. Must be set
+      before shjpeg_decode_run().
+     */
+    int		 resize_width;
+
+    //! Height of the decoded image. 0 means the height of the image.
+    int		 resize_height;
+
+    //! Region of the image to decode. 0 width or height means the whole image.
+    /*!
+      Given in the size of the image reported by shjpeg_decode_init().
+      Only the region is decoded and written to the destination,
+      resized to resize_width x resize_height if set. x and y are
+      rounded down, and w and h are rounded up to even numbers. Must
+      be set before shjpeg_decode_run().
+     */
+    shjpeg_rect_t crop;
+
+    //! Horizontal position in the destination to place the decoded image.
+    /*!
+      dst_x and dst_y must be even for YCbCr formats.
+     */
+    int		 dst_x;
+
+    //! Vertical position in the destination to place the decoded image.
+    int		 dst_y;
+
+    //! Orientation of the decoded image.
+    /*!
+      The image is rotated and mirrored after cropping and resizing,
+      i.e. the width and the height of the destination are swapped
+      for 90 and 270 degrees. If SHJPEG_ORIENTATION_EXIF is set before
+      shjpeg_decode_init(), it is replaced with the orientation found
+      in the EXIF data of the image.
+     */
+    shjpeg_orientation orientation;
+
+    //! Save APPn and COM markers of the image while decoding.
+    /*!
+      Must be set before shjpeg_decode_init(), which stores the
+      markers in markers. If the EXIF orientation is applied, it's
+      reset to top left in the saved markers.
+     */
+    bool	 save_markers;
+
+    //! libshjpeg sets the markers of the image if save_markers is set.
+    /*!
+      Valid until shjpeg_decode_shutdown(). May be passed to
+      encode_markers as is.
+     */
+    shjpeg_marker_t *markers;
+
+    //! libshjpeg sets the number of entries in markers.
+    int		 num_markers;
+
+    //! Region of the source image to encode. 0 width or height means the whole image.
+    /*!
+      x and y are rounded down, and w and h are rounded up to even
+      numbers. Must be set before shjpeg_encode().
+     */
+    shjpeg_rect_t encode_crop;
+
+    //! Width of the encoded image. 0 means the width of encode_crop.
+    /*!
+      If encode_width or encode_height is set, VEU resizes the source
+      into the line buffers of JPU while encoding, thus the source is
+      read only once and the resized image is never written to memory.
+     */
+    int		 encode_width;
+
+    //! Height of the encoded image. 0 means the height of encode_crop.
+    int		 encode_height;
+
+    //! Quality of the encoded image, from 1 to 100.
+    /*!
+      The quantization tables are scaled the same way as libjpeg's
+      jpeg_set_quality() does. 0 keeps the fixed tables libshjpeg has
+      always used.
+     */
+    int		 encode_quality;
+
+    //! Base quantization tables for luma and chroma, or NULL.
+    /*!
+      Each table has 64 entries in natural (not zigzag) order and is
+      scaled by encode_quality. NULL selects the standard table from
+      Annex K of the JPEG specification. If a table is given while
+      encode_quality is 0, quality 50 (the table as is) is used.
+     */
+    const unsigned int *encode_quant_tables[2];
+
+    //! Target size of each encoded image in bytes, 0 to disable.
+    /*!
+      When encode_target_size or encode_bitrate is set, libshjpeg
+      chooses the quality for each image from the sizes of the
+      previous ones encoded with the context, starting from
+      encode_quality (or 75 if not set).
+     */
+    int		 encode_target_size;
+
+    //! Target bitrate in bits per second, 0 to disable.
+    /*!
+      Images larger than the budget are paid back by the following
+      ones, so that the average bitrate over about a second stays close
+      to the target. Requires encode_framerate.
+     */
+    int		 encode_bitrate;
+
+    //! Number of images encoded per second, used with encode_bitrate.
+    int		 encode_framerate;
+
+    //! Maximum number of re-encodes of an image exceeding the target.
+    /*!
+      If non-zero, the image is first encoded into an internal buffer
+      and written to sops only once its size is accepted.
+     */
+    int		 encode_max_retries;
+
+    //! libshjpeg sets the quality used for the last encoded image.
+    int		 encode_last_quality;
+
+    //! Restart interval of the encoded image in MCUs (up to 65535).
+    /*!
+      See shjpeg_restart_interval for the special values.
+     */
+    int		 encode_restart_interval;
+
+    //! Array to store the restart index by shjpeg_encode(), or NULL.
+    /*!
+      See restart_offsets of shjpeg_encode_output_t.
+     */
+    unsigned long *encode_restart_offsets;
+
+    //! Number of entries encode_restart_offsets can hold.
+    int		 encode_max_restarts;
+
+    //! libshjpeg sets the number of entries in the restart index.
+    int		 encode_num_restarts;
+
+    //! Markers written after SOI of each encoded image, or NULL.
+    /*!
+      Each segment is passed to sops in its own write, thus neither
+      the markers nor the coded data are copied. The data must be kept
+      while encoding.
+     */
+    const shjpeg_marker_t *encode_markers;
+
+    //! Number of entries in encode_markers.
+    int		 encode_num_markers;
+
     //! libshjpeg private data - verbose flag
     int		 verbose;
+    //! libshjpeg private data - rate control state of the stream
+    void	*encode_rc;
     //! libshjpeg private data - libjpeg compress context
     struct jpeg_compress_struct    jpeg_comp;
     //! libshjpeg private data - libjpeg compress context
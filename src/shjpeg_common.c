@@ -436,17 +436,17 @@ shjpeg_shutdown(shjpeg_context_t *context)
     uio_shutdown(&data);
 
     /* clean up */
-    if (context)
-	free(context);
-
-    if (!data.ref_count)
-	goto quit;
+    if (context) {
+	shjpeg_rc_t *rc = (shjpeg_rc_t*)context->encode_rc;
 
-    if (--data.ref_count)
-	goto quit;
+	if (rc)
+	    free(rc->buf);
+	free(rc);
+	free(context);
+    }
 
-quit:
-    return;
+    if (data.ref_count)
+	data.ref_count--;
 }
 
 /*
@@ -20,6 +20,10 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA	 02110-1301 USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -33,12 +37,631 @@
 #include <setjmp.h>
 
 #include <shjpeg/shjpeg.h>
+#include <jerror.h>
 #include "shjpeg_internal.h"
 #include "shjpeg_jpu.h"
 #include "shjpeg_veu.h"
+#include "shjpeg_format.h"
+#include "shjpeg_transform.h"
+
+/*
+ * libjpeg source manager
+ */
+
+#define SHJPEG_STREAM_BUF_SIZE    0x10000
+
+typedef struct {
+    struct jpeg_source_mgr  pub; /* public fields */
+    JOCTET		    *data;	 /* start of buffer */
+
+    /*
+     * Bytes read from the stream while parsing the header. They are
+     * replayed to the JPU, so that the stream is read only once.
+     */
+    JOCTET		    *header;	 /* captured bytes */
+    size_t		     header_len; /* number of bytes captured */
+    size_t		     header_size;/* size of the capture buffer */
+    size_t		     replay;	 /* number of bytes replayed */
+    boolean		     capture;	 /* true while parsing the header */
+    boolean		     consumed;	 /* true if read past the header */
+
+    /*
+     * The standard Huffman tables are inserted after SOI, when the
+     * stream has no DHT of its own.
+     */
+    boolean		     dht_missing;
+    size_t		     dht_replay; /* number of bytes of DHT replayed */
+
+    /*
+     * Stream offsets, to resume decoding from a restart marker after
+     * the JPU failed.
+     */
+    size_t		     offset;	 /* end of data read by libjpeg */
+    size_t		     hw_offset;	 /* end of data read for JPU */
+    size_t		     sof;	 /* SOF marker */
+    size_t		     scan_start; /* entropy coded data */
+    size_t		     scanned;	 /* end of data searched for RSTn */
+    boolean		     scanned_ff; /* last byte searched was 0xff */
+    size_t		    *restarts;	 /* RSTn markers found */
+    int			     num_restarts;
+    int			     max_restarts;
+    boolean		     restarts_lost; /* failed to record RSTn */
+
+    boolean		     resume;	 /* resume after resume_marker */
+    int			     resume_marker;
+    int			     resume_line;  /* first line to decode */
+    int			     resume_height;/* image height to patch in SOF */
+} shjpeg_stream_source_mgr;
+
+typedef shjpeg_stream_source_mgr * shjpeg_stream_src_ptr;
+
+/*
+ * Record the offset of an RSTn marker. Returns false if out of memory.
+ */
+
+static boolean
+decode_add_restart(shjpeg_stream_src_ptr src, size_t offset)
+{
+    if (src->num_restarts == src->max_restarts) {
+	int max = src->max_restarts ? src->max_restarts * 2 : 64;
+	size_t *restarts = realloc(src->restarts, max * sizeof(size_t));
+
+	if (!restarts) {
+	    src->restarts_lost = TRUE;
+	    return FALSE;
+	}
+
+	src->restarts     = restarts;
+	src->max_restarts = max;
+    }
+
+    src->restarts[src->num_restarts++] = offset;
+
+    return TRUE;
+}
+
+/*
+ * Record the offsets of RSTn markers in the entropy coded data.
+ */
+
+static void
+decode_find_restarts(shjpeg_stream_src_ptr	 src,
+		     const JOCTET		*buf,
+		     size_t			 base,
+		     size_t			 len)
+{
+    const JOCTET *p, *end = buf + len;
+
+    /* skip the header and data already searched */
+    if (base + len <= src->scanned || base + len <= src->scan_start)
+	return;
+
+    p = buf;
+    if (base < src->scanned)
+	p += src->scanned - base;
+    if (base + (p - buf) < src->scan_start) {
+	p = buf + (src->scan_start - base);
+	src->scanned_ff = FALSE;
+    }
+
+    /* marker split over two reads, 0xff ends the previous one */
+    if (src->scanned_ff && (*p & 0xf8) == JPEG_RST0) {
+	if (p > buf)
+	    p--;
+	else if (decode_add_restart(src, base - 1))
+	    p++;
+	else
+	    p = end;
+    }
+
+    while (p < end && (p = memchr(p, 0xff, end - p)) != NULL) {
+	if (++p == end)
+	    break;
+
+	if ((*p & 0xf8) != JPEG_RST0)
+	    continue;
+
+	if (!decode_add_restart(src, base + (p - buf) - 1))
+	    break;
+    }
+
+    src->scanned    = base + len;
+    src->scanned_ff = (buf[len - 1] == 0xff);
+}
+
+/*
+ * DHT segment with the standard Huffman tables of JPEG Annex K.3, for
+ * Motion JPEG frames that leave them out.
+ */
+
+static const JOCTET decode_std_dht[] = {
+    0xff, 0xc4, 0x01, 0xa2, 0x00, 0x00, 0x01, 0x05,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02,
+    0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,
+    0x0b, 0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02,
+    0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00,
+    0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11,
+    0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51,
+    0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91,
+    0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52,
+    0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09,
+    0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57,
+    0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77,
+    0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2,
+    0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8,
+    0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
+    0xf7, 0xf8, 0xf9, 0xfa, 0x01, 0x00, 0x03, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02,
+    0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,
+    0x0b, 0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04,
+    0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01,
+    0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04,
+    0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07,
+    0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14,
+    0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33,
+    0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16,
+    0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19,
+    0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36,
+    0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46,
+    0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56,
+    0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66,
+    0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76,
+    0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85,
+    0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94,
+    0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2,
+    0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+    0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+    0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8,
+    0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7,
+    0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
+    0xf7, 0xf8, 0xf9, 0xfa
+};
+
+/*
+ * Check if the tables used by the scan are defined, and if not, give
+ * the standard ones to libjpeg and have decode_read() insert them for
+ * the JPU. Tables defined by the stream are kept.
+ */
+
+static void
+decode_std_huff_tables(j_decompress_ptr cinfo)
+{
+    shjpeg_stream_src_ptr src = (shjpeg_stream_src_ptr)cinfo->src;
+    const JOCTET *p = decode_std_dht + 4;
+    const JOCTET *end = decode_std_dht + sizeof(decode_std_dht);
+    int i;
+
+    src->dht_missing = FALSE;
+    src->dht_replay  = 0;
+
+    if (cinfo->progressive_mode || cinfo->arith_code)
+	return;
+
+    for (i = 0; i < cinfo->comps_in_scan; i++) {
+	jpeg_component_info *comp = cinfo->cur_comp_info[i];
+
+	if (!cinfo->dc_huff_tbl_ptrs[comp->dc_tbl_no] ||
+	    !cinfo->ac_huff_tbl_ptrs[comp->ac_tbl_no])
+	    src->dht_missing = TRUE;
+    }
+
+    if (!src->dht_missing)
+	return;
+
+    D_DEBUG_AT(SH7722_JPEG, "  -> no DHT, using the standard tables");
+
+    while (p < end) {
+	JHUFF_TBL **tbl = (*p >> 4) ?
+	    &cinfo->ac_huff_tbl_ptrs[*p & 0x0f] :
+	    &cinfo->dc_huff_tbl_ptrs[*p & 0x0f];
+	int k, count = 0;
+
+	p++;
+	for (k = 0; k < 16; k++)
+	    count += p[k];
+
+	if (!*tbl) {
+	    *tbl = jpeg_alloc_huff_table((j_common_ptr)cinfo);
+	    (*tbl)->bits[0] = 0;
+	    memcpy(&(*tbl)->bits[1], p, 16);
+	    memcpy((*tbl)->huffval, p + 16, count);
+	}
+
+	p += 16 + count;
+    }
+}
+
+/*
+ * Read JPEG stream for the JPU. The bytes captured during
+ * shjpeg_decode_init() are returned first, and then the stream is
+ * read forward. Short reads are retried until the buffer is filled or
+ * the end of the stream is reached. The standard Huffman tables are
+ * inserted after SOI if the stream lacks them; they are not counted in
+ * hw_offset, which stays an offset in the stream.
+ */
+
+static int
+decode_read(shjpeg_context_t *context, size_t *nbytes, void *dataptr)
+{
+    shjpeg_stream_src_ptr src = (shjpeg_stream_src_ptr)context->jpeg_decomp.src;
+    JOCTET *buf = dataptr;
+    size_t len = 0, n;
+    boolean dht;
+    int ret;
+
+    while (len < *nbytes) {
+	n = *nbytes - len;
+	dht = src->dht_missing && (src->dht_replay < sizeof(decode_std_dht));
+
+	if (dht && (src->replay == 2)) {
+	    /* insert the tables */
+	    n = MIN(n, sizeof(decode_std_dht) - src->dht_replay);
+	    memcpy(buf + len, decode_std_dht + src->dht_replay, n);
+	    src->dht_replay += n;
+	    len += n;
+	    continue;
+	}
+
+	if (src->replay < src->header_len) {
+	    /* replay the header, up to SOI if the tables follow */
+	    n = MIN(n, (dht ? 2 : src->header_len) - src->replay);
+	    memcpy(buf + len, src->header + src->replay, n);
+	    src->replay += n;
+	}
+	else {
+	    /* and then continue reading */
+	    src->consumed = TRUE;
+	    ret = context->sops->read(context->private, &n, buf + len);
+	    if (ret) {
+		if (!len) {
+		    *nbytes = 0;
+		    return ret;
+		}
+		break;
+	    }
+
+	    if (!n)
+		break;
+	}
+
+	if (context->jpeg_decomp.restart_interval)
+	    decode_find_restarts(src, buf + len, src->hw_offset, n);
+	src->hw_offset += n;
+	len += n;
+    }
+
+    *nbytes = len;
+
+    return 0;
+}
+
+/*
+ * Find the line from which decoding could be resumed after the JPU
+ * stopped with an error. Restart intervals which end before the
+ * consumed data are known to be decoded, and the first one that starts
+ * on an MCU row boundary is chosen. If the number of lines written is
+ * known, as in the line buffer mode, the result does not exceed it.
+ *
+ * Returns 0 if the whole image has to be decoded again.
+ */
+
+static int
+decode_resume_line(shjpeg_context_t *context, size_t consumed, int lines)
+{
+    j_decompress_ptr cinfo = &context->jpeg_decomp;
+    shjpeg_stream_src_ptr src = (shjpeg_stream_src_ptr)cinfo->src;
+    int mcu_width, mcu_height, mcus_per_row, i;
+
+    if (!cinfo->restart_interval || cinfo->progressive_mode ||
+	cinfo->comps_in_scan != cinfo->num_components || src->restarts_lost)
+	return 0;
+
+    if (cinfo->comps_in_scan == 1) {
+	jpeg_component_info *comp = cinfo->cur_comp_info[0];
+
+	mcu_width  = DCTSIZE * cinfo->max_h_samp_factor / comp->h_samp_factor;
+	mcu_height = DCTSIZE * cinfo->max_v_samp_factor / comp->v_samp_factor;
+    } else {
+	mcu_width  = DCTSIZE * cinfo->max_h_samp_factor;
+	mcu_height = DCTSIZE * cinfo->max_v_samp_factor;
+    }
+    mcus_per_row = (cinfo->image_width + mcu_width - 1) / mcu_width;
+
+    /* intervals 0..i-1 end before the consumed data */
+    for (i = 0; i < src->num_restarts && src->restarts[i] < consumed; i++)
+	;
+
+    for (; i > 0; i--) {
+	long mcu = (long)i * cinfo->restart_interval;
+	int line = (mcu / mcus_per_row) * mcu_height;
+
+	if ((mcu % mcus_per_row) || (line >= cinfo->image_height))
+	    continue;
+
+	if ((lines >= 0) && (line > lines))
+	    continue;
+
+	src->resume_marker = i - 1;
+	src->resume_height = cinfo->image_height - line;
+
+	D_INFO("libshjpeg: resume from line %d (RST #%d at %d)",
+	       line, i - 1, src->restarts[i - 1]);
+
+	return line;
+    }
+
+    return 0;
+}
+
+/*
+ * Get the region of the image to decode, rounded to even pixels and
+ * clipped to the image. Returns true if it's not the whole image.
+ */
+
+static bool
+decode_region(shjpeg_context_t *context, shjpeg_rect_t *rect)
+{
+    shjpeg_rect_t *crop = &context->crop;
+
+    if ((crop->w <= 0) || (crop->h <= 0)) {
+	rect->x = 0;
+	rect->y = 0;
+	rect->w = context->width;
+	rect->h = context->height;
+	return false;
+    }
+
+    rect->x = MAX(crop->x, 0) & ~1;
+    rect->y = MAX(crop->y, 0) & ~1;
+    rect->w = MIN((crop->x + crop->w + 1) & ~1, context->width)  - rect->x;
+    rect->h = MIN((crop->y + crop->h + 1) & ~1, context->height) - rect->y;
+
+    return true;
+}
+
+/*
+ * Break down the orientation into mirroring, and rotation by 90
+ * degrees applied after it. Returns true if rotated.
+ */
+
+static bool
+decode_orientation(shjpeg_context_t *context, bool *hflip, bool *vflip)
+{
+    shjpeg_orientation orientation = context->orientation;
+
+    *hflip = (orientation & SHJPEG_FLIP_H) != 0;
+    *vflip = (orientation & SHJPEG_FLIP_V) != 0;
+
+    /* 180 degrees is same as mirroring in both directions */
+    if (orientation & SHJPEG_ROTATE_180) {
+	*hflip = !*hflip;
+	*vflip = !*vflip;
+    }
+
+    return (orientation & SHJPEG_ROTATE_90) != 0;
+}
+
+/*
+ * Get the size of the decoded image.
+ */
+
+static void
+decode_output_size(shjpeg_context_t *context, int *width, int *height)
+{
+    shjpeg_rect_t rect;
+
+    decode_region(context, &rect);
+
+    *width  = context->resize_width  ? context->resize_width  : rect.w;
+    *height = context->resize_height ? context->resize_height : rect.h;
+}
+
+/*
+ * Band output of shjpeg_decode_bands(). The JPU path converts each
+ * line buffer to one of two band buffers in the contiguous memory,
+ * and libjpeg fills a band buffer of its own.
+ */
+
+typedef struct {
+    shjpeg_band_func	 func;
+    void		*private;
+    shjpeg_band_t	 band;		/* format, width and pitch */
+    void		*virt;		/* band buffers for the JPU */
+    unsigned long	 phys;
+    int			 size;		/* size of a band buffer */
+    int			 c_offset;	/* offset of the CbCr plane */
+    int			 lines;		/* lines passed so far */
+    int			 error;		/* func failed */
+} decode_band_t;
+
+/*
+ * Pass the lines y to y + h - 1 to the callback, except the ones
+ * already passed before the JPU failed.
+ */
+
+static void
+decode_band_pass(decode_band_t	*b,
+		 int		 y,
+		 int		 h,
+		 void		*addr,
+		 void		*c_addr,
+		 unsigned long	 phys,
+		 unsigned long	 c_phys)
+{
+    shjpeg_band_t *band = &b->band;
+    int skip = b->lines - y;
+    int c_skip;
+
+    if (b->error || (y + h <= b->lines))
+	return;
+
+    if (skip > 0) {
+	c_skip = ((band->format == SHJPEG_PF_NV12) ? skip / 2 : skip) *
+	    band->pitch;
+
+	addr  += skip * band->pitch;
+	phys  += phys ? skip * band->pitch : 0;
+	c_addr = c_addr ? c_addr + c_skip : NULL;
+	c_phys = c_phys ? c_phys + c_skip : 0;
+	y     += skip;
+	h     -= skip;
+    }
+
+    band->y	 = y;
+    band->height = h;
+    band->addr	 = addr;
+    band->c_addr = c_addr;
+    band->phys	 = phys;
+    band->c_phys = c_phys;
+
+    if (b->func(b->private, band))
+	b->error = 1;
+
+    b->lines = y + h;
+}
+
+/*
+ * Called by the state machine for each line buffer converted by VEU.
+ * Returns non-zero if the callback asked to stop.
+ */
+
+static int
+decode_hw_band(void *private, int buf, int y, int h)
+{
+    decode_band_t *b = (decode_band_t*)private;
+    int offset = buf * b->size;
+    bool nv = (b->band.format == SHJPEG_PF_NV12 ||
+	       b->band.format == SHJPEG_PF_NV16);
+
+    decode_band_pass(b, y, h, b->virt + offset,
+		     nv ? b->virt + offset + b->c_offset : NULL,
+		     b->phys + offset,
+		     nv ? b->phys + offset + b->c_offset : 0);
+
+    return b->error;
+}
+
+/*
+ * Outputs of shjpeg_decode_multi(). The JPU path converts each line
+ * buffer once for each output, and libjpeg writes each decoded line
+ * to all of them.
+ */
+
+typedef struct {
+    const shjpeg_decode_output_t *outputs;
+    int			    num_outputs;
+    shjpeg_jpu_output_t	   *jpu;	/* VEU settings of each output */
+    shjpeg_map_t	   *maps;	/* Y and CbCr planes of each output */
+} decode_multi_t;
+
+/*
+ * Get the addresses of the top left corner of the image placed at
+ * (x, y) in the frame.
+ */
+
+static void
+decode_hw_dest(shjpeg_pixelformat format, unsigned long phys,
+	       unsigned long c_phys, int pitch, int x, int y,
+	       u32 *yaddr, u32 *caddr)
+{
+    *yaddr = phys + y * pitch + x * SHJPEG_PF_PITCH_MULTIPLY(format);
+    *caddr = c_phys + x + ((format == SHJPEG_PF_NV12) ? y / 2 : y) * pitch;
+}
+
+/*
+ * Set up VEU to convert the region rect of the image decoded by the
+ * JPU into the destination at yaddr and caddr, and the settings to
+ * place each line buffer on its own.
+ */
+
+static void
+decode_hw_veu(shjpeg_context_t		*context,
+	      shjpeg_pixelformat	 format,
+	      const shjpeg_rect_t	*rect,
+	      int			 out_width,
+	      int			 out_height,
+	      u32			 yaddr,
+	      u32			 caddr,
+	      int			 pitch,
+	      shjpeg_jpu_output_t	*output)
+{
+    const shjpeg_format_t *fmt = shjpeg_format_get(format);
+    shjpeg_veu_t      *veu  = &output->veu;
+    shjpeg_jpu_crop_t *crop = &output->crop;
+    bool rotate, hflip, vflip;
+    u32 vtrcr = 0;
+
+    memset(output, 0, sizeof(*output));
+
+    if (!context->mode420)
+	vtrcr |= (1 << 14);
+
+    /* GRAY8 is not converted by VEU, and has no settings */
+    vtrcr |= fmt->vtrcrout;
+    vtrcr |= (0x1 << 2);
+
+    rotate = decode_orientation(context, &hflip, &vflip);
+
+    /* source */
+    veu->src.width	= rect->w;
+    veu->src.height	= rect->h;
+    veu->src.pitch	= SHJPEG_JPU_LINEBUFFER_PITCH;
+
+    /* destination */
+    veu->dst.width	= out_width;
+    veu->dst.height	= out_height;
+    veu->dst.pitch	= pitch;
+    veu->dst.yaddr	= yaddr;
+    veu->dst.caddr	= caddr;
+
+    /* transformation parameter */
+    veu->vbssr		= SHJPEG_JPU_LINEBUFFER_HEIGHT;
+    veu->vtrcr		= vtrcr;
+    veu->vrfcr		= 
+	(shjpeg_veu_resize_factor(rect->h, out_height) << 16) |
+	shjpeg_veu_resize_factor(rect->w, out_width);
+    veu->vswpr		= fmt->vswpout | 7;
+    veu->vfmcr		= (rotate ? VEU_VFMCR_ROT90 : 0) |
+			  (hflip  ? VEU_VFMCR_HMIR  : 0) |
+			  (vflip  ? VEU_VFMCR_VMIR  : 0);
+
+    /* each line buffer placed on its own */
+    crop->x		= rect->x;
+    crop->y		= rect->y;
+    crop->w		= rect->w;
+    crop->h		= rect->h;
+    crop->out_w		= out_width;
+    crop->out_h		= out_height;
+    crop->yaddr		= yaddr;
+    crop->caddr		= caddr;
+    crop->pitch		= pitch;
+    crop->bpp		= SHJPEG_PF_PITCH_MULTIPLY(format);
+    crop->rotate	= rotate;
+    crop->vflip		= vflip;
+    crop->c_shift	= (format == SHJPEG_PF_NV12);
+    crop->lb_c_shift	= context->mode420;
+}
+
+static int decode_tiled(shjpeg_internal_t *data, shjpeg_context_t *context,
+			shjpeg_pixelformat format, unsigned long phys,
+			unsigned long c_phys, int width, int height, int pitch);
 
 /*
- * Decode using H/W
+ * Decode using H/W. c_phys is the address of the CbCr plane. If multi
+ * is given, the image is converted to each of its outputs instead.
  */
 
 static int
@@ -46,16 +669,29 @@ decode_hw(shjpeg_internal_t	*data,
 	  shjpeg_context_t	*context,
 	  shjpeg_pixelformat	 format,
 	  unsigned long	 	 phys,
+	  unsigned long	 	 c_phys,
 	  int			 width,
 	  int			 height, 
-	  int			 pitch)
+	  int			 pitch,
+	  decode_band_t		*band,
+	  decode_multi_t	*multi)
 {
-    int			ret;
-    unsigned int	len;
+    int			ret, i;
+    size_t		len;
+    size_t		filled[2] = { 0, 0 };
+    size_t		consumed  = 0;
     bool		reload = false;
     shjpeg_jpu_t	jpeg;
-    u32		    	vtrcr   = 0;
-    u32		    	vswpout = 0;
+    shjpeg_stream_src_ptr src = (shjpeg_stream_src_ptr)context->jpeg_decomp.src;
+    u32			yaddr, caddr;
+    const shjpeg_format_t *fmt;
+    int			out_width, out_height;
+    int			denom;
+    bool		resize, crop;
+    bool		rotate, hflip, vflip, orient;
+    bool		direct;
+    shjpeg_rect_t	rect;
+    j_decompress_ptr	cinfo = &context->jpeg_decomp;
 
     D_ASSERT( data != NULL );
 
@@ -64,48 +700,112 @@ decode_hw(shjpeg_internal_t	*data,
 	       data, phys, pitch, context->width, context->height, format);
 
     /* Init VEU transformation control (format conversion). */
-    if (!context->mode420)
-	vtrcr |= (1 << 14);
-
-    switch (format) {
-    case SHJPEG_PF_NV12:
-	vswpout = 0x70;
-	break;
+    fmt = shjpeg_format_get(format);
+    if (!fmt || (fmt->base != format)) {
+	D_BUG("unexpected format %08x", format);
+	return -1;
+    }
 
-    case SHJPEG_PF_NV16:
-	vswpout = 0x70;
-	vtrcr	 |= (1 << 22);
-	break;
+    /*
+     * JPU always decodes at the original size, and VEU crops and
+     * resizes it. The region is given in the scaled image.
+     */
+    decode_region(context, &rect);
+    decode_output_size(context, &out_width, &out_height);
+
+    denom  = context->scale_denom ? context->scale_denom : 1;
+    rect.x = rect.x * denom;
+    rect.y = rect.y * denom;
+    rect.w = MIN(rect.w * denom, cinfo->image_width  - rect.x);
+    rect.h = MIN(rect.h * denom, cinfo->image_height - rect.y);
+
+    crop   = (rect.w != cinfo->image_width || rect.h != cinfo->image_height);
+    resize = (out_width != rect.w || out_height != rect.h);
+    rotate = decode_orientation(context, &hflip, &vflip);
+    orient = (rotate || hflip || vflip);
+
+    if (resize &&
+	(!shjpeg_veu_can_resize(rect.w, out_width) ||
+	 !shjpeg_veu_can_resize(rect.h, out_height))) {
+	D_ERROR("libshjpeg: VEU can't resize %dx%d to %dx%d.",
+		rect.w, rect.h, out_width, out_height);
+	return -1;
+    }
 
-    case SHJPEG_PF_RGB16:
-	vswpout = 0x60;
-	vtrcr	 |= (6 << 16) | 2;
-	break;
+    /*
+     * GRAY8 is decoded without VEU. JPU writes the Y plane of each
+     * line buffer straight to the destination, and the chroma to the
+     * line buffer. As JPU writes whole MCUs, the destination must hold
+     * the image padded to 16 pixels in both directions.
+     */
+    if ((format == SHJPEG_PF_GRAY8) &&
+	(resize || crop || orient || band || multi ||
+	 ((context->dst_x | pitch) & 0x7) ||
+	 (pitch * (context->mode420 ? 8 : 16) > SHJPEG_JPU_LINEBUFFER_SIZE_Y) ||
+	 (context->dst_x + ((cinfo->image_width  + 15) & ~15) > pitch) ||
+	 (context->dst_y + ((cinfo->image_height + 15) & ~15) > height))) {
+	D_INFO("libshjpeg: JPU can't decode to GRAY8 here.");
+	return -1;
+    }
 
-    case SHJPEG_PF_RGB32:
-	vswpout = 0x40;
-	vtrcr	 |= (19 << 16) | 2;
-	break;
+    /* JPU writes directly only 8 bytes aligned */
+    direct = (!resize && !crop && !orient && !band && !multi &&
+	      !(context->dst_x & 0x7) &&
+	      ((context->mode420 && format == SHJPEG_PF_NV12) ||
+	       (!context->mode420 && format == SHJPEG_PF_NV16)));
 
-    case SHJPEG_PF_RGB24:
-	vswpout = 0x70;
-	vtrcr	 |= (21 << 16) | 2;
-	break;
+    /*
+     * Line buffers for VEU hold at most SHJPEG_JPU_LINEBUFFER_PITCH
+     * pixels. Wider images are decoded in vertical strips.
+     */
+    if (!direct && (format != SHJPEG_PF_GRAY8) &&
+	(cinfo->image_width > SHJPEG_JPU_LINEBUFFER_PITCH)) {
+	if (band || multi) {
+	    D_INFO("libshjpeg: JPU can't decode %d pixels wide image %s.",
+		   cinfo->image_width, band ? "in bands" : "to many outputs");
+	    return -1;
+	}
 
-    default:
-	D_BUG("unexpected format %08x", format);
-	return -1;
+	return decode_tiled(data, context, format, phys, c_phys,
+			    width, height, pitch);
     }
 
-    vtrcr |= (0x1 << 2);
+    /* Calculate destination address of the top left corner. */
+    if (band) {
+	yaddr = band->phys;
+	caddr = band->phys + band->c_offset;
+    } else
+	decode_hw_dest(format, phys, c_phys, pitch,
+		       context->dst_x, context->dst_y, &yaddr, &caddr);
+
+    /*
+     * Every output is converted from the region decoded by the JPU at
+     * its own size and place.
+     */
+    for (i = 0; multi && (i < multi->num_outputs); i++) {
+	const shjpeg_decode_output_t *output = &multi->outputs[i];
+	int w = output->resize_width  ? output->resize_width  : out_width;
+	int h = output->resize_height ? output->resize_height : out_height;
+	u32 y_addr, c_addr;
+
+	if (!shjpeg_veu_can_resize(rect.w, w) ||
+	    !shjpeg_veu_can_resize(rect.h, h)) {
+	    D_INFO("libshjpeg: VEU can't resize %dx%d to %dx%d.",
+		   rect.w, rect.h, w, h);
+	    return -1;
+	}
 
-    /* Calculate destination base address. */
-    // phys += rect->x + rect->y * pitch;
+	decode_hw_dest(output->format, output->frame.phys,
+		       output->frame.c_phys, output->frame.pitch,
+		       output->dst_x, output->dst_y, &y_addr, &c_addr);
+	decode_hw_veu(context, output->format, &rect, w, h, y_addr, c_addr,
+		      output->frame.pitch, &multi->jpu[i]);
+    }
 
     D_DEBUG_AT( SH7722_JPEG, "	 -> locking JPU..." );
 
     /* Locking JPU using lockf(3) */
-    if (lockf(data->jpu_uio_fd, F_LOCK, 0) < 0) {
+    if (!data->jpu_held && lockf(data->jpu_uio_fd, F_LOCK, 0) < 0) {
 	D_PERROR( "libshjpeg: Could not lock JPEG engine!" );
 	return -1;
     }
@@ -119,15 +819,17 @@ decode_hw(shjpeg_internal_t	*data,
     }
 
     len = SHJPEG_JPU_RELOAD_SIZE;
-    ret = context->sops->read(context->private, &len, (void*)data->jpeg_virt);
+    ret = decode_read(context, &len, (void*)data->jpeg_virt);
     if (ret) {
 	D_DERROR( ret, "libshjpeg: Could not fill first reload buffer!" );
-	if (lockf( data->jpu_uio_fd, F_ULOCK, 0 ) < 0) {
+	if (!data->jpu_held && lockf( data->jpu_uio_fd, F_ULOCK, 0 ) < 0) {
 	    D_PERROR("libshjpeg: unlock UIO failed.");
 	}
 	return -1;
     }
 
+    filled[0] = src->hw_offset;
+
     D_DEBUG_AT( SH7722_JPEG, "	 -> %d/%dbytes filled", 
 		len, SHJPEG_JPU_RELOAD_SIZE );
     D_DEBUG_AT( SH7722_JPEG, "	 -> setting..." );
@@ -158,9 +860,7 @@ decode_hw(shjpeg_internal_t	*data,
 			data->jpeg_phys + SHJPEG_JPU_RELOAD_SIZE );
     shjpeg_jpu_setreg32(data, JPU_JIFDDRSZ,len & 0x00FFFF00 );
 
-    if ((context->mode420 && format == SHJPEG_PF_NV12) ||
-	(!context->mode420 && format == SHJPEG_PF_NV16))
-    {
+    if (direct) {
 	/* Setup JPU for decoding in frame mode (directly to surface). */
 	shjpeg_jpu_setreg32(data, JPU_JINTE,
 			    JPU_JINTS_INS5_ERROR | JPU_JINTS_INS6_DONE |
@@ -169,16 +869,17 @@ decode_hw(shjpeg_internal_t	*data,
 			    JPU_JIFDCNT_SWAP_4321 | 
 			    (reload ? JPU_JIFDCNT_RELOAD_ENABLE : 0));
 
-	shjpeg_jpu_setreg32(data, JPU_JIFDDYA1, phys);
-	shjpeg_jpu_setreg32(data, JPU_JIFDDCA1, phys + pitch * height);
+	shjpeg_jpu_setreg32(data, JPU_JIFDDYA1, yaddr);
+	shjpeg_jpu_setreg32(data, JPU_JIFDDCA1, caddr);
 	shjpeg_jpu_setreg32(data, JPU_JIFDDMW,  pitch);
     }
-    else {
-	shjpeg_veu_t veu;
-
-	jpeg.flags |= SHJPEG_JPU_FLAG_CONVERT;
+    else if (format == SHJPEG_PF_GRAY8) {
+	/*
+	 * Setup JPU for decoding in line buffer mode, with the Y plane
+	 * of the line buffers moved along the destination.
+	 */
+	jpeg.flags |= SHJPEG_JPU_FLAG_CONVERT | SHJPEG_JPU_FLAG_DIRECT;
 
-	/* Setup JPU for decoding in line buffer mode. */
 	shjpeg_jpu_setreg32(data, JPU_JINTE,
 			    JPU_JINTS_INS5_ERROR | JPU_JINTS_INS6_DONE |
 			    JPU_JINTS_INS11_LINEBUF0 | 
@@ -191,37 +892,76 @@ decode_hw(shjpeg_internal_t	*data,
 			    JPU_JIFDCNT_SWAP_4321 | 
 			    (reload ? JPU_JIFDCNT_RELOAD_ENABLE : 0) );
 
-	shjpeg_jpu_setreg32( data, JPU_JIFDDYA1, data->jpeg_lb1 );
-	shjpeg_jpu_setreg32( data, JPU_JIFDDCA1, 
-			     data->jpeg_lb1 + SHJPEG_JPU_LINEBUFFER_SIZE_Y );
-	shjpeg_jpu_setreg32( data, JPU_JIFDDYA2, data->jpeg_lb2 );
-	shjpeg_jpu_setreg32( data, JPU_JIFDDCA2, 
-			     data->jpeg_lb2 + SHJPEG_JPU_LINEBUFFER_SIZE_Y );
-	shjpeg_jpu_setreg32( data, JPU_JIFDDMW,  
-			     SHJPEG_JPU_LINEBUFFER_PITCH );
+	shjpeg_jpu_setreg32(data, JPU_JIFDDYA1, yaddr);
+	shjpeg_jpu_setreg32(data, JPU_JIFDDCA1, 
+			    data->jpeg_lb1 + SHJPEG_JPU_LINEBUFFER_SIZE_Y);
+	shjpeg_jpu_setreg32(data, JPU_JIFDDYA2, 
+			    yaddr + SHJPEG_JPU_LINEBUFFER_HEIGHT * pitch);
+	shjpeg_jpu_setreg32(data, JPU_JIFDDCA2, 
+			    data->jpeg_lb2 + SHJPEG_JPU_LINEBUFFER_SIZE_Y);
+	shjpeg_jpu_setreg32(data, JPU_JIFDDMW,  pitch);
 
-	/* Setup VEU for conversion/scaling (from line buffer to surface). */
-	memset((void*)&veu, 0, sizeof(shjpeg_veu_t));
+	jpeg.crop.yaddr = yaddr;
+	jpeg.crop.pitch = pitch;
+	jpeg.crop.out_h = cinfo->image_height;
+    }
+    else {
+	shjpeg_jpu_output_t output;
+
+	jpeg.flags |= SHJPEG_JPU_FLAG_CONVERT;
+
+	/* Setup JPU for decoding in line buffer mode. */
+	shjpeg_jpu_setreg32(data, JPU_JINTE,
+			    JPU_JINTS_INS5_ERROR | JPU_JINTS_INS6_DONE |
+			    JPU_JINTS_INS11_LINEBUF0 | 
+			    JPU_JINTS_INS12_LINEBUF1 |
+			    (reload ? JPU_JINTS_INS14_RELOAD : 0));
+
+	shjpeg_jpu_setreg32(data, JPU_JIFDCNT, 
+			    JPU_JIFDCNT_LINEBUF_MODE | 
+			    (SHJPEG_JPU_LINEBUFFER_HEIGHT << 16) |
+			    JPU_JIFDCNT_SWAP_4321 | 
+			    (reload ? JPU_JIFDCNT_RELOAD_ENABLE : 0) );
 
-	/* source */
-	veu.src.width	= context->width;
-	veu.src.height	= context->height;
-	veu.src.pitch	= SHJPEG_JPU_LINEBUFFER_PITCH;
+	shjpeg_jpu_setreg32( data, JPU_JIFDDYA1, data->jpeg_lb1 );
+	shjpeg_jpu_setreg32( data, JPU_JIFDDCA1, 
+			     data->jpeg_lb1 + SHJPEG_JPU_LINEBUFFER_SIZE_Y );
+	shjpeg_jpu_setreg32( data, JPU_JIFDDYA2, data->jpeg_lb2 );
+	shjpeg_jpu_setreg32( data, JPU_JIFDDCA2, 
+			     data->jpeg_lb2 + SHJPEG_JPU_LINEBUFFER_SIZE_Y );
+	shjpeg_jpu_setreg32( data, JPU_JIFDDMW,  
+			     SHJPEG_JPU_LINEBUFFER_PITCH );
 
-	/* destination */
-	veu.dst.width	= context->width;
-	veu.dst.height	= context->height;
-	veu.dst.pitch	= pitch;
-	veu.dst.yaddr	= phys;
-	veu.dst.caddr	= phys + pitch * height;
+	/* Setup VEU for conversion/scaling (from line buffer to surface). */
+	decode_hw_veu(context, format, &rect, out_width, out_height,
+		      yaddr, caddr, pitch, &output);
+	shjpeg_veu_init(data, &output.veu);
+
+	/*
+	 * When cropping, each line buffer inside the region is
+	 * converted on its own, and the others are dropped. Also
+	 * mirrored or rotated line buffers are placed one by one, and
+	 * bands are passed one by one.
+	 */
+	if (crop || orient || band) {
+	    jpeg.flags		   |= SHJPEG_JPU_FLAG_CROP;
+	    jpeg.crop		    = output.crop;
+	}
 
-	/* transformation parameter */
-	veu.vbssr	= SHJPEG_JPU_LINEBUFFER_HEIGHT;
-	veu.vtrcr	= vtrcr;
-	veu.vswpr	= vswpout | 7;
+	/* VEU is set up again for each output */
+	if (multi) {
+	    jpeg.flags		   |= SHJPEG_JPU_FLAG_MULTI;
+	    jpeg.outputs	    = multi->jpu;
+	    jpeg.num_outputs	    = multi->num_outputs;
+	    jpeg.output		    = 0;
+	}
 
-	/* set VEU */
-	shjpeg_veu_init(data, &veu);
+	if (band) {
+	    jpeg.flags		   |= SHJPEG_JPU_FLAG_BAND;
+	    jpeg.crop.band_size	    = band->size;
+	    jpeg.band		    = decode_hw_band;
+	    jpeg.band_private	    = band;
+	}
     }
 
     D_DEBUG_AT( SH7722_JPEG, "	 -> starting..." );
@@ -244,6 +984,14 @@ decode_hw(shjpeg_internal_t	*data,
 	    if (jpeg.error) {
 		D_ERROR( "libshjpeg: ERROR 0x%x!\n", jpeg.error );
 		ret = -1;
+
+		/* find out how far the JPU got */
+		if (!resize && !crop && !orient && !band && !multi)
+		    src->resume_line = 
+			decode_resume_line(context, consumed,
+					   (jpeg.flags & SHJPEG_JPU_FLAG_CONVERT) ?
+					   data->jpeg_line : -1);
+		src->resume = (src->resume_line > 0);
 	    }
 	    
 	    break;
@@ -257,10 +1005,13 @@ decode_hw(shjpeg_internal_t	*data,
 
 		    D_ASSERT( reload );
 
+		    /* the JPU is done with the data in this buffer */
+		    consumed = MAX(consumed, filled[i-1]);
+
 		    len = SHJPEG_JPU_RELOAD_SIZE;
 		    ptr = (void*)data->jpeg_virt + 
 			(i-1) * SHJPEG_JPU_RELOAD_SIZE;
-		    ret = context->sops->read(context->private, &len, ptr);
+		    ret = decode_read(context, &len, ptr);
 		    if (ret) {
 			D_DERROR(ret, 
 				 "libshjpeg: Can't fill %s reload buffer!\n",
@@ -271,6 +1022,8 @@ decode_hw(shjpeg_internal_t	*data,
 		    else if (len < SHJPEG_JPU_RELOAD_SIZE)
 			jpeg.flags &= ~SHJPEG_JPU_FLAG_RELOAD;
 
+		    filled[i-1] = src->hw_offset;
+
 		    D_DEBUG_AT(SH7722_JPEG, "libshjpeg: %d/%dbytes filled\n",
 			       len, SHJPEG_JPU_RELOAD_SIZE);
 		}
@@ -281,7 +1034,7 @@ decode_hw(shjpeg_internal_t	*data,
     }
 
     /* Unlocking JPU using lockf(3) */
-    if ( lockf( data->jpu_uio_fd, F_ULOCK, 0 ) < 0 ) {
+    if ( !data->jpu_held && lockf( data->jpu_uio_fd, F_ULOCK, 0 ) < 0 ) {
 	D_PERROR( "libshjpeg: Could not unlock JPEG engine!" );
 	ret = -1;
     }
@@ -290,6 +1043,205 @@ decode_hw(shjpeg_internal_t	*data,
 }
 
 
+/*
+ * Stream operations for the strips of a tiled image. A strip is
+ * replayed as a whole from the capture buffer, and nothing follows.
+ */
+
+static int
+tile_read(void *private, size_t *nbytes, void *dataptr)
+{
+    *nbytes = 0;
+    return 0;
+}
+
+static shjpeg_sops tile_sops = {
+    .init     = NULL,
+    .read     = tile_read,
+    .write    = NULL,
+    .finalize = NULL,
+};
+
+/*
+ * Decode an image wider than the line buffers in vertical strips. The
+ * whole stream is read, and each strip is cut out of it at the restart
+ * markers, so every MCU row must consist of whole restart intervals.
+ * The strip gets its own width in SOF and renumbered RSTn markers, and
+ * is decoded by the JPU at its offset in the destination.
+ *
+ * Returns -1 if the image can't be split, to fall back to libjpeg.
+ */
+
+static int
+decode_tiled(shjpeg_internal_t	*data,
+	     shjpeg_context_t	*context,
+	     shjpeg_pixelformat	 format,
+	     unsigned long	 phys,
+	     unsigned long	 c_phys,
+	     int		 width,
+	     int		 height,
+	     int		 pitch)
+{
+    j_decompress_ptr	cinfo = &context->jpeg_decomp;
+    shjpeg_stream_src_ptr src = (shjpeg_stream_src_ptr)cinfo->src;
+    shjpeg_stream_source_mgr saved;
+    shjpeg_sops		*sops = context->sops;
+    JOCTET		*buf = NULL, *strip = NULL;
+    size_t		 len = 0, size = 0, eoi, pos, n;
+    int			 image_width = cinfo->image_width;
+    int			 context_width = context->width;
+    int			 dst_x = context->dst_x;
+    int			 mcu_width, mcu_height, mcus_per_row, mcu_rows;
+    int			 interval, intervals_per_row, strip_mcus, x;
+    int			 out_width, out_height;
+    bool		 hflip, vflip;
+    shjpeg_rect_t	 rect;
+    int			 ret = -1;
+
+    mcu_width	 = DCTSIZE * cinfo->max_h_samp_factor;
+    mcu_height	 = DCTSIZE * cinfo->max_v_samp_factor;
+    mcus_per_row = (cinfo->image_width  + mcu_width  - 1) / mcu_width;
+    mcu_rows	 = (cinfo->image_height + mcu_height - 1) / mcu_height;
+    interval	 = cinfo->restart_interval;
+    strip_mcus	 = interval ?
+	(SHJPEG_JPU_LINEBUFFER_PITCH / mcu_width) / interval * interval : 0;
+
+    /* strips are placed as they are, without cropping or scaling */
+    decode_output_size(context, &out_width, &out_height);
+    if (decode_region(context, &rect) ||
+	decode_orientation(context, &hflip, &vflip) || hflip || vflip ||
+	(out_width != cinfo->image_width) ||
+	(out_height != cinfo->image_height) ||
+	!strip_mcus || (mcus_per_row % interval) ||
+	cinfo->progressive_mode ||
+	(cinfo->comps_in_scan != cinfo->num_components) ||
+	!src->sof || src->consumed) {
+	D_INFO("libshjpeg: can't split %d pixels wide image into strips.",
+	       cinfo->image_width);
+	return -1;
+    }
+
+    intervals_per_row = mcus_per_row / interval;
+
+    /* read the whole stream, recording RSTn markers */
+    src->dht_replay = sizeof(decode_std_dht);	/* tables go to each strip */
+    do {
+	if (len == size) {
+	    JOCTET *p = realloc(buf, size + SHJPEG_STREAM_BUF_SIZE);
+
+	    if (!p) {
+		D_ERROR("libshjpeg: no memory to split the image.");
+		goto out;
+	    }
+	    buf   = p;
+	    size += SHJPEG_STREAM_BUF_SIZE;
+	}
+
+	n = size - len;
+	if (decode_read(context, &n, buf + len))
+	    goto out;
+	len += n;
+    } while (n);
+
+    if (src->restarts_lost ||
+	(src->num_restarts != intervals_per_row * mcu_rows - 1)) {
+	D_INFO("libshjpeg: restart markers don't match the image.");
+	goto out;
+    }
+
+    /* entropy coded data of the last interval ends at EOI */
+    for (eoi = len; eoi >= 2; eoi--)
+	if ((buf[eoi - 2] == 0xff) && (buf[eoi - 1] == JPEG_EOI))
+	    break;
+    eoi = (eoi >= 2) ? eoi - 2 : len;
+
+    if (src->num_restarts && (eoi < src->restarts[src->num_restarts - 1] + 2))
+	goto out;
+
+    strip = malloc(len + 2 * intervals_per_row * mcu_rows + 2);
+    if (!strip) {
+	D_ERROR("libshjpeg: no memory to split the image.");
+	goto out;
+    }
+
+    saved = *src;
+    context->sops = &tile_sops;
+
+    for (x = 0; x < mcus_per_row; x += strip_mcus) {
+	int mcus = MIN(strip_mcus, mcus_per_row - x);
+	int w	 = MIN((x + mcus) * mcu_width, image_width) - x * mcu_width;
+	int row, i, k, num = 0;
+
+	/* header with the width of the strip */
+	memcpy(strip, buf, saved.scan_start);
+	strip[saved.sof + 7] = (JOCTET)(w >> 8);
+	strip[saved.sof + 8] = (JOCTET)(w & 0xff);
+	pos = saved.scan_start;
+
+	/* restart intervals of the strip in each MCU row */
+	for (row = 0; row < mcu_rows; row++) {
+	    for (i = 0; i < mcus / interval; i++, num++) {
+		size_t start, end;
+
+		k     = row * intervals_per_row + x / interval + i;
+		start = k ? saved.restarts[k - 1] + 2 : saved.scan_start;
+		end   = (k < saved.num_restarts) ? saved.restarts[k] : eoi;
+
+		if (num) {
+		    strip[pos++] = 0xff;
+		    strip[pos++] = JPEG_RST0 + ((num - 1) & 7);
+		}
+
+		memcpy(strip + pos, buf + start, end - start);
+		pos += end - start;
+	    }
+	}
+
+	strip[pos++] = 0xff;
+	strip[pos++] = JPEG_EOI;
+
+	/* replay the strip, and don't resume within it */
+	src->header	   = strip;
+	src->header_len	   = pos;
+	src->replay	   = 0;
+	src->dht_replay	   = 0;
+	src->hw_offset	   = 0;
+	src->scanned	   = 0;
+	src->restarts	   = NULL;
+	src->num_restarts  = 0;
+	src->max_restarts  = 0;
+	src->restarts_lost = TRUE;
+
+	cinfo->image_width = w;
+	context->width	   = w;
+	context->dst_x	   = dst_x + x * mcu_width;
+
+	D_DEBUG_AT(SH7722_JPEG, "  -> strip at %d, %d pixels wide, %d bytes",
+		   x * mcu_width, w, (int)pos);
+
+	ret = decode_hw(data, context, format, phys, c_phys,
+			width, height, pitch, NULL, NULL);
+
+	free(src->restarts);
+
+	if (ret)
+	    break;
+    }
+
+    *src		= saved;
+    cinfo->image_width	= image_width;
+    context->width	= context_width;
+    context->dst_x	= dst_x;
+    context->sops	= sops;
+
+ out:
+    free(strip);
+    free(buf);
+
+    return ret;
+}
+
+
 /*
  * Software based decoding w/ libjpeg
  */
@@ -363,34 +1315,384 @@ copy_line_y(uint16_t *yy, const uint8_t *src_ycbcr, int width )
     }
 }
 
+/*
+ * Convert a line of YCbCr samples to RGB, with the same fixed point
+ * arithmetic as libjpeg, for outputs in RGB when others take YCbCr.
+ */
+
+#define YCC_SCALEBITS	16
+#define YCC_ONE_HALF	(1 << (YCC_SCALEBITS - 1))
+#define YCC_FIX(x)	((int)((x) * (1 << YCC_SCALEBITS) + 0.5))
+
+static inline uint8_t
+ycc_clamp(int v)
+{
+    return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+static void
+ycc_to_rgb_line(uint8_t *rgb, const uint8_t *src_ycbcr, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x++) {
+	int y  = src_ycbcr[0];
+	int cb = src_ycbcr[1] - 128;
+	int cr = src_ycbcr[2] - 128;
+
+	rgb[0] = ycc_clamp(y + ((YCC_FIX(1.40200) * cr + YCC_ONE_HALF) >>
+				YCC_SCALEBITS));
+	rgb[1] = ycc_clamp(y + ((-YCC_FIX(0.34414) * cb -
+				 YCC_FIX(0.71414) * cr + YCC_ONE_HALF) >>
+				YCC_SCALEBITS));
+	rgb[2] = ycc_clamp(y + ((YCC_FIX(1.77200) * cb + YCC_ONE_HALF) >>
+				YCC_SCALEBITS));
+
+	rgb	  += 3;
+	src_ycbcr += 3;
+    }
+}
+
+/*
+ * Get the chroma line for the line y. Returns NULL if the line has no
+ * chroma.
+ */
+static inline void *
+chroma_line(shjpeg_pixelformat format, void *addr_uv, int pitch, int y)
+{
+    switch (format) {
+    case SHJPEG_PF_NV12:
+	return (y & 1) ? NULL : addr_uv + y / 2 * pitch;
+
+    case SHJPEG_PF_NV16:
+	return addr_uv + y * pitch;
+
+    default:
+	return NULL;
+    }
+}
+
+/*
+ * Write a line of grayscale pixels. Chroma is neutral.
+ */
+static void
+write_gray_line(shjpeg_pixelformat format, void *addr, void *addr_uv,
+		JSAMPROW row, int width)
+{
+    int i;
+
+    switch (format) {
+    case SHJPEG_PF_GRAY8:
+	memcpy(addr, row, width);
+	break;
+
+    case SHJPEG_PF_NV12:
+    case SHJPEG_PF_NV16:
+	memcpy(addr, row, width);
+	if (addr_uv)
+	    memset(addr_uv, 0x80, width);
+	break;
+
+    case SHJPEG_PF_RGB16:
+	for (i = 0; i < width; i++)
+	    ((uint16_t*)addr)[i] = PIXEL_RGB16(row[i], row[i], row[i]);
+	break;
+
+    case SHJPEG_PF_RGB24:
+	for (i = 0; i < width; i++) {
+	    ((uint8_t*)addr)[i*3+0] = row[i];
+	    ((uint8_t*)addr)[i*3+1] = row[i];
+	    ((uint8_t*)addr)[i*3+2] = row[i];
+	}
+	break;
+
+    case SHJPEG_PF_RGB32:
+	for (i = 0; i < width; i++)
+	    ((uint32_t*)addr)[i] = PIXEL_RGB32(row[i], row[i], row[i]);
+	break;
+
+    default:
+	D_ONCE( "unimplemented destination format (0x%08x)", format );
+	break;
+    }
+}
+
+/*
+ * Write a line of decoded pixels, of ncomp samples each.
+ */
+static void
+write_line(shjpeg_pixelformat format, void *addr, void *addr_uv,
+	   JSAMPROW row, int width, int ncomp)
+{
+    if (ncomp == 1) {
+	write_gray_line(format, addr, addr_uv, row, width);
+	return;
+    }
+
+    switch (format) {
+    case SHJPEG_PF_NV12:
+    case SHJPEG_PF_NV16:
+	if (addr_uv)
+	    copy_line_nv16(addr, addr_uv, row, width);
+	else
+	    copy_line_y(addr, row, width);
+	break;
+
+    default:
+	write_rgb_span(row, addr, width, format);
+	break;
+    }
+}
+
+/*
+ * Write a band of decoded lines rotated by 90 degrees, starting at
+ * the column x. The pixels of each column are gathered in span, so
+ * that the destination is written in runs of the band height rather
+ * than a pixel at a time. The first line becomes the rightmost
+ * column unless reverse is false.
+ *
+ * Columns of NV12 and NV16 share chroma in pairs starting at even
+ * columns. A band may start or end in the middle of a pair: an odd
+ * column on its own writes only its Y, and takes chroma from its
+ * neighbour, which writes the chroma of the pair alone.
+ */
+
+#define DECODE_SW_BAND_HEIGHT	16
+
+static void
+write_band_rotated(shjpeg_pixelformat	 format,
+		   void			*addr,
+		   void			*addr_uv,
+		   int			 pitch,
+		   JSAMPARRAY		 band,
+		   int			 lines,
+		   int			 width,
+		   int			 x,
+		   bool			 reverse,
+		   JSAMPROW		 span,
+		   int			 ncomp)
+{
+    int bpp = SHJPEG_PF_PITCH_MULTIPLY(format);
+    bool pairs = (ncomp == 3) &&
+	((format == SHJPEG_PF_NV12) || (format == SHJPEG_PF_NV16));
+    int lead = (pairs && (x & 1)) ? 1 : 0;
+    int tail = (pairs && ((x + lines) & 1)) ? 1 : 0;
+    int n = lines - lead - tail;
+    int i, c, y;
+
+    for (y = 0; y < width; y++) {
+	uint8_t *yy = addr + y * pitch + x * bpp;
+	uint8_t *uv = chroma_line(format, addr_uv + x, pitch, y);
+	JSAMPROW s = span + lead * ncomp;
+
+	for (i = 0; i < lines; i++) {
+	    JSAMPROW src = band[reverse ? lines - 1 - i : i] + y * ncomp;
+
+	    for (c = 0; c < ncomp; c++)
+		span[i * ncomp + c] = src[c];
+	}
+
+	/* odd column on its own, the chroma is its neighbour's */
+	if (lead)
+	    yy[0] = span[0];
+
+	if (n > 0)
+	    write_line(format, yy + lead, uv ? uv + lead : NULL, s, n, ncomp);
+
+	/* even column on its own, the chroma of the pair is its own */
+	if (tail && (lines > lead)) {
+	    s += n * ncomp;
+	    yy[lead + n] = s[0];
+	    if (uv) {
+		uv[lead + n]	 = s[1];
+		uv[lead + n + 1] = s[2];
+	    }
+	}
+    }
+}
+
+/*
+ * Decode a 4:4:4 image to NV12 or NV16 from the raw components, so
+ * that libjpeg neither upsamples nor interleaves the samples. Chroma
+ * is reduced by a box filter over pairs of pixels (NV16) or 2x2
+ * blocks (NV12). The loops are kept simple enough for the compiler to
+ * vectorize them where the CPU has SIMD instructions.
+ */
+
+static inline void
+box_filter_2x1(uint8_t *uv, const uint8_t *cb, const uint8_t *cr, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x += 2) {
+	uv[x + 0] = (cb[x] + cb[x + 1]) >> 1;
+	uv[x + 1] = (cr[x] + cr[x + 1]) >> 1;
+    }
+}
+
+static inline void
+box_filter_2x2(uint8_t *uv, const uint8_t *cb0, const uint8_t *cb1,
+	       const uint8_t *cr0, const uint8_t *cr1, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x += 2) {
+	uv[x + 0] = (cb0[x] + cb0[x + 1] + cb1[x] + cb1[x + 1] + 2) >> 2;
+	uv[x + 1] = (cr0[x] + cr0[x + 1] + cr1[x] + cr1[x + 1] + 2) >> 2;
+    }
+}
+
+static int
+decode_sw_444(shjpeg_context_t	 *context,
+	      shjpeg_pixelformat  format,
+	      void		 *addr,
+	      void		 *addr_uv,
+	      int		  pitch)
+{
+    j_decompress_ptr cinfo = &context->jpeg_decomp;
+    JSAMPARRAY planes[3];
+    int lines = cinfo->max_v_samp_factor * DCTSIZE;
+    int width, height, top, n, c, i;
+
+    D_DEBUG_AT( SH7722_JPEG, "	 -> decoding raw 4:4:4..." );
+
+    cinfo->raw_data_out	   = TRUE;
+    cinfo->out_color_space = JCS_YCbCr;
+
+    jpeg_start_decompress(cinfo);
+
+    width  = (cinfo->output_width + 1) & ~1;
+    height = cinfo->output_height;
+
+    /* rows are padded to whole blocks, so pairs never run over */
+    for (c = 0; c < 3; c++)
+	planes[c] = (*cinfo->mem->alloc_sarray)
+	    ((j_common_ptr)cinfo, JPOOL_IMAGE,
+	     cinfo->comp_info[c].width_in_blocks * DCTSIZE, lines);
+
+    while ((top = cinfo->output_scanline) < height) {
+	jpeg_read_raw_data(cinfo, planes, lines);
+	n = MIN(lines, height - top);
+
+	for (i = 0; i < n; i++)
+	    memcpy(addr + (top + i) * pitch, planes[0][i], width);
+
+	/* lines is a multiple of 8, thus top is always even */
+	if (format == SHJPEG_PF_NV16) {
+	    for (i = 0; i < n; i++)
+		box_filter_2x1(addr_uv + (top + i) * pitch,
+			       planes[1][i], planes[2][i], width);
+	} else {
+	    for (i = 0; i < n; i += 2)
+		box_filter_2x2(addr_uv + (top + i) / 2 * pitch,
+			       planes[1][i], planes[1][i + 1],
+			       planes[2][i], planes[2][i + 1], width);
+	}
+    }
+
+    jpeg_finish_decompress(cinfo);
+
+    return 0;
+}
+
 static int
 decode_sw(shjpeg_context_t	*context,
 	  shjpeg_pixelformat	 format,
 	  void			*addr,
+	  void			*c_addr,
 	  int			 width,
 	  int			 height,
-	  int			 pitch)
+	  int			 pitch,
+	  int			 line,
+	  decode_band_t		*band_out)
 {
     JSAMPARRAY buffer;	     /* Output row buffer */
+    JSAMPROW row;	     /* Resized row */
+    JSAMPARRAY band = NULL;  /* Lines to be rotated */
+    JSAMPROW span = NULL;    /* Rotated column */
     int row_stride;	     /* physical row width in output buffer */
-    void *addr_uv = addr + height * pitch;
+    int *xmap = NULL;	     /* source pixel of each resized pixel */
+    int out_width, out_height, x, y, c, lines;
+    int ncomp;		     /* samples per pixel from libjpeg */
+    int denom, left;
+    int crop_x, crop_y, crop_w, crop_h;
+    bool crop, rotate, hflip, vflip;
+    shjpeg_rect_t rect;
+    void *addr_uv = c_addr ? c_addr : addr + height * pitch;
     j_decompress_ptr cinfo = &context->jpeg_decomp;
 
     D_ASSERT(context != NULL);
 
-    D_DEBUG_AT(SH7722_JPEG, "%s( %p, %p|%d [%dx%d] %08x )", __FUNCTION__,
+    D_DEBUG_AT(SH7722_JPEG, "%s( %p, %p|%d [%dx%d] %08x, %d )", __FUNCTION__,
 	       context, addr, pitch, context->width, context->height,
-	       format);
+	       format, line);
 
     cinfo->output_components = 3;
 
+    /* bands are written to the top of the band buffer */
+    if (band_out) {
+	addr	= (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_IMAGE,
+					     pitch * DECODE_SW_BAND_HEIGHT * 2);
+	addr_uv = addr + pitch * DECODE_SW_BAND_HEIGHT;
+	height	= DECODE_SW_BAND_HEIGHT;
+    }
+    else
+	/* destination of the top left corner, after lines decoded by the JPU */
+	addr += (context->dst_y + line) * pitch +
+	    context->dst_x * SHJPEG_PF_PITCH_MULTIPLY(format);
+
+    crop = decode_region(context, &rect);
+    decode_output_size(context, &out_width, &out_height);
+    rotate = decode_orientation(context, &hflip, &vflip);
+
+    /* 4:4:4 images at the original size take the raw component path */
+    if (context->mode444 && !line && !band_out &&
+	!crop && !rotate && !hflip && !vflip &&
+	(context->scale_denom <= 1) &&
+	!context->resize_width && !context->resize_height &&
+	(cinfo->jpeg_color_space == JCS_YCbCr) &&
+	((format == SHJPEG_PF_NV12) || (format == SHJPEG_PF_NV16)))
+	return decode_sw_444(context, format, addr,
+			     addr_uv + context->dst_x +
+			     ((format == SHJPEG_PF_NV12) ?
+			      context->dst_y / 2 : context->dst_y) * pitch,
+			     pitch);
+
     /*
-     * XXX: Calculate destination base address. rect->{x,y} are x/y offsets
-     * from top left corner, i.e. base address. 
+     * When resizing, let libjpeg reduce the region as much as possible
+     * with scaled IDCT, and resample the rest.
      */
-    //addr += DFB_BYTES_PER_LINE( format, rect->x ) + rect->y * pitch;
+    denom = context->scale_denom ? context->scale_denom : 1;
+
+    if (context->resize_width || context->resize_height) {
+	int d;
+
+	for (d = 8; d > 1; d /= 2) {
+	    if ((rect.w * denom + d - 1) / d >= out_width &&
+		(rect.h * denom + d - 1) / d >= out_height)
+		break;
+	}
+
+	cinfo->scale_num   = 1;
+	cinfo->scale_denom = d;
+	jpeg_calc_output_dimensions(cinfo);
+    } else if (!crop) {
+	/* the image may be shorter than reported when resuming */
+	out_width  = cinfo->output_width;
+	out_height = cinfo->output_height;
+    }
+
+    /* the region in the image decoded by libjpeg */
+    crop_x = (long long)rect.x * denom / cinfo->scale_denom;
+    crop_y = (long long)rect.y * denom / cinfo->scale_denom;
+    crop_w = (long long)rect.w * denom / cinfo->scale_denom;
+    crop_h = (long long)rect.h * denom / cinfo->scale_denom;
+    crop_w = MAX(MIN(crop_w, (int)cinfo->output_width  - crop_x), 1);
+    crop_h = MAX(MIN(crop_h, (int)cinfo->output_height - crop_y), 1);
+
+    /* do not read beyond the decoded line */
+    width = out_width;
 
-    /* Not all formats yet :( */
     switch (format) {
     case SHJPEG_PF_RGB16:
     case SHJPEG_PF_RGB24:
@@ -399,74 +1701,364 @@ decode_sw(shjpeg_context_t	*context,
 	break;
 
     case SHJPEG_PF_NV12:
-	//addr_uv += rect->x + rect->y / 2 * pitch;
+	if (!band_out)
+	    addr_uv += context->dst_x + (context->dst_y + line) / 2 * pitch;
 	cinfo->out_color_space = JCS_YCbCr;
 	width = (width + 1) & ~1;
 	break;
 
     case SHJPEG_PF_NV16:
-	//addr_uv += rect->x + rect->y * pitch;
+	if (!band_out)
+	    addr_uv += context->dst_x + (context->dst_y + line) * pitch;
 	cinfo->out_color_space = JCS_YCbCr;
 	width = (width + 1) & ~1;
 	break;
 
+    case SHJPEG_PF_GRAY8:
+	/* chroma is not even decoded */
+	cinfo->out_color_space = JCS_GRAYSCALE;
+	break;
+
     default:
 	return -1;
     }
 
+    /* libjpeg converts grayscale images only to grayscale */
+    if (cinfo->jpeg_color_space == JCS_GRAYSCALE)
+	cinfo->out_color_space = JCS_GRAYSCALE;
+
+    ncomp = (cinfo->out_color_space == JCS_GRAYSCALE) ? 1 : 3;
+
     D_DEBUG_AT( SH7722_JPEG, "	 -> decoding..." );
 
     jpeg_start_decompress(cinfo);
-    row_stride = ((cinfo->output_width + 1) & ~1) * 3;
+
+    /* decode only the iMCU columns covering the region */
+    left = crop_x;
+#ifdef HAVE_JPEG_CROP_SCANLINE
+    if (crop_w < cinfo->output_width) {
+	JDIMENSION xoffset = crop_x;
+	JDIMENSION cwidth  = crop_w;
+
+	jpeg_crop_scanline(cinfo, &xoffset, &cwidth);
+	left = crop_x - xoffset;
+    }
+#endif
+
+    row_stride = ((cinfo->output_width + 1) & ~1) * ncomp;
     buffer = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE, row_stride, 1);
+    row = *buffer;
+
+    /* prepare for horizontal cropping, resampling and mirroring */
+    if (left || out_width != crop_w || hflip) {
+	row  = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_IMAGE,
+					  width * ncomp);
+	xmap = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_IMAGE,
+					  width * sizeof(int));
+	for (x = 0; x < width; x++) {
+	    int sx = (hflip) ? MAX(out_width - 1 - x, 0) : x;
+
+	    xmap[x] = left + (long long)sx * crop_w / out_width;
+	    if (xmap[x] >= cinfo->output_width)
+		xmap[x] = cinfo->output_width - 1;
+	    xmap[x] *= ncomp;
+	}
+    }
 
-    while (cinfo->output_scanline < cinfo->output_height) {
-	jpeg_read_scanlines(cinfo, buffer, 1);
+    /* lines are rotated in bands */
+    if (rotate) {
+	band = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+					   width * ncomp, DECODE_SW_BAND_HEIGHT);
+	span = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_IMAGE,
+					  DECODE_SW_BAND_HEIGHT * ncomp);
+    }
 
-	switch (format) {
-	case SHJPEG_PF_NV12:
-	    if (cinfo->output_scanline & 1) {
-		// copy_line_nv16(addr, addr_uv, *buffer, (rect->w + 1) & ~1 );
-		copy_line_nv16(addr, addr_uv, *buffer, width);
-		addr_uv += pitch;
-	    }
-	    else
-		// copy_line_y( addr, *buffer, (rect->w + 1) & ~1 );
-		copy_line_y( addr, *buffer, width);
-	    break;
+    /* skip the lines above the region */
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+    if (crop_y > 0)
+	jpeg_skip_scanlines(cinfo, crop_y);
+#endif
 
-	case SHJPEG_PF_NV16:
-	    copy_line_nv16(addr, addr_uv, *buffer, width);
-	    addr_uv += pitch;
-	    break;
+    for (y = 0, lines = 0; y < out_height; y++) {
+	JDIMENSION sy = crop_y + (long long)y * crop_h / out_height;
+	JSAMPROW line_buf = (rotate) ? band[lines++] : row;
 
-	default:
-	    write_rgb_span(*buffer, addr, width, format);
-	    break;
+	/* the nearest line */
+	while (cinfo->output_scanline <= sy)
+	    jpeg_read_scanlines(cinfo, buffer, 1);
+
+	if (xmap) {
+	    for (x = 0; x < width; x++)
+		for (c = 0; c < ncomp; c++)
+		    line_buf[x * ncomp + c] = buffer[0][xmap[x] + c];
 	}
+	else if (rotate)
+	    memcpy(line_buf, *buffer, width * ncomp);
+
+	if (rotate) {
+	    int first = y + 1 - lines;
+
+	    if ((lines < DECODE_SW_BAND_HEIGHT) && (y < out_height - 1))
+		continue;
+
+	    write_band_rotated(format, addr, addr_uv, pitch, band, lines,
+			       out_width, 
+			       (vflip) ? first : out_height - first - lines,
+			       !vflip, span, ncomp);
+	    lines = 0;
+	} else if (band_out) {
+	    int dy = y % DECODE_SW_BAND_HEIGHT;
+
+	    write_line(format, addr + dy * pitch,
+		       chroma_line(format, addr_uv, pitch, dy),
+		       line_buf, width, ncomp);
+
+	    if ((dy < DECODE_SW_BAND_HEIGHT - 1) && (y < out_height - 1))
+		continue;
+
+	    decode_band_pass(band_out, y - dy, dy + 1, addr,
+			     (format == SHJPEG_PF_NV12 ||
+			      format == SHJPEG_PF_NV16) ? addr_uv : NULL,
+			     0, 0);
+
+	    /* the callback asked to stop */
+	    if (band_out->error) {
+		jpeg_abort_decompress(cinfo);
+		return -1;
+	    }
+	} else {
+	    int dy = (vflip) ? out_height - 1 - y : y;
 
-	addr += pitch;
+	    write_line(format, addr + dy * pitch,
+		       chroma_line(format, addr_uv, pitch, dy),
+		       line_buf, width, ncomp);
+	}
     }
 
+    /* lines left after the last line of the region */
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+    if (cinfo->output_scanline < cinfo->output_height)
+	jpeg_skip_scanlines(cinfo, 
+			    cinfo->output_height - cinfo->output_scanline);
+#endif
+    while (cinfo->output_scanline < cinfo->output_height)
+	jpeg_read_scanlines(cinfo, buffer, 1);
+
     jpeg_finish_decompress(cinfo);
 
     return 0;
 }
 
 /*
- * libjpeg initialization
+ * Decode with libjpeg once, and write each decoded line to all the
+ * outputs it maps to. libjpeg reduces the region with scaled IDCT as
+ * long as it's still as large as the largest output, and each output
+ * resamples the rest. Outputs in RGB convert the decoded lines if
+ * other outputs take YCbCr.
  */
 
-#define SHJPEG_STREAM_BUF_SIZE    0x10000
-
 typedef struct {
-    struct jpeg_source_mgr  pub; /* public fields */
-    JOCTET		    *data;	 /* start of buffer */
-} shjpeg_stream_source_mgr;
-
-typedef shjpeg_stream_source_mgr * shjpeg_stream_src_ptr;
+    shjpeg_pixelformat	 format;
+    void		*addr;		/* top left corner of the image */
+    void		*addr_uv;
+    int			 pitch;
+    int			 out_width;
+    int			 out_height;
+    int			 width;		/* samples written per line */
+    int			*xmap;		/* source pixel of each pixel */
+    JSAMPROW		 row;		/* resampled line */
+    JSAMPROW		 rgb;		/* line converted to RGB */
+    int			 y;		/* next line to write */
+} decode_sw_target_t;
 
-/*
+static int
+decode_sw_multi(shjpeg_context_t *context, decode_multi_t *multi)
+{
+    j_decompress_ptr cinfo = &context->jpeg_decomp;
+    decode_sw_target_t *targets, *t;
+    JSAMPARRAY buffer;
+    shjpeg_rect_t rect;
+    int crop_x, crop_y, crop_w, crop_h;
+    int max_width = 0, max_height = 0;
+    int denom, left, ncomp, d, i, x, c;
+    bool ycc = false, rgb = false;
+
+    targets = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo, JPOOL_IMAGE,
+					 multi->num_outputs * sizeof(*targets));
+
+    decode_region(context, &rect);
+
+    for (i = 0; i < multi->num_outputs; i++) {
+	const shjpeg_decode_output_t *output = &multi->outputs[i];
+	shjpeg_map_t *maps = &multi->maps[i * 2];
+	int pitch = output->frame.pitch;
+
+	t = &targets[i];
+	t->format     = output->format;
+	t->pitch      = pitch;
+	t->out_width  = output->resize_width  ? output->resize_width  : rect.w;
+	t->out_height = output->resize_height ? output->resize_height : rect.h;
+	t->width      = t->out_width;
+	t->xmap	      = NULL;
+	t->rgb	      = NULL;
+	t->y	      = 0;
+
+	t->addr	   = maps[0].addr + output->dst_y * pitch +
+	    output->dst_x * SHJPEG_PF_PITCH_MULTIPLY(output->format);
+	t->addr_uv = (maps[1].addr ? maps[1].addr :
+		      maps[0].addr + output->height * pitch) +
+	    output->dst_x +
+	    ((output->format == SHJPEG_PF_NV12) ?
+	     output->dst_y / 2 : output->dst_y) * pitch;
+
+	if ((t->format == SHJPEG_PF_NV12) || (t->format == SHJPEG_PF_NV16)) {
+	    t->width = (t->width + 1) & ~1;
+	    ycc = true;
+	}
+	else
+	    rgb = true;
+
+	max_width  = MAX(max_width,  t->out_width);
+	max_height = MAX(max_height, t->out_height);
+    }
+
+    /* the smallest scaled IDCT still as large as every output */
+    denom = context->scale_denom ? context->scale_denom : 1;
+
+    for (d = 8; d > 1; d /= 2) {
+	if ((rect.w * denom + d - 1) / d >= max_width &&
+	    (rect.h * denom + d - 1) / d >= max_height)
+	    break;
+    }
+
+    cinfo->scale_num   = 1;
+    cinfo->scale_denom = d;
+    jpeg_calc_output_dimensions(cinfo);
+
+    /* the region in the image decoded by libjpeg */
+    crop_x = (long long)rect.x * denom / cinfo->scale_denom;
+    crop_y = (long long)rect.y * denom / cinfo->scale_denom;
+    crop_w = (long long)rect.w * denom / cinfo->scale_denom;
+    crop_h = (long long)rect.h * denom / cinfo->scale_denom;
+    crop_w = MAX(MIN(crop_w, (int)cinfo->output_width  - crop_x), 1);
+    crop_h = MAX(MIN(crop_h, (int)cinfo->output_height - crop_y), 1);
+
+    /* libjpeg converts grayscale images only to grayscale */
+    cinfo->output_components = 3;
+    if (cinfo->jpeg_color_space == JCS_GRAYSCALE)
+	cinfo->out_color_space = JCS_GRAYSCALE;
+    else
+	cinfo->out_color_space = ycc ? JCS_YCbCr : JCS_RGB;
+
+    ncomp = (cinfo->out_color_space == JCS_GRAYSCALE) ? 1 : 3;
+
+    jpeg_start_decompress(cinfo);
+
+    /* decode only the iMCU columns covering the region */
+    left = crop_x;
+#ifdef HAVE_JPEG_CROP_SCANLINE
+    if (crop_w < cinfo->output_width) {
+	JDIMENSION xoffset = crop_x;
+	JDIMENSION cwidth  = crop_w;
+
+	jpeg_crop_scanline(cinfo, &xoffset, &cwidth);
+	left = crop_x - xoffset;
+    }
+#endif
+
+    buffer = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+					 ((cinfo->output_width + 1) & ~1) *
+					 ncomp, 1);
+
+    /* prepare for horizontal cropping, resampling and conversion */
+    for (i = 0; i < multi->num_outputs; i++) {
+	t = &targets[i];
+	t->row = *buffer;
+
+	if (left || (t->out_width != crop_w)) {
+	    t->row  = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+						 JPOOL_IMAGE,
+						 t->width * ncomp);
+	    t->xmap = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+						 JPOOL_IMAGE,
+						 t->width * sizeof(int));
+	    for (x = 0; x < t->width; x++) {
+		t->xmap[x] = left + (long long)x * crop_w / t->out_width;
+		if (t->xmap[x] >= cinfo->output_width)
+		    t->xmap[x] = cinfo->output_width - 1;
+		t->xmap[x] *= ncomp;
+	    }
+	}
+
+	if (rgb && ycc && (ncomp == 3) &&
+	    (t->format != SHJPEG_PF_NV12) && (t->format != SHJPEG_PF_NV16))
+	    t->rgb = (*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+						JPOOL_IMAGE, t->width * 3);
+    }
+
+    /* skip the lines above the region */
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+    if (crop_y > 0)
+	jpeg_skip_scanlines(cinfo, crop_y);
+#endif
+
+    for (;;) {
+	JDIMENSION sy = cinfo->output_height;
+
+	/* the nearest line any output needs next */
+	for (i = 0; i < multi->num_outputs; i++) {
+	    t = &targets[i];
+	    if (t->y < t->out_height)
+		sy = MIN(sy, crop_y + (long long)t->y * crop_h / t->out_height);
+	}
+
+	if (sy >= cinfo->output_height)
+	    break;
+
+	while (cinfo->output_scanline <= sy)
+	    jpeg_read_scanlines(cinfo, buffer, 1);
+
+	for (i = 0; i < multi->num_outputs; i++) {
+	    t = &targets[i];
+
+	    while ((t->y < t->out_height) &&
+		   (crop_y + (long long)t->y * crop_h / t->out_height == sy)) {
+		JSAMPROW line_buf = t->row;
+
+		if (t->xmap) {
+		    for (x = 0; x < t->width; x++)
+			for (c = 0; c < ncomp; c++)
+			    line_buf[x * ncomp + c] = buffer[0][t->xmap[x] + c];
+		}
+
+		if (t->rgb) {
+		    ycc_to_rgb_line(t->rgb, line_buf, t->width);
+		    line_buf = t->rgb;
+		}
+
+		write_line(t->format, t->addr + t->y * t->pitch,
+			   chroma_line(t->format, t->addr_uv, t->pitch, t->y),
+			   line_buf, t->width, ncomp);
+		t->y++;
+	    }
+	}
+    }
+
+    /* lines left after the last line of the region */
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+    if (cinfo->output_scanline < cinfo->output_height)
+	jpeg_skip_scanlines(cinfo, 
+			    cinfo->output_height - cinfo->output_scanline);
+#endif
+    while (cinfo->output_scanline < cinfo->output_height)
+	jpeg_read_scanlines(cinfo, buffer, 1);
+
+    jpeg_finish_decompress(cinfo);
+
+    return 0;
+}
+
+/*
  * callbacks for input source
  */
 
@@ -480,6 +2072,37 @@ shjpeg_libjpeg_init_source(j_decompress_ptr cinfo)
 	context->sops->init(context->private);
 }
 
+/*
+ * Patch the data read, so that libjpeg sees an image that starts at
+ * the resume point - the image height in SOF is reduced, and RSTn
+ * markers are renumbered from RST0 after the resume marker.
+ */
+static void
+shjpeg_libjpeg_resume_filter(shjpeg_stream_src_ptr src, size_t nbytes)
+{
+    size_t base = src->offset, end = base + nbytes, off;
+    int i;
+
+    off = src->sof + 5;
+    if (off >= base && off < end)
+	src->data[off - base] = src->resume_height >> 8;
+    off++;
+    if (off >= base && off < end)
+	src->data[off - base] = src->resume_height & 0xff;
+
+    decode_find_restarts(src, src->data, base, nbytes);
+
+    for (i = src->resume_marker + 1; i < src->num_restarts; i++) {
+	off = src->restarts[i] + 1;
+	if (off < base)
+	    continue;
+	if (off >= end)
+	    break;
+
+	src->data[off - base] = JPEG_RST0 + ((i - src->resume_marker - 1) & 7);
+    }
+}
+
 /* 
  * fill input buffer
  */
@@ -500,6 +2123,28 @@ shjpeg_libjpeg_fill_input_buffer(j_decompress_ptr cinfo)
 	src->data[1] = (JOCTET) JPEG_EOI;
 	nbytes = 2;
     }
+    else if (src->capture) {
+	/* keep a copy of the header bytes to replay them to the JPU */
+	if (src->header_len + nbytes > src->header_size) {
+	    size_t size = src->header_len + nbytes;
+	    JOCTET *header = realloc(src->header, size);
+
+	    if (!header)
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+
+	    src->header      = header;
+	    src->header_size = size;
+	}
+
+	memcpy(src->header + src->header_len, src->data, nbytes);
+	src->header_len += nbytes;
+    }
+    else
+	src->consumed = TRUE;
+
+    if (src->resume)
+	shjpeg_libjpeg_resume_filter(src, nbytes);
+    src->offset += nbytes;
 
     src->pub.next_input_byte = src->data;
     src->pub.bytes_in_buffer = nbytes;
@@ -564,6 +2209,89 @@ shjpeg_init_src(shjpeg_context_t *context, j_decompress_ptr cinfo)
     src->pub.term_source	= shjpeg_libjpeg_term_source;
     src->pub.bytes_in_buffer	= 0; /* forces fill_input_buffer on first read */
     src->pub.next_input_byte	= NULL; /* until buffer loaded */
+
+    src->header			= NULL;
+    src->header_len		= 0;
+    src->header_size		= 0;
+    src->replay			= 0;
+    src->capture		= TRUE;
+    src->consumed		= FALSE;
+    src->dht_missing		= FALSE;
+    src->dht_replay		= 0;
+
+    src->offset			= 0;
+    src->hw_offset		= 0;
+    src->sof			= 0;
+    src->scan_start		= 0;
+    src->scanned		= 0;
+    src->scanned_ff		= FALSE;
+    src->restarts		= NULL;
+    src->num_restarts		= 0;
+    src->max_restarts		= 0;
+    src->restarts_lost		= FALSE;
+    src->resume			= FALSE;
+    src->resume_marker		= 0;
+    src->resume_line		= 0;
+    src->resume_height		= 0;
+}
+
+/*
+ * find SOF marker in the captured header
+ */
+
+static size_t
+shjpeg_find_sof(shjpeg_stream_src_ptr src)
+{
+    const JOCTET *buf = src->header;
+    size_t p = 2;		/* skip SOI */
+
+    while (p + 4 <= src->header_len) {
+	int marker;
+
+	if (buf[p] != 0xff)
+	    break;
+
+	/* fill bytes */
+	if (buf[p + 1] == 0xff) {
+	    p++;
+	    continue;
+	}
+
+	marker = buf[p + 1];
+	if ((marker & 0xf0) == 0xc0 &&
+	    marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+	    return p;
+
+	if (marker == 0xda)	/* SOS */
+	    break;
+
+	p += 2 + ((buf[p + 2] << 8) | buf[p + 3]);
+    }
+
+    return 0;
+}
+
+/*
+ * release input source
+ */
+
+static void
+shjpeg_release_src(j_decompress_ptr cinfo)
+{
+    shjpeg_stream_src_ptr src = (shjpeg_stream_src_ptr)cinfo->src;
+
+    if (!src)
+	return;
+
+    free(src->header);
+    src->header      = NULL;
+    src->header_len  = 0;
+    src->header_size = 0;
+
+    free(src->restarts);
+    src->restarts     = NULL;
+    src->num_restarts = 0;
+    src->max_restarts = 0;
 }
 
 struct my_error_mgr {
@@ -578,6 +2306,83 @@ jpeglib_panic(j_common_ptr cinfo)
     longjmp(myerr->setjmp_buffer, 1);
 }
 
+/*
+ * Set decoding parameters to libjpeg, after the header is read.
+ */
+
+static int
+decode_set_params(shjpeg_context_t *context)
+{
+    j_decompress_ptr cinfo = &context->jpeg_decomp;
+
+    switch (context->scale_denom) {
+    case 0:
+    case 1:
+    case 2:
+    case 4:
+    case 8:
+	break;
+
+    default:
+	D_ERROR("libshjpeg: invalid scale 1/%d.", context->scale_denom);
+	return -1;
+    }
+
+    cinfo->scale_num   = 1;
+    cinfo->scale_denom = context->scale_denom ? context->scale_denom : 1;
+    jpeg_calc_output_dimensions(cinfo);
+
+    return 0;
+}
+
+/*
+ * Copy the markers saved by libjpeg, as they're freed with the image.
+ * The segments are stored after the array in one allocation.
+ */
+
+static int
+decode_save_markers(shjpeg_context_t *context)
+{
+    jpeg_saved_marker_ptr saved;
+    shjpeg_marker_t *markers;
+    JOCTET *data;
+    size_t size = 0;
+    int num = 0;
+
+    for (saved = context->jpeg_decomp.marker_list; saved; saved = saved->next) {
+	size += saved->data_length;
+	num++;
+    }
+
+    if (!num)
+	return 0;
+
+    markers = malloc(num * sizeof(shjpeg_marker_t) + size);
+    if (!markers) {
+	D_ERROR("libshjpeg: no memory to save %d markers.", num);
+	return -1;
+    }
+
+    data = (JOCTET*)(markers + num);
+    num  = 0;
+
+    for (saved = context->jpeg_decomp.marker_list; saved; saved = saved->next) {
+	memcpy(data, saved->data, saved->data_length);
+
+	markers[num].marker = saved->marker;
+	markers[num].data   = data;
+	markers[num].length = saved->data_length;
+
+	data += saved->data_length;
+	num++;
+    }
+
+    context->markers     = markers;
+    context->num_markers = num;
+
+    return 0;
+}
+
 /*******************************************************************/
 
 /*
@@ -590,6 +2395,7 @@ shjpeg_decode_init(shjpeg_context_t *context)
     shjpeg_internal_t *data;
     struct my_error_mgr jerr;
     j_decompress_ptr cinfo;
+    shjpeg_stream_src_ptr src;
 
     if (!context) {
 	D_ERROR("libshjpeg: invalid context passed.");
@@ -604,6 +2410,9 @@ shjpeg_decode_init(shjpeg_context_t *context)
 	return -1;
     }
 
+    context->markers	 = NULL;
+    context->num_markers = 0;
+
     /* initialize libjpeg */
     cinfo = &context->jpeg_decomp;
     cinfo->err	= jpeg_std_error( &jerr.pub );
@@ -611,18 +2420,70 @@ shjpeg_decode_init(shjpeg_context_t *context)
 
     if (setjmp( jerr.setjmp_buffer )) {
 	D_ERROR( "libshjpeg: Error while reading headers!" );
+	shjpeg_release_src(cinfo);
 	jpeg_destroy_decompress(cinfo);
+	free(context->markers);
+	context->markers     = NULL;
+	context->num_markers = 0;
 	return -1;
     }
 
     jpeg_create_decompress(cinfo);
     shjpeg_init_src(context, cinfo);
+
+    /* keep EXIF only if it's needed */
+    if (context->orientation & SHJPEG_ORIENTATION_EXIF)
+	jpeg_save_markers(cinfo, JPEG_APP0 + 1, 0xffff);
+
+    if (context->save_markers) {
+	int i;
+
+	for (i = 0; i < 16; i++)
+	    jpeg_save_markers(cinfo, JPEG_APP0 + i, 0xffff);
+	jpeg_save_markers(cinfo, JPEG_COM, 0xffff);
+    }
+
     jpeg_read_header(cinfo, TRUE);
-    jpeg_calc_output_dimensions(cinfo);
+
+    /* the saved EXIF no longer applies to the decoded image */
+    if (context->orientation & SHJPEG_ORIENTATION_EXIF)
+	context->orientation = shjpeg_exif_orientation(cinfo,
+						       context->save_markers);
+
+    if (context->save_markers && (decode_save_markers(context) < 0)) {
+	shjpeg_release_src(cinfo);
+	jpeg_destroy_decompress(cinfo);
+	return -1;
+    }
+
+    /* header is parsed - stop capturing */
+    src = (shjpeg_stream_src_ptr)cinfo->src;
+    src->capture    = FALSE;
+    src->scan_start = src->offset - src->pub.bytes_in_buffer;
+    src->sof        = shjpeg_find_sof(src);
+
+    /* Motion JPEG frames may rely on the standard Huffman tables */
+    decode_std_huff_tables(cinfo);
+
+    if (decode_set_params(context) < 0) {
+	shjpeg_release_src(cinfo);
+	jpeg_destroy_decompress(cinfo);
+	free(context->markers);
+	context->markers     = NULL;
+	context->num_markers = 0;
+	return -1;
+    }
 
     context->width  = cinfo->output_width;
     context->height = cinfo->output_height;
 
+    /* subsampling is meaningful only for YCbCr images */
+    if (cinfo->num_components != 3) {
+	context->mode420 = false;
+	context->mode444 = false;
+	return 0;
+    }
+
     /* True if 4:2:0 */
     context->mode420 = 
 	(cinfo->comp_info[1].h_samp_factor == 
@@ -649,50 +2510,148 @@ shjpeg_decode_init(shjpeg_context_t *context)
 }
 
 /*
- * deocde main
+ * Rewind the stream and read the header again for libjpeg. If the JPU
+ * has decoded a part of the image, the stream is positioned to the
+ * restart marker to resume from.
  */
 
-int
-shjpeg_decode_run(shjpeg_context_t	*context,
-		  shjpeg_pixelformat	 format,
-		  unsigned long	   	 phys,
-    		  int			 width,
-		  int			 height,
-		  int			 pitch)
+static int
+decode_rewind(shjpeg_context_t *context)
 {
-    shjpeg_internal_t *data;
+    j_decompress_ptr cinfo = &context->jpeg_decomp;
+    shjpeg_stream_src_ptr src = (shjpeg_stream_src_ptr)cinfo->src;
+
+    if (!context->sops->init) {
+	D_ERROR("libshjpeg: stream can't be rewound for libjpeg.");
+	return -1;
+    }
+
+    /* sof is needed to patch the image height */
+    if (src->resume && !src->sof) {
+	src->resume      = FALSE;
+	src->resume_line = 0;
+    }
+
+    jpeg_abort_decompress(cinfo);
+    src->pub.bytes_in_buffer = 0;
+    src->pub.next_input_byte = NULL;
+    src->offset   = 0;
+    src->consumed = FALSE;
+    jpeg_read_header(cinfo, TRUE);
+    decode_set_params(context);
+
+    /* skip the restart intervals decoded by the JPU */
+    if (src->resume) {
+	size_t pos = src->offset - src->pub.bytes_in_buffer;
+
+	shjpeg_libjpeg_skip_input_data(cinfo, 
+				       src->restarts[src->resume_marker] + 2 -
+				       pos);
+    }
+
+    return 0;
+}
+
+/*
+ * JPU decodes only at the original size. It's resized by VEU if the
+ * size is explicitly given (sized), otherwise libjpeg is used for
+ * scaled decoding.
+ */
+
+static bool
+decode_hw_capable(shjpeg_context_t *context, bool sized)
+{
+    return ((context->jpeg_decomp.num_components == 3) &&
+	    (!context->mode444) &&
+	    ((context->scale_denom <= 1) || sized) &&
+	    (context->libjpeg_disabled >= 0));
+}
+
+/*
+ * deocde main. c_phys is the address of the CbCr plane, or 0 if it
+ * follows the Y plane.
+ */
+
+static int
+decode_frame(shjpeg_context_t		*context,
+	     const shjpeg_format_t	*fmt,
+	     unsigned long		 phys,
+	     unsigned long		 c_phys,
+	     int			 width,
+	     int			 height,
+	     int			 pitch)
+{
+    shjpeg_internal_t *data = (shjpeg_internal_t*)context->internal_data;
     struct my_error_mgr jerr;
-    void		*addr;
+    const shjpeg_format_t *base = shjpeg_format_get(fmt->base);
+    shjpeg_planes_t planes, base_planes, rows;
+    shjpeg_map_t map, c_map;
+    int out_width, out_height;
+    int base_pitch, frame_size, y_size, rows_size = 0;
+    void *saved = NULL;
+    shjpeg_rect_t rect, dst;
     int ret = -1;
 
-    data = (shjpeg_internal_t*)context->internal_data;
+    decode_region(context, &rect);
+    if ((rect.w <= 0) || (rect.h <= 0)) {
+	D_ERROR("libshjpeg: crop region is outside of the image.");
+	return -1;
+    }
 
-    /* sanity check */
-    if (!data->ref_count) {
-	D_ERROR("libshjpeg: not initialized yet.");
+    /* YCbCr can be placed only at even pixels */
+    if ((context->dst_x < 0) || (context->dst_y < 0) ||
+	((fmt->info.h_shift || fmt->info.v_shift) &&
+	 ((context->dst_x | context->dst_y) & 1))) {
+	D_ERROR("libshjpeg: can't place the image at (%d, %d).",
+		context->dst_x, context->dst_y);
 	return -1;
     }
 
+    decode_output_size(context, &out_width, &out_height);
+    if (context->orientation & SHJPEG_ROTATE_90) {
+	int tmp = out_width;
+	out_width  = out_height;
+	out_height = tmp;
+    }
+
+    /* region written in the frame buffer */
+    dst.x = context->dst_x;
+    dst.y = context->dst_y;
+    dst.w = out_width;
+    dst.h = out_height;
+
+    out_width  += context->dst_x;
+    out_height += context->dst_y;
+
     /* check if we got a large enough surface */
-    if ((context->width  > width ) || 
-	(context->height > height) ||
-	((context->width * (SHJPEG_PF_PITCH_MULTIPLY(format))) > pitch) ||
+    if ((out_width  > width ) || 
+	(out_height > height) ||
+	((out_width * fmt->info.bytes_per_pixel) > pitch) ||
 	(pitch & 0x7)) {
 	D_ERROR("libshjpeg: width, height or pitch doesn't fit.");
 	return -1;
     }
 
+    /* the base format is decoded in the memory of the frame */
+    base_pitch = shjpeg_format_base_pitch(fmt, pitch);
+    if (base_pitch < 0) {
+	D_ERROR("libshjpeg: pitch %d doesn't fit %s.", pitch, fmt->info.name);
+	return -1;
+    }
+
+    frame_size = shjpeg_get_frame_size(fmt->info.format, pitch, height);
+    y_size     = c_phys ? pitch * height : frame_size;
+
     /* if physical address is not given, use the default */
     if (phys == SHJPEG_USE_DEFAULT_BUFFER) {
 	/* first of all, check if the decoded image would fit */
-	int req_size = pitch * SHJPEG_PF_PLANE_MULTIPLY(format, height);
 	int max_size = data->jpeg_size - SHJPEG_JPU_SIZE;
 
-	if (req_size > max_size) {
+	if (frame_size > max_size) {
 	    D_ERROR("libshjpeg: "
 		    "no memory to hold an image of %dx%d (%dbpp) = %d(%d)B.",
-		    context->width, context->height, SHJPEG_PF_BPP(format),
-		    req_size, max_size);
+		    context->width, context->height, fmt->info.bits_per_pixel,
+		    frame_size, max_size);
 	    errno = -ENOMEM;
 	    return -1;
 	}
@@ -700,70 +2659,587 @@ shjpeg_decode_run(shjpeg_context_t	*context,
 	phys = data->jpeg_data;
     }
 
+    if (shjpeg_map(data, phys, y_size, &map) < 0)
+	return -1;
+
+    /* the CbCr plane is mapped on its own if it doesn't follow */
+    c_map.map  = NULL;
+    c_map.addr = NULL;
+    if (c_phys &&
+	(shjpeg_map(data, c_phys, frame_size - y_size, &c_map) < 0)) {
+	shjpeg_unmap(&map);
+	return -1;
+    }
+
+    shjpeg_format_planes(fmt, map.addr, pitch, height, &planes);
+    shjpeg_format_planes(base, map.addr, base_pitch, height, &base_planes);
+
+    /*
+     * If the base format is laid out differently, decoding it
+     * overwrites the lines around the region. They're saved, and
+     * restored after the decoded lines are taken out.
+     */
+    if (fmt->from_base &&
+	((fmt->info.planes != base->info.planes) ||
+	 (fmt->info.bytes_per_pixel != base->info.bytes_per_pixel))) {
+	rows_size = shjpeg_get_frame_size(fmt->base, base_pitch, dst.h);
+	saved = malloc(rows_size * 2);
+	if (!saved) {
+	    D_ERROR("libshjpeg: no memory to convert to %s.", fmt->info.name);
+	    goto out;
+	}
+
+	shjpeg_format_copy_rows(base, &base_planes, dst.y, dst.h, saved, true);
+    }
+
     context->jpeg_decomp.err = jpeg_std_error( &jerr.pub );
     jerr.pub.error_exit      = jpeglib_panic;
 
     if (setjmp( jerr.setjmp_buffer )) {
 	D_ERROR("libshjpeg: Error while decoding image with libjpeg!");
+	ret = -1;
+	goto out;
+    }
+
+    // Reset libjpeg used flag to zero
+    context->libjpeg_used = 0;
+
+    if (decode_hw_capable(context, (context->resize_width ||
+				    context->resize_height)))
+	ret = decode_hw(data, context, fmt->base, phys,
+			c_phys ? c_phys : phys + base_pitch * height,
+			width, height, base_pitch, NULL, NULL);
+
+    if ((context->libjpeg_disabled <= 0) && (ret)) {
+	shjpeg_stream_src_ptr src = 
+	    (shjpeg_stream_src_ptr)context->jpeg_decomp.src;
+
+	/*
+	 * The stream can't be positioned to resume from unless it can
+	 * be rewound, then the whole image is decoded again.
+	 */
+	if (src->resume && !src->consumed && !context->sops->init) {
+	    src->resume	     = FALSE;
+	    src->resume_line = 0;
+	}
+
+	/*
+	 * If the JPU has read the stream beyond the header, or has
+	 * decoded a part of the image, libjpeg must start over from
+	 * the beginning of the stream.
+	 */
+	if ((src->consumed || src->resume) && decode_rewind(context) < 0) {
+	    ret = -1;
+	    goto out;
+	}
+
+	ret = decode_sw(context, fmt->base, map.addr, c_map.addr,
+			width, height, base_pitch, src->resume_line, NULL);
+
+	// set the flag to notify the use of libjpeg
+	if (!ret)
+    	    context->libjpeg_used = 1;
+    }
+
+    /* convert the region from the base format */
+    if (!ret && saved) {
+	void *decoded = saved + rows_size;
+
+	shjpeg_format_copy_rows(base, &base_planes, dst.y, dst.h,
+				decoded, true);
+	shjpeg_format_copy_rows(base, &base_planes, dst.y, dst.h,
+				saved, false);
+
+	shjpeg_format_planes(base, decoded, base_pitch, dst.h, &rows);
+	shjpeg_format_convert(fmt, fmt->from_base, &rows, dst.y,
+			      &planes, &dst, height);
+    }
+    else if (!ret && fmt->from_base)
+	shjpeg_format_convert(fmt, fmt->from_base, &base_planes, 0,
+			      &planes, &dst, height);
+
+ out:
+    if (saved) {
+	if (ret)
+	    shjpeg_format_copy_rows(base, &base_planes, dst.y, dst.h,
+				    saved, false);
+	free(saved);
+    }
+
+    shjpeg_unmap(&c_map);
+    shjpeg_unmap(&map);
+
+    return ret;
+}
+
+int
+shjpeg_decode_run(shjpeg_context_t	*context,
+		  shjpeg_pixelformat	 format,
+		  unsigned long	   	 phys,
+    		  int			 width,
+		  int			 height,
+		  int			 pitch)
+{
+    shjpeg_internal_t *data;
+    const shjpeg_format_t *fmt;
+
+    data = (shjpeg_internal_t*)context->internal_data;
+
+    /* sanity check */
+    if (!data->ref_count) {
+	D_ERROR("libshjpeg: not initialized yet.");
 	return -1;
     }
 
-    switch (format) {
-    case SHJPEG_PF_NV12:
-    case SHJPEG_PF_NV16:
-    case SHJPEG_PF_RGB16:
-    case SHJPEG_PF_RGB32:
-    case SHJPEG_PF_RGB24:
-	break;
+    fmt = shjpeg_format_get(format);
+    if (!fmt) {
+	D_ERROR("libshjpeg: Unsupported destination format.");
+	return -1;
+    }
 
-    default:
+    return decode_frame(context, fmt, phys, 0, width, height, pitch);
+}
+
+/*
+ * decode to separate planes
+ */
+
+int
+shjpeg_decode_frame(shjpeg_context_t	 *context,
+		    shjpeg_pixelformat	  format,
+		    const shjpeg_frame_t *frame,
+		    int			  width,
+		    int			  height)
+{
+    shjpeg_internal_t *data;
+    const shjpeg_format_t *fmt;
+
+    data = (shjpeg_internal_t*)context->internal_data;
+
+    /* sanity check */
+    if (!data->ref_count) {
+	D_ERROR("libshjpeg: not initialized yet.");
+	return -1;
+    }
+
+    fmt = shjpeg_format_get(format);
+    if (!fmt) {
 	D_ERROR("libshjpeg: Unsupported destination format.");
 	return -1;
     }
 
-    // Reset libjpeg used flag to zero
-    context->libjpeg_used = 0;
+    if (shjpeg_format_check_frame(data, fmt, frame))
+	return -1;
+
+    return decode_frame(context, fmt, frame->phys, frame->c_phys,
+			width, height, frame->pitch);
+}
 
-    if ((!context->mode444) && (context->libjpeg_disabled >= 0)) {
-	if (context->sops->init)
-	    context->sops->init(context->private);
+int
+shjpeg_decode_multi(shjpeg_context_t		 *context,
+		    const shjpeg_decode_output_t *outputs,
+		    int				  num_outputs)
+{
+    shjpeg_internal_t *data;
+    struct my_error_mgr jerr;
+    decode_multi_t multi;
+    shjpeg_rect_t rect;
+    int saved_dst_x, saved_dst_y, saved_resize_w, saved_resize_h;
+    bool sized = true;
+    int i, ret = -1;
 
-	ret = decode_hw(data, context, format, phys, width, height, pitch);
+    data = (shjpeg_internal_t*)context->internal_data;
+
+    /* sanity check */
+    if (!data->ref_count) {
+	D_ERROR("libshjpeg: not initialized yet.");
+	return -1;
     }
 
-    if ((context->libjpeg_disabled <= 0) && (ret)) {
-	int fd;
-	int len = _PAGE_ALIGN(SHJPEG_PF_PLANE_MULTIPLY(format, height) * pitch) + _PAGE_SIZE;
-	void *offsetaddr;
+    if (!outputs || (num_outputs <= 0)) {
+	D_ERROR("libshjpeg: no output to decode to.");
+	return -1;
+    }
+
+    if (context->orientation != SHJPEG_ROTATE_0) {
+	D_ERROR("libshjpeg: can't rotate or mirror to many outputs.");
+	return -1;
+    }
+
+    decode_region(context, &rect);
+    if ((rect.w <= 0) || (rect.h <= 0)) {
+	D_ERROR("libshjpeg: crop region is outside of the image.");
+	return -1;
+    }
 
-	fd = open( "/dev/mem", O_RDWR | O_SYNC );
-	if (fd < 0) {
-	    D_PERROR( "libshjpeg: Could not open /dev/mem!" );
+    for (i = 0; i < num_outputs; i++) {
+	const shjpeg_decode_output_t *output = &outputs[i];
+	const shjpeg_format_t *fmt = shjpeg_format_get(output->format);
+	int out_width, out_height;
+
+	switch (output->format) {
+	case SHJPEG_PF_NV12:
+	case SHJPEG_PF_NV16:
+	case SHJPEG_PF_RGB16:
+	case SHJPEG_PF_RGB24:
+	case SHJPEG_PF_RGB32:
+	    break;
+
+	default:
+	    D_ERROR("libshjpeg: Unsupported destination format of output %d.",
+		    i);
 	    return -1;
 	}
 
-	addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
-		    phys & ~(_PAGE_SIZE - 1));
-	if (addr == MAP_FAILED) {
-	    D_PERROR( "libshjpeg: Could not map /dev/mem at 0x%08lx (length %d)!", phys, len );
-	    close(fd);
+	if (shjpeg_format_check_frame(data, fmt, &output->frame))
 	    return -1;
+
+	/* YCbCr can be placed only at even pixels */
+	if ((output->dst_x < 0) || (output->dst_y < 0) ||
+	    ((fmt->info.h_shift || fmt->info.v_shift) &&
+	     ((output->dst_x | output->dst_y) & 1))) {
+	    D_ERROR("libshjpeg: can't place output %d at (%d, %d).",
+		    i, output->dst_x, output->dst_y);
+	    return -1;
+	}
+
+	/* JPU decodes a scaled image only if VEU gives every output its size */
+	if (!output->resize_width && !output->resize_height)
+	    sized = false;
+
+	out_width  = output->resize_width  ? output->resize_width  : rect.w;
+	out_height = output->resize_height ? output->resize_height : rect.h;
+	out_width  += output->dst_x;
+	out_height += output->dst_y;
+
+	/* check if we got a large enough surface */
+	if ((out_width	> output->width ) || 
+	    (out_height > output->height) ||
+	    ((out_width * fmt->info.bytes_per_pixel) > output->frame.pitch) ||
+	    (output->frame.pitch & 0x7)) {
+	    D_ERROR("libshjpeg: width, height or pitch of output %d "
+		    "doesn't fit.", i);
+	    return -1;
+	}
+    }
+
+    multi.outputs     = outputs;
+    multi.num_outputs = num_outputs;
+    multi.jpu	      = calloc(num_outputs, sizeof(*multi.jpu));
+    multi.maps	      = calloc(num_outputs * 2, sizeof(*multi.maps));
+    if (!multi.jpu || !multi.maps) {
+	D_ERROR("libshjpeg: no memory for %d outputs.", num_outputs);
+	goto out;
+    }
+
+    /* the planes of each output are mapped for libjpeg */
+    for (i = 0; i < num_outputs; i++) {
+	const shjpeg_frame_t *frame = &outputs[i].frame;
+	int frame_size = shjpeg_get_frame_size(outputs[i].format, frame->pitch,
+					       outputs[i].height);
+	int y_size     = frame->c_phys ? 
+	    frame->pitch * outputs[i].height : frame_size;
+
+	if (shjpeg_map(data, frame->phys, y_size, &multi.maps[i * 2]) < 0)
+	    goto out;
+
+	if (frame->c_phys &&
+	    (shjpeg_map(data, frame->c_phys, frame_size - y_size,
+			&multi.maps[i * 2 + 1]) < 0))
+	    goto out;
+    }
+
+    /* each output has its own place and size */
+    saved_dst_x	   = context->dst_x;
+    saved_dst_y	   = context->dst_y;
+    saved_resize_w = context->resize_width;
+    saved_resize_h = context->resize_height;
+
+    context->dst_x	   = 0;
+    context->dst_y	   = 0;
+    context->resize_width  = 0;
+    context->resize_height = 0;
+
+    context->jpeg_decomp.err = jpeg_std_error( &jerr.pub );
+    jerr.pub.error_exit      = jpeglib_panic;
+
+    if (setjmp( jerr.setjmp_buffer )) {
+	D_ERROR("libshjpeg: Error while decoding image with libjpeg!");
+	ret = -1;
+	goto restore;
+    }
+
+    // Reset libjpeg used flag to zero
+    context->libjpeg_used = 0;
+
+    if (decode_hw_capable(context, sized)) {
+	const shjpeg_frame_t *frame = &outputs[0].frame;
+
+	ret = decode_hw(data, context, outputs[0].format, frame->phys,
+			frame->c_phys ? frame->c_phys :
+			frame->phys + frame->pitch * outputs[0].height,
+			outputs[0].width, outputs[0].height, frame->pitch,
+			NULL, &multi);
+    }
+
+    if ((context->libjpeg_disabled <= 0) && (ret)) {
+	shjpeg_stream_src_ptr src = 
+	    (shjpeg_stream_src_ptr)context->jpeg_decomp.src;
+
+	/* the outputs are written again from the top */
+	src->resume	 = FALSE;
+	src->resume_line = 0;
+
+	if (src->consumed && decode_rewind(context) < 0) {
+	    ret = -1;
+	    goto restore;
 	}
 
-	offsetaddr = addr + (phys & (_PAGE_SIZE - 1));
-	ret = decode_sw(context, format, offsetaddr, width, height, pitch);
+	ret = decode_sw_multi(context, &multi);
 
 	// set the flag to notify the use of libjpeg
 	if (!ret)
     	    context->libjpeg_used = 1;
+    }
+
+ restore:
+    context->dst_x	   = saved_dst_x;
+    context->dst_y	   = saved_dst_y;
+    context->resize_width  = saved_resize_w;
+    context->resize_height = saved_resize_h;
+
+ out:
+    for (i = 0; multi.maps && (i < num_outputs * 2); i++)
+	shjpeg_unmap(&multi.maps[i]);
+
+    free(multi.maps);
+    free(multi.jpu);
+
+    return ret;
+}
+
+/*
+ * shjpeg_transcode()
+ */
+
+int
+shjpeg_transcode(shjpeg_context_t	*context,
+		 shjpeg_pixelformat	 format,
+		 shjpeg_encode_output_t	*output)
+{
+    shjpeg_internal_t *data;
+    const shjpeg_format_t *fmt;
+    shjpeg_rect_t encode_crop;
+    const shjpeg_marker_t *encode_markers;
+    int encode_num_markers;
+    int width, height, pitch, padded;
+    int jpu_held;
+    int ret;
+
+    data = (shjpeg_internal_t*)context->internal_data;
+
+    /* sanity check */
+    if (!data->ref_count) {
+	D_ERROR("libshjpeg: not initialized yet.");
+	return -1;
+    }
+
+    /* the JPU reads the decoded image back as it is */
+    switch (format) {
+    case SHJPEG_PF_NV12:
+    case SHJPEG_PF_NV16:
+    case SHJPEG_PF_GRAY8:
+	break;
+
+    default:
+	D_ERROR("libshjpeg: can't transcode through %08x.", format);
+	return -1;
+    }
+
+    if (!output) {
+	D_ERROR("libshjpeg: no output to encode.");
+	return -1;
+    }
+
+    fmt = shjpeg_format_get(format);
+
+    /* the decoded image fills the buffer of the library */
+    decode_output_size(context, &width, &height);
+    if (context->orientation & SHJPEG_ROTATE_90) {
+	int tmp = width;
+	width  = height;
+	height = tmp;
+    }
+
+    pitch  = (width * fmt->info.bytes_per_pixel + 7) & ~7;
+    padded = height;
+
+    /* JPU decodes GRAY8 only with room for whole MCUs, 16 pixels each */
+    if (format == SHJPEG_PF_GRAY8) {
+	pitch  = (width  + 15) & ~15;
+	padded = (height + 15) & ~15;
+    }
+
+    D_DEBUG_AT( SH7722_JPEG, "	 -> locking JPU..." );
+
+    /* Locking JPU using lockf(3), unless a session holds it already */
+    jpu_held = data->jpu_held;
+    if (!jpu_held && lockf(data->jpu_uio_fd, F_LOCK, 0) < 0) {
+	D_PERROR( "libshjpeg: Could not lock JPEG engine!" );
+	return -1;
+    }
+
+    /* decoding and encoding don't lock the JPU on their own */
+    data->jpu_held = 1;
+
+    ret = shjpeg_decode_run(context, format, SHJPEG_USE_DEFAULT_BUFFER,
+			    width, padded, pitch);
+
+    /* the whole decoded image is encoded, without the padding */
+    if (!ret) {
+	encode_crop = context->encode_crop;
+	memset(&context->encode_crop, 0, sizeof(context->encode_crop));
+
+	/* carry the saved markers over, unless others are given */
+	encode_markers	   = context->encode_markers;
+	encode_num_markers = context->encode_num_markers;
+	if (!encode_markers && context->markers) {
+	    context->encode_markers	= context->markers;
+	    context->encode_num_markers = context->num_markers;
+	}
 
-	munmap(addr, len);
-	close(fd);
+	ret = shjpeg_encode_multi(context, format, SHJPEG_USE_DEFAULT_BUFFER,
+				  width, height, pitch, output, 1);
+
+	context->encode_crop	    = encode_crop;
+	context->encode_markers	    = encode_markers;
+	context->encode_num_markers = encode_num_markers;
+    }
+
+    data->jpu_held = jpu_held;
+
+    /* Unlocking JPU using lockf(3) */
+    if (!jpu_held && lockf(data->jpu_uio_fd, F_ULOCK, 0) < 0) {
+	D_PERROR( "libshjpeg: Could not unlock JPEG engine!" );
+	ret = -1;
     }
 
     return ret;
 }
 
+/*
+ * decode in bands
+ */
+
+int
+shjpeg_decode_bands(shjpeg_context_t	*context,
+		    shjpeg_pixelformat	 format,
+		    int			 pitch,
+		    shjpeg_band_func	 func,
+		    void		*private)
+{
+    shjpeg_internal_t *data;
+    struct my_error_mgr jerr;
+    const shjpeg_format_t *fmt;
+    decode_band_t band;
+    shjpeg_rect_t rect;
+    int out_width, out_height, max_lines;
+    bool hflip, vflip;
+    int ret = -1;
+
+    data = (shjpeg_internal_t*)context->internal_data;
+
+    /* sanity check */
+    if (!data->ref_count) {
+	D_ERROR("libshjpeg: not initialized yet.");
+	return -1;
+    }
+
+    fmt = shjpeg_format_get(format);
+    if (!fmt || (fmt->base != format)) {
+	D_ERROR("libshjpeg: Unsupported band format.");
+	return -1;
+    }
+
+    if (!func) {
+	D_ERROR("libshjpeg: no callback to pass the bands.");
+	return -1;
+    }
+
+    decode_region(context, &rect);
+    if ((rect.w <= 0) || (rect.h <= 0)) {
+	D_ERROR("libshjpeg: crop region is outside of the image.");
+	return -1;
+    }
+
+    /* bands are passed from the top */
+    if (decode_orientation(context, &hflip, &vflip) || vflip) {
+	D_ERROR("libshjpeg: bands can't be rotated or flipped vertically.");
+	return -1;
+    }
+
+    decode_output_size(context, &out_width, &out_height);
+
+    if (!pitch)
+	pitch = (out_width * fmt->info.bytes_per_pixel + 7) & ~7;
+
+    if ((out_width * fmt->info.bytes_per_pixel > pitch) || (pitch & 0x7)) {
+	D_ERROR("libshjpeg: pitch %d doesn't fit.", pitch);
+	return -1;
+    }
+
+    memset(&band, 0, sizeof(band));
+    band.func	      = func;
+    band.private      = private;
+    band.band.format  = format;
+    band.band.width   = out_width;
+    band.band.pitch   = pitch;
+
+    /* lines a line buffer is resized to at most */
+    max_lines = ((SHJPEG_JPU_LINEBUFFER_HEIGHT * out_height + rect.h - 1) /
+		 rect.h + 2) & ~1;
+
+    band.c_offset     = pitch * max_lines;
+    band.size	      = (shjpeg_get_frame_size(format, pitch, max_lines) + 7) & ~7;
+    band.phys	      = data->jpeg_data;
+    band.virt	      = data->jpeg_virt + (data->jpeg_data - data->jpeg_phys);
+
+    context->jpeg_decomp.err = jpeg_std_error( &jerr.pub );
+    jerr.pub.error_exit      = jpeglib_panic;
+
+    if (setjmp( jerr.setjmp_buffer )) {
+	D_ERROR("libshjpeg: Error while decoding image with libjpeg!");
+	return -1;
+    }
+
+    context->libjpeg_used = 0;
+
+    /* two band buffers must fit in the contiguous memory */
+    if (decode_hw_capable(context, (context->resize_width ||
+				    context->resize_height)) &&
+	(band.size * 2 <= data->jpeg_size - SHJPEG_JPU_SIZE))
+	ret = decode_hw(data, context, format, 0, 0, 0, 0, pitch, &band, NULL);
+
+    if ((context->libjpeg_disabled <= 0) && ret && !band.error) {
+	shjpeg_stream_src_ptr src = 
+	    (shjpeg_stream_src_ptr)context->jpeg_decomp.src;
+
+	/* bands passed by the JPU are skipped rather than resumed */
+	src->resume	 = FALSE;
+	src->resume_line = 0;
+
+	if (src->consumed && decode_rewind(context) < 0)
+	    return -1;
+
+	ret = decode_sw(context, format, NULL, NULL, 0, 0, pitch, 0, &band);
+
+	if (!ret)
+	    context->libjpeg_used = 1;
+    }
+
+    return band.error ? -1 : ret;
+}
+
 /*
  * clean decode context
  */
@@ -771,5 +3247,10 @@ shjpeg_decode_run(shjpeg_context_t	*context,
 void
 shjpeg_decode_shutdown(shjpeg_context_t *context)
 {
+    shjpeg_release_src(&context->jpeg_decomp);
     jpeg_destroy_decompress(&context->jpeg_decomp);
+
+    free(context->markers);
+    context->markers     = NULL;
+    context->num_markers = 0;
 }
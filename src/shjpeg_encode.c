@@ -30,11 +30,13 @@
 #include <dirent.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 
 #include <shjpeg/shjpeg.h>
 #include "shjpeg_internal.h"
 #include "shjpeg_jpu.h"
 #include "shjpeg_veu.h"
+#include "shjpeg_format.h"
 
 static inline int
 coded_data_amount(shjpeg_internal_t *data)
@@ -44,79 +46,497 @@ coded_data_amount(shjpeg_internal_t *data)
 	(shjpeg_jpu_getreg32(data, JPU_JCDTCD));
 }
 
+/*
+ * Get the region of the source to encode, rounded to even pixels and
+ * clipped to the source image.
+ */
+
+static void
+encode_region(shjpeg_context_t	*context,
+	      int		 width,
+	      int		 height,
+	      shjpeg_rect_t	*rect)
+{
+    shjpeg_rect_t *crop = &context->encode_crop;
+
+    if ((crop->w <= 0) || (crop->h <= 0)) {
+	rect->x = 0;
+	rect->y = 0;
+	rect->w = width;
+	rect->h = height;
+    } else {
+	rect->x = MAX(crop->x, 0) & ~1;
+	rect->y = MAX(crop->y, 0) & ~1;
+	rect->w = MIN((crop->x + crop->w + 1) & ~1, width)  - rect->x;
+	rect->h = MIN((crop->y + crop->h + 1) & ~1, height) - rect->y;
+    }
+}
+
+/*
+ * Get the size of the encoded image.
+ */
+
+static void
+encode_output_size(shjpeg_encode_output_t *output, shjpeg_rect_t *rect,
+		   int *width, int *height)
+{
+    *width  = output->width  ? output->width  : rect->w;
+    *height = output->height ? output->height : rect->h;
+}
+
+/*
+ * Restart index
+ *
+ * The coded data is scanned while it is passed to sops, to find the
+ * start of the scan and the RST markers.
+ */
+
+typedef enum {
+    INDEX_HEADER,		// expecting a marker
+    INDEX_MARKER,		// got 0xff, expecting the marker code
+    INDEX_LENGTH_HI,		// length of the marker segment
+    INDEX_LENGTH_LO,
+    INDEX_SKIP,			// skipping the marker segment
+    INDEX_SCAN,			// in entropy coded data
+    INDEX_SCAN_FF,		// got 0xff in entropy coded data
+    INDEX_DONE
+} encode_index_state;
+
+typedef struct {
+    encode_index_state	    state;
+    int			    marker;
+    size_t		    length;
+    unsigned long	    offset;	// offset of the next byte
+    shjpeg_encode_output_t *output;
+} encode_index_t;
+
+static void
+encode_index_init(encode_index_t *index, shjpeg_encode_output_t *output)
+{
+    index->state  = INDEX_HEADER;
+    index->marker = 0;
+    index->length = 0;
+    index->offset = 0;
+    index->output = output;
+
+    output->num_restarts = 0;
+}
+
+static inline void
+encode_index_add(encode_index_t *index, unsigned long offset)
+{
+    shjpeg_encode_output_t *output = index->output;
+
+    if (output->restart_offsets &&
+	(output->num_restarts < output->max_restarts))
+	output->restart_offsets[output->num_restarts] = offset;
+
+    output->num_restarts++;
+}
+
+static void
+encode_index_scan(encode_index_t *index, const u8 *ptr, size_t len)
+{
+    size_t i;
+
+    for (i = 0; (i < len) && (index->state != INDEX_DONE);
+	 i++, index->offset++) {
+	u8 c = ptr[i];
+
+	switch (index->state) {
+	case INDEX_HEADER:
+	    if (c == 0xff)
+		index->state = INDEX_MARKER;
+	    break;
+
+	case INDEX_MARKER:
+	    if (c == 0xff)	/* fill byte */
+		break;
+	    index->marker = c;
+	    index->state  = (c == 0xd8) ? INDEX_HEADER : INDEX_LENGTH_HI;
+	    break;
+
+	case INDEX_LENGTH_HI:
+	    index->length = c << 8;
+	    index->state  = INDEX_LENGTH_LO;
+	    break;
+
+	case INDEX_LENGTH_LO:
+	    index->length |= c;
+	    index->length  = (index->length > 2) ? index->length - 2 : 0;
+	    index->state   = INDEX_SKIP;
+	    if (!index->length)
+		index->state = (index->marker == 0xda) ?
+		    INDEX_SCAN : INDEX_HEADER;
+	    if (index->state == INDEX_SCAN)
+		encode_index_add(index, index->offset + 1);
+	    break;
+
+	case INDEX_SKIP:
+	    if (--index->length)
+		break;
+
+	    if (index->marker == 0xda) {	/* SOS */
+		encode_index_add(index, index->offset + 1);
+		index->state = INDEX_SCAN;
+	    } else
+		index->state = INDEX_HEADER;
+	    break;
+
+	case INDEX_SCAN:
+	    if (c == 0xff)
+		index->state = INDEX_SCAN_FF;
+	    break;
+
+	case INDEX_SCAN_FF:
+	    if ((c >= 0xd0) && (c <= 0xd7)) {	/* RSTn */
+		encode_index_add(index, index->offset - 1);
+		index->state = INDEX_SCAN;
+	    } else if (c == 0x00)		/* stuffed byte */
+		index->state = INDEX_SCAN;
+	    else if (c != 0xff)			/* EOI */
+		index->state = INDEX_DONE;
+	    break;
+
+	default:
+	    break;
+	}
+    }
+}
+
+/*
+ * Pass the coded data to sops. The markers of the context are written
+ * right after SOI, each in chunks of its own, thus the coded data is
+ * never copied to make room for them.
+ */
+
+static void
+encode_write_chunk(shjpeg_encode_output_t *output,
+		   shjpeg_sops		  *sops,
+		   encode_index_t	  *index,
+		   const void		  *ptr,
+		   size_t		   len)
+{
+    encode_index_scan(index, ptr, len);
+    sops->write(output->private, &len, (void*)ptr);
+}
+
+static void
+encode_write(shjpeg_context_t	    *context,
+	     shjpeg_encode_output_t *output,
+	     shjpeg_sops	    *sops,
+	     encode_index_t	    *index,
+	     const u8		    *ptr,
+	     size_t		     len)
+{
+    int i;
+
+    if (!index->offset && (len >= 2) && (context->encode_num_markers > 0)) {
+	encode_write_chunk(output, sops, index, ptr, 2);
+	ptr += 2;
+	len -= 2;
+
+	for (i = 0; i < context->encode_num_markers; i++) {
+	    const shjpeg_marker_t *marker = &context->encode_markers[i];
+	    u8 header[4];
+
+	    header[0] = 0xff;
+	    header[1] = marker->marker;
+	    header[2] = (marker->length + 2) >> 8;
+	    header[3] = (marker->length + 2) & 0xff;
+
+	    encode_write_chunk(output, sops, index, header, 4);
+	    if (marker->length)
+		encode_write_chunk(output, sops, index,
+				   marker->data, marker->length);
+	}
+    }
+
+    if (len)
+	encode_write_chunk(output, sops, index, ptr, len);
+}
+
+/*
+ * Get the restart interval in MCUs for the image.
+ */
+
+static int
+encode_restart_interval(shjpeg_context_t *context, int width)
+{
+    switch (context->encode_restart_interval) {
+    case SHJPEG_RESTART_NONE:
+	return 0;
+
+    case SHJPEG_RESTART_MCU_ROW:
+	/* MCU is always 16 pixels wide for 4:2:0 and 4:2:2 */
+	return (width + 15) / 16;
+
+    case SHJPEG_RESTART_DEFAULT:
+	return 512;
+
+    default:
+	return context->encode_restart_interval;
+    }
+}
+
+/*
+ * Band input of shjpeg_encode_bands(). The caller fills one of two
+ * band buffers in the contiguous memory each time JPU or VEU releases
+ * the line buffer it was read into.
+ */
+
+typedef struct {
+    shjpeg_band_func	 func;
+    void		*private;
+    shjpeg_band_t	 band;		/* format, width and pitch */
+    void		*virt;		/* band buffers */
+    unsigned long	 phys;
+    int			 size;		/* size of a band buffer */
+    int			 c_offset;	/* offset of the CbCr plane */
+} encode_band_t;
+
+/*
+ * Called by the state machine to fill the band buffer buf.
+ */
+
+static int
+encode_hw_band(void *private, int buf, int y, int h)
+{
+    encode_band_t *b = (encode_band_t*)private;
+    shjpeg_band_t *band = &b->band;
+    int offset = buf * b->size;
+    bool nv = (band->format == SHJPEG_PF_NV12 ||
+	       band->format == SHJPEG_PF_NV16);
+
+    band->y	 = y;
+    band->height = h;
+    band->addr	 = b->virt + offset;
+    band->c_addr = nv ? b->virt + offset + b->c_offset : NULL;
+    band->phys	 = b->phys + offset;
+    band->c_phys = nv ? b->phys + offset + b->c_offset : 0;
+
+    return b->func(b->private, band);
+}
+
+static int encode_tiled(shjpeg_internal_t *data, shjpeg_context_t *context,
+			shjpeg_pixelformat format, unsigned long phys,
+			unsigned long c_phys, int width, int height, int pitch,
+			shjpeg_encode_output_t *output, int quality, int *size);
+
+/*
+ * Program JPU from reset with the settings common to all the modes.
+ */
+
+static void
+encode_hw_setup(shjpeg_internal_t *data,
+		bool		   mode420,
+		int		   interval,
+		int		   out_width,
+		int		   out_height)
+{
+    shjpeg_jpu_reset(data);
+    shjpeg_jpu_setreg32(data, JPU_JCMOD, 
+			JPU_JCMOD_INPUT_CTRL | JPU_JCMOD_DSP_ENCODE | 
+			(mode420 ? 2 : 1));
+
+    shjpeg_jpu_setreg32(data, JPU_JCQTN,   0x14); //0x14
+    shjpeg_jpu_setreg32(data, JPU_JCHTN,   0x3c); //0x3c
+    shjpeg_jpu_setreg32(data, JPU_JCDRIU,  interval >> 8);
+    shjpeg_jpu_setreg32(data, JPU_JCDRID,  interval & 0xff);
+    shjpeg_jpu_setreg32(data, JPU_JCHSZU,  out_width >> 8);
+    shjpeg_jpu_setreg32(data, JPU_JCHSZD,  out_width & 0xff);
+    shjpeg_jpu_setreg32(data, JPU_JCVSZU,  out_height >> 8);
+    shjpeg_jpu_setreg32(data, JPU_JCVSZD,  out_height & 0xff);
+    shjpeg_jpu_setreg32(data, JPU_JIFCNT,  JPU_JIFCNT_VJSEL_JPU);
+    shjpeg_jpu_setreg32(data, JPU_JIFDCNT, JPU_JIFDCNT_SWAP_4321);
+    shjpeg_jpu_setreg32(data, JPU_JIFEDA1, data->jpeg_phys);
+    shjpeg_jpu_setreg32(data, JPU_JIFEDA2, 
+			data->jpeg_phys + SHJPEG_JPU_RELOAD_SIZE);
+    shjpeg_jpu_setreg32(data, JPU_JIFEDRSZ, SHJPEG_JPU_RELOAD_SIZE);
+    shjpeg_jpu_setreg32(data, JPU_JIFESHSZ, out_width);
+    shjpeg_jpu_setreg32(data, JPU_JIFESVSZ, out_height);
+}
+
+/*
+ * Setup JPU for encoding in frame mode (directly from surface).
+ */
+
+static void
+encode_hw_direct(shjpeg_internal_t *data,
+		 bool		    mode420,
+		 u32		    yaddr,
+		 u32		    caddr,
+		 int		    pitch)
+{
+    shjpeg_jpu_setreg32(data, JPU_JINTE,	  
+			JPU_JINTS_INS10_XFER_DONE |JPU_JINTS_INS13_LOADED);
+    shjpeg_jpu_setreg32(data, JPU_JIFECNT, 
+			JPU_JIFECNT_SWAP_4321 | 
+			JPU_JIFECNT_RELOAD_ENABLE | (mode420 ? 1 : 0));
+
+    shjpeg_jpu_setreg32(data, JPU_JIFESYA1, yaddr);
+    shjpeg_jpu_setreg32(data, JPU_JIFESCA1, caddr);
+    shjpeg_jpu_setreg32(data, JPU_JIFESMW,  pitch);
+}
+
+/*
+ * Run the state machine programmed in jpeg, and write the coded data
+ * of each loaded buffer.
+ */
+
 static int
-encode_hw(shjpeg_internal_t	*data,
-	  shjpeg_context_t	*context,
-	  shjpeg_pixelformat	 format,
-	  unsigned long		 phys,
-	  int		 	 width,
-	  int		 	 height,
-	  int			 pitch)
+encode_hw_run(shjpeg_internal_t	     *data,
+	      shjpeg_context_t	     *context,
+	      shjpeg_encode_output_t *output,
+	      shjpeg_sops	     *sops,
+	      encode_index_t	     *index,
+	      shjpeg_jpu_t	     *jpeg,
+	      int		     *size)
 {
     int			ret = 0;
-    int			i, fd = -1;
+    int			i;
     int			written = 0;
+
+    D_DEBUG_AT( SH7722_JPEG, "	 -> starting...");
+
+    /* State machine. */
+    for(;;) {
+	/* Run the state machine. */
+	if (shjpeg_jpu_run(context, data, jpeg) < 0) {
+	    D_PERROR( "libshjpeg: shjpeg_jpu_run() failed!");
+	    ret = -1;
+	    break;
+	}
+
+	D_ASSERT(jpeg->state != SHJPEG_JPU_START);
+
+	/* Check for loaded buffers. */
+	for (i=1; i<=2; i++) {
+	    if (jpeg->buffers & i) {
+		int amount = coded_data_amount(data) - written;
+		size_t len;
+		void *ptr;
+
+		if (amount > SHJPEG_JPU_RELOAD_SIZE)
+		    amount = SHJPEG_JPU_RELOAD_SIZE;
+
+		D_INFO("libshjpeg: Coded data amount: + %5d (buffer %d)", 
+		       amount, i);
+
+		ptr = (void*)data->jpeg_virt + (i-1) * SHJPEG_JPU_RELOAD_SIZE;
+		len = amount;
+		encode_write(context, output, sops, index, ptr, len);
+	    }
+	}
+
+	/* Handle end (or error). */
+	if (jpeg->state == SHJPEG_JPU_END) {
+	    if (jpeg->error) {
+		D_ERROR("libshjpeg: ERROR 0x%x!", jpeg->error);
+		ret = -1;
+	    }
+
+	    break;
+	}
+    }
+
+    D_INFO("libshjpeg: Coded data amount: = %5d (written: %d, buffers: %d)",
+	   coded_data_amount(data), written, jpeg->buffers);
+
+    if (size)
+	*size = coded_data_amount(data);
+
+    return ret;
+}
+
+/*
+ * Encode using H/W. JPU must be locked by the caller. c_phys is the
+ * address of the CbCr plane. If band is given, the image is read from
+ * its band buffers, and phys and c_phys are ignored.
+ */
+
+static int
+encode_hw(shjpeg_internal_t	 *data,
+	  shjpeg_context_t	 *context,
+	  shjpeg_pixelformat	  format,
+	  unsigned long		  phys,
+	  unsigned long		  c_phys,
+	  int		 	  width,
+	  int		 	  height,
+	  int			  pitch,
+	  shjpeg_encode_output_t *output,
+	  int			  quality,
+	  int			 *size,
+	  encode_band_t		 *band)
+{
+    int			interval;
+    encode_index_t	index;
     u32			vtrcr   = 0;
     u32			vswpin  = 0;
+    u32			yaddr, caddr;
     bool 		mode420 = false;
+    const shjpeg_format_t *fmt;
+    bool		resize, direct;
+    int			out_width, out_height;
+    shjpeg_rect_t	rect;
     shjpeg_jpu_t	jpeg;
+    shjpeg_sops		*sops = output->sops ? output->sops : context->sops;
 
     D_DEBUG_AT(SH7722_JPEG, "( %p, 0x%08lx|%d [%dx%d])", 
 	       data, phys, pitch, width, height);
 
     /* Init VEU transformation control (format conversion). */
-    if (format == SHJPEG_PF_NV12)
+    fmt = shjpeg_format_get(format);
+    if (!fmt || (fmt->base != format)) {
+	D_BUG( "unexpected format %d", format);
+	return -1;
+    }
+
+    /* GRAY8 is encoded as 4:2:0 with neutral chroma */
+    if (fmt->info.v_shift || (format == SHJPEG_PF_GRAY8))
 	mode420 = true;
     else
 	vtrcr |= (1 << 22);
 
-    switch (format) {
-    case SHJPEG_PF_NV12:
-	vswpin = 0x66;
-	break;
-
-    case SHJPEG_PF_NV16:
-	vswpin  = 0x77;
-	vtrcr	 |= (1 << 14);
-	break;
-
-    case SHJPEG_PF_RGB16:
-	vswpin  = 0x76;
-	vtrcr	 |= (3 << 8) | 3;
-	break;
-
-    case SHJPEG_PF_RGB32:
-	vswpin  = 0x44;
-	vtrcr	 |= (0 << 8) | 3;
-	break;
+    /* GRAY8 is not converted by VEU, and has no settings */
+    vswpin  = fmt->vswpin;
+    vtrcr  |= fmt->vtrcrin;
 
-    case SHJPEG_PF_RGB24:
-	vswpin  = 0x77;
-	vtrcr	 |= (2 << 8) | 3;
-	break;
+    vtrcr |= (0x1) << 2;
 
-    default:
-	D_BUG( "unexpected format %d", format);
-	return -1;
-    }
+    /* Calculate source address of the top left corner. */
+    encode_region(context, width, height, &rect);
+    encode_output_size(output, &rect, &out_width, &out_height);
+    resize = (out_width != rect.w || out_height != rect.h);
 
-    vtrcr |= (0x1) << 2;
+    /* JPU reads directly only 8 bytes aligned */
+    direct = (!band && !resize && !(rect.x & 0x7) &&
+	      (format == SHJPEG_PF_NV12 || format == SHJPEG_PF_NV16));
 
-    /* Calculate source base address. */
-    //phys += rect->x + rect->y * pitch;
+    /*
+     * Line buffers for VEU hold at most SHJPEG_JPU_LINEBUFFER_PITCH
+     * pixels. Wider images are encoded in vertical strips.
+     */
+    if (!direct && (format != SHJPEG_PF_GRAY8) &&
+	(out_width > SHJPEG_JPU_LINEBUFFER_PITCH))
+	return encode_tiled(data, context, format, phys, c_phys,
+			    width, height, pitch, output, quality, size);
 
-    D_DEBUG_AT( SH7722_JPEG, "	 -> locking JPU...");
+    yaddr = phys + rect.y * pitch + rect.x * SHJPEG_PF_PITCH_MULTIPLY(format);
+    caddr = c_phys + rect.x + (mode420 ? rect.y / 2 : rect.y) * pitch;
 
-    /* Locking JPU using lockf(3) */
-    if ( lockf( data->jpu_uio_fd, F_LOCK, 0 ) < 0 ) {
-	D_PERROR( "libshjpeg: Could not lock JPEG engine!");
-	return -1;
+    if (band) {
+	yaddr = band->phys;
+	caddr = band->phys + band->c_offset;
     }
 
     D_DEBUG_AT(SH7722_JPEG, "	 -> opening file for writing...");
 
-    if (context->sops->init)
-	context->sops->init(context->private);
+    if (sops->init)
+	sops->init(output->private);
+
+    interval = encode_restart_interval(context, out_width);
+    encode_index_init(&index, output);
 
     D_DEBUG_AT( SH7722_JPEG, "	 -> setting...");
 
@@ -129,46 +549,51 @@ encode_hw(shjpeg_internal_t	*data,
     jpeg.flags |= SHJPEG_JPU_FLAG_RELOAD;
 
     /* Program JPU from RESET. */
-    shjpeg_jpu_reset(data);
-    shjpeg_jpu_setreg32(data, JPU_JCMOD, 
-			JPU_JCMOD_INPUT_CTRL | JPU_JCMOD_DSP_ENCODE | 
-			(mode420 ? 2 : 1));
+    encode_hw_setup(data, mode420, interval, out_width, out_height);
 
-    shjpeg_jpu_setreg32(data, JPU_JCQTN,   0x14); //0x14
-    shjpeg_jpu_setreg32(data, JPU_JCHTN,   0x3c); //0x3c
-    shjpeg_jpu_setreg32(data, JPU_JCDRIU,  0x02);
-    shjpeg_jpu_setreg32(data, JPU_JCDRID,  0x00);
-    shjpeg_jpu_setreg32(data, JPU_JCHSZU,  width >> 8);
-    shjpeg_jpu_setreg32(data, JPU_JCHSZD,  width & 0xff);
-    shjpeg_jpu_setreg32(data, JPU_JCVSZU,  height >> 8);
-    shjpeg_jpu_setreg32(data, JPU_JCVSZD,  height & 0xff);
-    shjpeg_jpu_setreg32(data, JPU_JIFCNT,  JPU_JIFCNT_VJSEL_JPU);
-    shjpeg_jpu_setreg32(data, JPU_JIFDCNT, JPU_JIFDCNT_SWAP_4321);
-    shjpeg_jpu_setreg32(data, JPU_JIFEDA1, data->jpeg_phys);
-    shjpeg_jpu_setreg32(data, JPU_JIFEDA2, 
-			data->jpeg_phys + SHJPEG_JPU_RELOAD_SIZE);
-    shjpeg_jpu_setreg32(data, JPU_JIFEDRSZ, SHJPEG_JPU_RELOAD_SIZE);
-    shjpeg_jpu_setreg32(data, JPU_JIFESHSZ, width);
-    shjpeg_jpu_setreg32(data, JPU_JIFESVSZ, height);
-
-    if (format == SHJPEG_PF_NV12 || format == SHJPEG_PF_NV16)
-    {
-	/* Setup JPU for encoding in frame mode (directly from surface). */
-	shjpeg_jpu_setreg32(data, JPU_JINTE,	  
-			    JPU_JINTS_INS10_XFER_DONE |JPU_JINTS_INS13_LOADED);
+    if (direct)
+	encode_hw_direct(data, mode420, yaddr, caddr, pitch);
+    else if (format == SHJPEG_PF_GRAY8) {
+	u32 neutral = data->jpeg_lb1 + SHJPEG_JPU_LINEBUFFER_SIZE_Y;
+
+	/*
+	 * Setup JPU for encoding in line buffer mode, with the Y plane
+	 * of the line buffers moved along the source. Both line buffers
+	 * share the chroma of the first one, filled with neutral gray.
+	 */
+	jpeg.flags |= SHJPEG_JPU_FLAG_CONVERT | SHJPEG_JPU_FLAG_DIRECT;
+	jpeg.height = out_height;
+
+	memset((void*)data->jpeg_virt + (neutral - data->jpeg_phys), 0x80,
+	       pitch * SHJPEG_JPU_LINEBUFFER_HEIGHT / 2);
+
+	shjpeg_jpu_setreg32(data, JPU_JINTE, 
+			    JPU_JINTS_INS11_LINEBUF0 |
+			    JPU_JINTS_INS12_LINEBUF1 |
+			    JPU_JINTS_INS10_XFER_DONE |
+			    JPU_JINTS_INS13_LOADED);
 	shjpeg_jpu_setreg32(data, JPU_JIFECNT, 
-			    JPU_JIFECNT_SWAP_4321 | 
-			    JPU_JIFECNT_RELOAD_ENABLE | (mode420 ? 1 : 0));
+			    JPU_JIFECNT_LINEBUF_MODE | 
+			    (SHJPEG_JPU_LINEBUFFER_HEIGHT << 16) |
+			    JPU_JIFECNT_SWAP_4321 |
+			    JPU_JIFECNT_RELOAD_ENABLE | 1);
 
-	shjpeg_jpu_setreg32(data, JPU_JIFESYA1, phys);
-	shjpeg_jpu_setreg32(data, JPU_JIFESCA1, phys + pitch * height);
+	shjpeg_jpu_setreg32(data, JPU_JIFESYA1, yaddr);
+	shjpeg_jpu_setreg32(data, JPU_JIFESCA1, neutral);
+	shjpeg_jpu_setreg32(data, JPU_JIFESYA2, 
+			    yaddr + SHJPEG_JPU_LINEBUFFER_HEIGHT * pitch);
+	shjpeg_jpu_setreg32(data, JPU_JIFESCA2, neutral);
 	shjpeg_jpu_setreg32(data, JPU_JIFESMW,  pitch);
+
+	jpeg.crop.yaddr = yaddr;
+	jpeg.crop.pitch = pitch;
+	jpeg.crop.out_h = out_height;
     }
     else {
 	shjpeg_veu_t veu;
 
 	jpeg.flags |= SHJPEG_JPU_FLAG_CONVERT;
-	jpeg.height = height;
+	jpeg.height = out_height;
 
 	/* Setup JPU for encoding in line buffer mode. */
 	shjpeg_jpu_setreg32(data, JPU_JINTE, 
@@ -195,15 +620,15 @@ encode_hw(shjpeg_internal_t	*data,
 	memset((void*)&veu, 0, sizeof(shjpeg_veu_t));
 
 	/* source */
-	veu.src.width	= context->width;
+	veu.src.width	= rect.w;
 	veu.src.height	= SHJPEG_JPU_LINEBUFFER_HEIGHT;
 	veu.src.pitch	= pitch;
-	veu.src.yaddr	= phys;
-	veu.src.caddr	= phys + pitch * height;
+	veu.src.yaddr	= yaddr;
+	veu.src.caddr	= caddr;
 
 	/* destination */
-	veu.dst.width	= context->width;
-	veu.dst.height	= context->height;
+	veu.dst.width	= out_width;
+	veu.dst.height	= out_height;
 	veu.dst.pitch	= SHJPEG_JPU_LINEBUFFER_PITCH;
 	veu.dst.yaddr	= data->jpeg_lb1;
 	veu.dst.caddr	= data->jpeg_lb1 + SHJPEG_JPU_LINEBUFFER_SIZE_Y;
@@ -217,69 +642,868 @@ encode_hw(shjpeg_internal_t	*data,
 	shjpeg_veu_init(data, &veu);
 
 	/* configs */
-	jpeg.sa_y = phys;
-	jpeg.sa_c = phys + pitch * height;
+	jpeg.sa_y = yaddr;
+	jpeg.sa_c = caddr;
 	jpeg.sa_inc = pitch * 16;
+
+	/*
+	 * When resizing, source lines for each line buffer are
+	 * chosen by the state machine.
+	 */
+	if (resize) {
+	    jpeg.flags		   |= SHJPEG_JPU_FLAG_CROP;
+	    jpeg.crop.x		    = rect.x;
+	    jpeg.crop.y		    = rect.y;
+	    jpeg.crop.w		    = rect.w;
+	    jpeg.crop.h		    = rect.h;
+	    jpeg.crop.out_w	    = out_width;
+	    jpeg.crop.out_h	    = out_height;
+	    jpeg.crop.yaddr	    = yaddr;
+	    jpeg.crop.caddr	    = caddr;
+	    jpeg.crop.pitch	    = pitch;
+	    jpeg.crop.bpp	    = SHJPEG_PF_PITCH_MULTIPLY(format);
+	    jpeg.crop.rotate	    = false;
+	    jpeg.crop.vflip	    = false;
+	    jpeg.crop.c_shift	    = mode420;
+	    jpeg.crop.lb_c_shift    = mode420;
+	}
+    }
+
+    /* the state machine asks for each band before reading it */
+    if (band) {
+	jpeg.flags	       |= SHJPEG_JPU_FLAG_BAND;
+	jpeg.crop.yaddr		= yaddr;
+	jpeg.crop.caddr		= caddr;
+	jpeg.crop.pitch		= pitch;
+	jpeg.crop.out_h		= out_height;
+	jpeg.crop.band_size	= band->size;
+	jpeg.band		= encode_hw_band;
+	jpeg.band_private	= band;
     }
 
     /* init QT/HT */
-    shjpeg_jpu_init_quantization_table(data);
+    shjpeg_jpu_init_quantization_table(data, quality,
+				       context->encode_quant_tables);
     shjpeg_jpu_init_huffman_table(data);
 
-    D_DEBUG_AT( SH7722_JPEG, "	 -> starting...");
+    return encode_hw_run(data, context, output, sops, &index, &jpeg, size);
+}
 
-    /* State machine. */
-    for(;;) {
-	/* Run the state machine. */
-	if (shjpeg_jpu_run(context, data, &jpeg) < 0) {
-	    D_PERROR( "libshjpeg: shjpeg_jpu_run() failed!");
-	    ret = -1;
-	    break;
-	}
+/*
+ * Tiled encoding
+ *
+ * Images wider than the line buffers are encoded in vertical strips
+ * with a restart interval that divides both the strips and the MCU
+ * rows. The strips are held in memory, and then stitched into a single
+ * image by taking the restart intervals of each MCU row from one strip
+ * after another, and renumbering the RSTn markers.
+ */
 
-	D_ASSERT(jpeg.state != SHJPEG_JPU_START);
+#define TILE_BUFFER_CHUNK	(64 * 1024)
 
-	/* Check for loaded buffers. */
-	for (i=1; i<=2; i++) {
-	    if (jpeg.buffers & i) {
-		int amount = coded_data_amount(data) - written;
-		size_t len;
-		void *ptr;
+typedef struct {
+    u8		  *buf;
+    size_t	   size;
+    size_t	   len;
+    int		   error;
+    int		   intervals;	// restart intervals in an MCU row
+    unsigned long *offsets;	// scan start, and then RSTn markers
+    int		   num_offsets;
+} encode_strip_t;
 
-		if (amount > SHJPEG_JPU_RELOAD_SIZE)
-		    amount = SHJPEG_JPU_RELOAD_SIZE;
+static int
+tile_buffer_write(void *private, size_t *nbytes, void *dataptr)
+{
+    encode_strip_t *strip = (encode_strip_t*)private;
 
-		D_INFO("libshjpeg: Coded data amount: + %5d (buffer %d)", 
-		       amount, i);
+    if (strip->size - strip->len < *nbytes) {
+	size_t size = (strip->len + *nbytes + TILE_BUFFER_CHUNK - 1) &
+	    ~(TILE_BUFFER_CHUNK - 1);
+	void *buf = realloc(strip->buf, size);
 
-		ptr = (void*)data->jpeg_virt + (i-1) * SHJPEG_JPU_RELOAD_SIZE;
-		len = amount;
-		context->sops->write(context->private, &len, ptr);
-	    }
+	if (!buf) {
+	    strip->error = 1;
+	    return -1;
 	}
 
-	/* Handle end (or error). */
-	if (jpeg.state == SHJPEG_JPU_END) {
-	    if (jpeg.error) {
-		D_ERROR("libshjpeg: ERROR 0x%x!", jpeg.error);
-		ret = -1;
-	    }
-
-	    break;
-	}
+	strip->buf  = buf;
+	strip->size = size;
     }
 
-    D_INFO("libshjpeg: Coded data amount: = %5d (written: %d, buffers: %d)",
-	   coded_data_amount(data), written, jpeg.buffers);
+    memcpy(strip->buf + strip->len, dataptr, *nbytes);
+    strip->len += *nbytes;
 
+    return 0;
+}
 
-    /* Unlocking JPU using lockf(3) */
-    if ( lockf(data->jpu_uio_fd, F_ULOCK, 0 ) < 0 ) {
-	ret = -1;
+static shjpeg_sops tile_buffer_sops = {
+    .init     = NULL,
+    .read     = NULL,
+    .write    = tile_buffer_write,
+    .finalize = NULL,
+};
+
+/*
+ * Find SOF marker in the header written by the JPU.
+ */
+
+static size_t
+tile_find_sof(const u8 *buf, size_t len)
+{
+    size_t p = 2;		/* skip SOI */
+
+    while ((p + 4 <= len) && (buf[p] == 0xff)) {
+	if ((buf[p + 1] >= 0xc0) && (buf[p + 1] <= 0xc2))
+	    return (p + 9 <= len) ? p : 0;
+
+	p += 2 + ((buf[p + 2] << 8) | buf[p + 3]);
+    }
+
+    return 0;
+}
+
+/*
+ * Get the entropy coded data of the k-th restart interval in a strip.
+ */
+
+static void
+tile_interval(const encode_strip_t *strip, size_t eoi, int k,
+	      size_t *start, size_t *end)
+{
+    *start = k ? strip->offsets[k] + 2 : strip->offsets[0];
+    *end   = (k + 1 < strip->num_offsets) ? strip->offsets[k + 1] : eoi;
+}
+
+static int
+encode_tiled(shjpeg_internal_t	    *data,
+	     shjpeg_context_t	    *context,
+	     shjpeg_pixelformat	     format,
+	     unsigned long	     phys,
+	     unsigned long	     c_phys,
+	     int		     width,
+	     int		     height,
+	     int		     pitch,
+	     shjpeg_encode_output_t *output,
+	     int		     quality,
+	     int		    *size)
+{
+    shjpeg_sops	   *sops = output->sops ? output->sops : context->sops;
+    shjpeg_rect_t   crop = context->encode_crop;
+    int		    restart = context->encode_restart_interval;
+    int		    markers = context->encode_num_markers;
+    shjpeg_rect_t   rect;
+    encode_strip_t *strips;
+    encode_index_t  index;
+    u8		   *buf = NULL;
+    size_t	    len, pos, sof;
+    int		    mcus_per_row, max_mcus, interval, strip_mcus;
+    int		    num_strips, rows, row, s, i, x, num;
+    int		    ret = -1;
+
+    encode_region(context, width, height, &rect);
+
+    /* MCU is always 16 pixels wide for 4:2:0 and 4:2:2 */
+    mcus_per_row = (rect.w + 15) / 16;
+    max_mcus	 = SHJPEG_JPU_LINEBUFFER_PITCH / 16;
+
+    /*
+     * The largest interval that divides the MCU row and fits in a
+     * strip, and doesn't exceed the one requested if any.
+     */
+    interval = encode_restart_interval(context, rect.w);
+    if ((interval <= 0) || (interval > max_mcus))
+	interval = max_mcus;
+    while (mcus_per_row % interval)
+	interval--;
+
+    strip_mcus = (max_mcus / interval) * interval;
+    num_strips = (mcus_per_row + strip_mcus - 1) / strip_mcus;
+
+    D_INFO("libshjpeg: encoding %d pixels wide image in %d strips, "
+	   "restart interval %d", rect.w, num_strips, interval);
+
+    strips = calloc(num_strips, sizeof(encode_strip_t));
+    if (!strips) {
+	D_ERROR("libshjpeg: no memory to encode in strips.");
+	return -1;
+    }
+
+    /* encode each strip on its own, the markers go in the stitched image */
+    context->encode_restart_interval = interval;
+    context->encode_num_markers	     = 0;
+
+    for (s = 0, x = 0; s < num_strips; s++, x += strip_mcus) {
+	encode_strip_t	       *strip = &strips[s];
+	shjpeg_encode_output_t	part;
+	int mcus = MIN(strip_mcus, mcus_per_row - x);
+
+	strip->intervals = mcus / interval;
+	strip->offsets	 = malloc(sizeof(unsigned long) *
+				  (strip->intervals *
+				   ((rect.h + 7) / 8) + 1));
+	if (!strip->offsets) {
+	    D_ERROR("libshjpeg: no memory to encode in strips.");
+	    goto out;
+	}
+
+	context->encode_crop.x = rect.x + x * 16;
+	context->encode_crop.y = rect.y;
+	context->encode_crop.w = MIN(mcus * 16, rect.w - x * 16);
+	context->encode_crop.h = rect.h;
+
+	memset(&part, 0, sizeof(part));
+	part.sops	     = &tile_buffer_sops;
+	part.private	     = strip;
+	part.restart_offsets = strip->offsets;
+	part.max_restarts    = strip->intervals * ((rect.h + 7) / 8) + 1;
+
+	if (encode_hw(data, context, format, phys, c_phys, width, height,
+		      pitch, &part, quality, NULL, NULL))
+	    goto out;
+
+	if (strip->error) {
+	    D_ERROR("libshjpeg: no memory to hold the encoded strip.");
+	    goto out;
+	}
+
+	strip->num_offsets = part.num_restarts;
+	if ((part.num_restarts > part.max_restarts) ||
+	    (part.num_restarts % strip->intervals)) {
+	    D_ERROR("libshjpeg: unexpected restart markers in strip %d.", s);
+	    goto out;
+	}
+    }
+
+    /* every strip must have the same number of MCU rows */
+    rows = strips[0].num_offsets / strips[0].intervals;
+    for (s = 0, len = 0; s < num_strips; s++) {
+	if (strips[s].num_offsets != rows * strips[s].intervals) {
+	    D_ERROR("libshjpeg: strips don't match.");
+	    goto out;
+	}
+	len += strips[s].len;
+    }
+
+    sof = tile_find_sof(strips[0].buf, strips[0].offsets[0]);
+    if (!sof) {
+	D_ERROR("libshjpeg: SOF not found in the encoded strip.");
+	goto out;
+    }
+
+    buf = malloc(len + 2);
+    if (!buf) {
+	D_ERROR("libshjpeg: no memory to stitch the strips.");
+	goto out;
+    }
+
+    /* header of the first strip with the width of the image */
+    pos = strips[0].offsets[0];
+    memcpy(buf, strips[0].buf, pos);
+    buf[sof + 7] = rect.w >> 8;
+    buf[sof + 8] = rect.w & 0xff;
+
+    for (row = 0, num = 0; row < rows; row++) {
+	for (s = 0; s < num_strips; s++) {
+	    encode_strip_t *strip = &strips[s];
+	    size_t eoi = strip->len;
+
+	    /* entropy coded data of the last interval ends at EOI */
+	    if ((eoi >= 2) && (strip->buf[eoi - 2] == 0xff) &&
+		(strip->buf[eoi - 1] == 0xd9))
+		eoi -= 2;
+
+	    for (i = 0; i < strip->intervals; i++, num++) {
+		size_t start, end;
+
+		tile_interval(strip, eoi, row * strip->intervals + i,
+			      &start, &end);
+
+		if (num) {
+		    buf[pos++] = 0xff;
+		    buf[pos++] = 0xd0 + ((num - 1) & 7);
+		}
+
+		memcpy(buf + pos, strip->buf + start, end - start);
+		pos += end - start;
+	    }
+	}
+    }
+
+    buf[pos++] = 0xff;
+    buf[pos++] = 0xd9;
+
+    /* pass the stitched image to the caller */
+    if (sops->init)
+	sops->init(output->private);
+
+    context->encode_num_markers = markers;
+
+    encode_index_init(&index, output);
+    encode_write(context, output, sops, &index, buf, pos);
+
+    if (size)
+	*size = pos;
+
+    ret = 0;
+
+ out:
+    context->encode_crop	     = crop;
+    context->encode_restart_interval = restart;
+    context->encode_num_markers	     = markers;
+
+    for (s = 0; s < num_strips; s++) {
+	free(strips[s].buf);
+	free(strips[s].offsets);
+    }
+    free(strips);
+    free(buf);
+
+    return ret;
+}
+
+/*
+ * Convert the image to the base format in the contiguous buffer of
+ * the library, placed after the image if the image is there. Only the
+ * region to encode is converted. JPU must be locked by the caller, as
+ * the buffer is shared.
+ */
+
+static int
+encode_convert(shjpeg_internal_t	*data,
+	       shjpeg_context_t		*context,
+	       const shjpeg_format_t	*fmt,
+	       unsigned long		*phys,
+	       int			 width,
+	       int			 height,
+	       int			*pitch)
+{
+    const shjpeg_format_t *base = shjpeg_format_get(fmt->base);
+    unsigned long	buf	= data->jpeg_data;
+    unsigned long	buf_end = data->jpeg_phys + data->jpeg_size;
+    int			src_size, dst_size, dst_pitch;
+    shjpeg_planes_t	src, dst;
+    shjpeg_map_t	map;
+    shjpeg_rect_t	rect;
+
+    src_size  = shjpeg_get_frame_size(fmt->info.format, *pitch, height);
+    dst_pitch = (width * base->info.bytes_per_pixel + 7) & ~7;
+    dst_size  = shjpeg_get_frame_size(base->info.format, dst_pitch, height);
+
+    if ((*phys < buf_end) && (*phys + src_size > buf))
+	buf = _PAGE_ALIGN(*phys + src_size);
+
+    if (buf + dst_size > buf_end) {
+	D_ERROR("libshjpeg: no memory to convert %s image of %dx%d.",
+		fmt->info.name, width, height);
+	return -1;
+    }
+
+    if (shjpeg_map(data, *phys, src_size, &map) < 0)
+	return -1;
+
+    shjpeg_format_planes(fmt, map.addr, *pitch, height, &src);
+    shjpeg_format_planes(base, data->jpeg_virt + (buf - data->jpeg_phys),
+			 dst_pitch, height, &dst);
+
+    encode_region(context, width, height, &rect);
+    shjpeg_format_convert(fmt, fmt->to_base, &src, 0, &dst, &rect, height);
+
+    shjpeg_unmap(&map);
+
+    *phys  = buf;
+    *pitch = dst_pitch;
+
+    return 0;
+}
+
+/*
+ * Rate control
+ *
+ * The size of an encoded image is roughly inversely proportional to
+ * the scale of the quantization tables, thus the scale for the next
+ * image is derived from the size and the scale of the previous one.
+ * The scale is the percentage jpeg_set_quality() multiplies the base
+ * tables by.
+ */
+
+#define RC_DEFAULT_QUALITY	75
+#define RC_MAX_STEP		2	// max change of the scale per image
+#define RC_TOLERANCE		10	// accepted overshoot in percent
+#define RC_BUFFER_CHUNK		(64 * 1024)
+
+static inline int
+rc_quality_to_scale(int quality)
+{
+    int scale = (quality < 50) ? 5000 / quality : 200 - quality * 2;
+
+    return (scale < 1) ? 1 : scale;
+}
+
+static inline int
+rc_scale_to_quality(int scale)
+{
+    int quality;
+
+    if (scale >= 100)
+	quality = (5000 + scale / 2) / scale;
+    else
+	quality = (200 - scale + 1) / 2;
+
+    if (quality < 1)
+	quality = 1;
+    if (quality > 100)
+	quality = 100;
+
+    return quality;
+}
+
+static inline bool
+rc_enabled(shjpeg_context_t *context)
+{
+    return (context->encode_target_size > 0) ||
+	((context->encode_bitrate > 0) && (context->encode_framerate > 0));
+}
+
+/*
+ * Get the size in bytes the next image should fit in.
+ */
+
+static int
+rc_target(shjpeg_context_t *context, shjpeg_rc_t *rc)
+{
+    int target = context->encode_target_size;
+
+    if ((context->encode_bitrate > 0) && (context->encode_framerate > 0)) {
+	long budget = context->encode_bitrate / 8 / context->encode_framerate;
+	long share  = budget - rc->debt / context->encode_framerate;
+
+	/* pay back the debt within a second, but not all at once */
+	if (share < budget / 4)
+	    share = budget / 4;
+
+	if ((target <= 0) || (share < target))
+	    target = share;
+    }
+
+    return (target < 1) ? 1 : target;
+}
+
+static int
+rc_next_scale(int scale, int size, int target)
+{
+    long next = (long)scale * size / target;
+
+    if (next > (long)scale * RC_MAX_STEP)
+	next = (long)scale * RC_MAX_STEP;
+    if (next < scale / RC_MAX_STEP)
+	next = scale / RC_MAX_STEP;
+
+    if (next < 1)
+	next = 1;
+    if (next > 5000)
+	next = 5000;
+
+    return next;
+}
+
+static void
+rc_update_debt(shjpeg_context_t *context, shjpeg_rc_t *rc, int size)
+{
+    long budget, limit;
+
+    if ((context->encode_bitrate <= 0) || (context->encode_framerate <= 0))
+	return;
+
+    budget = context->encode_bitrate / 8 / context->encode_framerate;
+    limit  = context->encode_bitrate / 8;
+
+    rc->debt += size - budget;
+
+    /* don't let a long still scene save up for a burst */
+    if (rc->debt > limit)
+	rc->debt = limit;
+    if (rc->debt < -limit)
+	rc->debt = -limit;
+}
+
+/*
+ * Stream operations to hold an image back until its size is accepted.
+ */
+
+static int
+rc_buffer_init(void *private)
+{
+    shjpeg_rc_t *rc = (shjpeg_rc_t*)private;
+
+    rc->buf_len   = 0;
+    rc->buf_error = 0;
+
+    return 0;
+}
+
+static int
+rc_buffer_write(void *private, size_t *nbytes, void *dataptr)
+{
+    shjpeg_rc_t *rc = (shjpeg_rc_t*)private;
+
+    if (rc->buf_size - rc->buf_len < *nbytes) {
+	size_t size = (rc->buf_len + *nbytes + RC_BUFFER_CHUNK - 1) &
+	    ~(RC_BUFFER_CHUNK - 1);
+	void *buf = realloc(rc->buf, size);
+
+	if (!buf) {
+	    rc->buf_error = 1;
+	    return -1;
+	}
+
+	rc->buf	     = buf;
+	rc->buf_size = size;
+    }
+
+    memcpy(rc->buf + rc->buf_len, dataptr, *nbytes);
+    rc->buf_len += *nbytes;
+
+    return 0;
+}
+
+static shjpeg_sops rc_buffer_sops = {
+    .init     = rc_buffer_init,
+    .read     = NULL,
+    .write    = rc_buffer_write,
+    .finalize = NULL,
+};
+
+/*
+ * Get the rate control state of the stream of the context. Each
+ * context has its own, started when the first image is encoded.
+ */
+
+static shjpeg_rc_t *
+rc_state(shjpeg_context_t *context)
+{
+    if (!context->encode_rc)
+	context->encode_rc = calloc(1, sizeof(shjpeg_rc_t));
+
+    return (shjpeg_rc_t*)context->encode_rc;
+}
+
+/*
+ * Encode the image with the quality chosen by rate control, and
+ * re-encode it with a coarser one while it exceeds the target.
+ */
+
+static int
+encode_rc(shjpeg_internal_t	 *data,
+	  shjpeg_context_t	 *context,
+	  shjpeg_pixelformat	  format,
+	  unsigned long		  phys,
+	  unsigned long		  c_phys,
+	  int		 	  width,
+	  int		 	  height,
+	  int			  pitch,
+	  shjpeg_encode_output_t *output,
+	  int			 *quality)
+{
+    shjpeg_encode_output_t trial = *output;
+    shjpeg_rc_t *rc = rc_state(context);
+    int retries = context->encode_max_retries;
+    int target, size, scale;
+
+    if (!rc) {
+	D_ERROR("libshjpeg: no memory for rate control.");
+	return -1;
+    }
+
+    target = rc_target(context, rc);
+
+    if (!rc->scale)
+	rc->scale = rc_quality_to_scale(context->encode_quality ?
+					context->encode_quality :
+					RC_DEFAULT_QUALITY);
+
+    if (retries > 0) {
+	trial.sops    = &rc_buffer_sops;
+	trial.private = rc;
+    }
+
+    for (;;) {
+	*quality = rc_scale_to_quality(rc->scale);
+
+	if (encode_hw(data, context, format, phys, c_phys, width, height,
+		      pitch, &trial, *quality, &size, NULL))
+	    return -1;
+
+	scale = rc_next_scale(rc->scale, size, target);
+
+	D_INFO("libshjpeg: rate control: quality %d, %d bytes (target %d)",
+	       *quality, size, target);
+
+	if ((retries-- <= 0) || (*quality == 1) ||
+	    ((long)size * 100 <= (long)target * (100 + RC_TOLERANCE)))
+	    break;
+
+	rc->scale = scale;
+    }
+
+    rc->scale = scale;
+    rc_update_debt(context, rc, size);
+
+    output->num_restarts = trial.num_restarts;
+
+    /* pass the accepted image to the caller */
+    if (trial.sops == &rc_buffer_sops) {
+	shjpeg_sops *sops = output->sops ? output->sops : context->sops;
+	size_t len = rc->buf_len;
+
+	if (rc->buf_error) {
+	    D_ERROR("libshjpeg: no memory to hold the encoded image.");
+	    return -1;
+	}
+
+	if (sops->init)
+	    sops->init(output->private);
+	sops->write(output->private, &len, rc->buf);
+    }
+
+    return 0;
+}
+
+/*
+ * Check the encoding settings of the context.
+ */
+
+static int
+encode_check_settings(shjpeg_context_t *context)
+{
+    int i;
+
+    if ((context->encode_quality < 0) || (context->encode_quality > 100)) {
+	D_ERROR("libshjpeg: invalid quality %d.", context->encode_quality);
+	return -1;
+    }
+
+    if ((context->encode_restart_interval < SHJPEG_RESTART_NONE) ||
+	(context->encode_restart_interval > 0xffff)) {
+	D_ERROR("libshjpeg: invalid restart interval %d.",
+		context->encode_restart_interval);
+	return -1;
+    }
+
+    if ((context->encode_num_markers > 0) && !context->encode_markers) {
+	D_ERROR("libshjpeg: no markers to write.");
+	return -1;
+    }
+
+    for (i = 0; i < context->encode_num_markers; i++) {
+	const shjpeg_marker_t *marker = &context->encode_markers[i];
+
+	if ((marker->marker != JPEG_COM) &&
+	    ((marker->marker < JPEG_APP0) || (marker->marker > JPEG_APP0 + 15))) {
+	    D_ERROR("libshjpeg: marker 0x%02x can't be written.",
+		    marker->marker);
+	    return -1;
+	}
+
+	if ((marker->length > 65533) || (marker->length && !marker->data)) {
+	    D_ERROR("libshjpeg: invalid length %u of marker 0x%02x.",
+		    marker->length, marker->marker);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Encode the image for each output while the JPU is locked.
+ */
+
+static int
+encode_outputs(shjpeg_context_t	      *context,
+	       shjpeg_pixelformat      format,
+	       unsigned long	       phys,
+	       unsigned long	       c_phys,
+	       int		       width,
+	       int		       height,
+	       int		       pitch,
+	       shjpeg_encode_output_t *outputs,
+	       int		       num_outputs)
+{
+    shjpeg_internal_t *data;
+    const shjpeg_format_t *fmt;
+    shjpeg_rect_t rect;
+    int out_width, out_height;
+    int quality;
+    int i, ret = 0;
+
+    if (!context) {
+	D_ERROR("libjpeg: invalid context passed.");
+	return -1;
+    }
+
+    data = (shjpeg_internal_t*)context->internal_data;
+
+    /* check ref counter */
+    if (!data->ref_count) {
+        D_ERROR("libshjpeg: not initialized yet.");
+        return -1;
+    }
+
+    /* if physical address is not given, use the default */
+    if (phys == SHJPEG_USE_DEFAULT_BUFFER)
+	phys = data->jpeg_data;
+
+    fmt = shjpeg_format_get(format);
+    if (!fmt) {
+	D_ERROR("libshjpeg: unsupported source format %08x.", format);
+	return -1;
+    }
+
+    /* GRAY8 shares a line buffer of neutral chroma with JPU */
+    if ((format == SHJPEG_PF_GRAY8) &&
+	(pitch * SHJPEG_JPU_LINEBUFFER_HEIGHT / 2 > SHJPEG_JPU_LINEBUFFER_SIZE_Y)) {
+	D_ERROR("libshjpeg: pitch %d is too large for GRAY8.", pitch);
+	return -1;
+    }
+
+    /* check the region and the sizes to encode */
+    encode_region(context, width, height, &rect);
+
+    if ((rect.w <= 0) || (rect.h <= 0)) {
+	D_ERROR("libshjpeg: crop region is outside of the image.");
+	return -1;
+    }
+
+    /* JPU reads GRAY8 directly, only 8 bytes aligned */
+    if ((format == SHJPEG_PF_GRAY8) && ((rect.x | pitch) & 0x7)) {
+	D_ERROR("libshjpeg: GRAY8 region must be 8 pixels aligned.");
+	return -1;
+    }
+
+    /*
+     * The last band of 16 lines is read as a whole, which must stay in
+     * the image unless it's in the buffer of the library.
+     */
+    if (format == SHJPEG_PF_GRAY8) {
+	int lines = rect.y + ((rect.h + SHJPEG_JPU_LINEBUFFER_HEIGHT - 1) &
+			      ~(SHJPEG_JPU_LINEBUFFER_HEIGHT - 1));
+
+	if ((lines > height) &&
+	    ((phys < data->jpeg_data) ||
+	     (phys + lines * pitch > data->jpeg_phys + data->jpeg_size))) {
+	    D_ERROR("libshjpeg: GRAY8 image must be padded to %d lines.",
+		    SHJPEG_JPU_LINEBUFFER_HEIGHT);
+	    return -1;
+	}
+    }
+
+    if (encode_check_settings(context))
+	return -1;
+
+    for (i = 0; i < num_outputs; i++) {
+	encode_output_size(&outputs[i], &rect, &out_width, &out_height);
+
+	if (((out_width != rect.w) || (out_height != rect.h)) &&
+	    (format == SHJPEG_PF_GRAY8)) {
+	    D_ERROR("libshjpeg: GRAY8 can't be resized.");
+	    return -1;
+	}
+
+	if (((out_width != rect.w) || (out_height != rect.h)) &&
+	    (!shjpeg_veu_can_resize(rect.w, out_width) ||
+	     !shjpeg_veu_can_resize(rect.h, out_height))) {
+	    D_ERROR("libshjpeg: VEU can't resize %dx%d to %dx%d.",
+		    rect.w, rect.h, out_width, out_height);
+	    return -1;
+	}
+
+	/* wide images are encoded in strips, which can't be resized */
+	if (((out_width != rect.w) || (out_height != rect.h)) &&
+	    (out_width > SHJPEG_JPU_LINEBUFFER_PITCH)) {
+	    D_ERROR("libshjpeg: can't resize to more than %d pixels wide.",
+		    SHJPEG_JPU_LINEBUFFER_PITCH);
+	    return -1;
+	}
+    }
+
+    D_DEBUG_AT( SH7722_JPEG, "	 -> locking JPU...");
+
+    /* Locking JPU using lockf(3) */
+    if ( !data->jpu_held && lockf( data->jpu_uio_fd, F_LOCK, 0 ) < 0 ) {
+	D_PERROR( "libshjpeg: Could not lock JPEG engine!");
+	return -1;
+    }
+
+    /* formats VEU can't read are converted first */
+    if (fmt->to_base &&
+	encode_convert(data, context, fmt, &phys, width, height, &pitch)) {
+	ret = -1;
+	goto unlock;
+    }
+    format = fmt->base;
+
+    /* the CbCr plane follows the Y plane unless given */
+    if (!c_phys)
+	c_phys = phys + pitch * height;
+
+    /* start hardware encoding */
+    quality = context->encode_quality;
+    i = 0;
+
+    /*
+     * Rate control chooses the quality by the first output, and the
+     * others are encoded with the same quality.
+     */
+    if (rc_enabled(context)) {
+	ret = encode_rc(data, context, format, phys, c_phys,
+			width, height, pitch, &outputs[0], &quality);
+	i = 1;
+    }
+
+    for (; (i < num_outputs) && !ret; i++)
+	ret = encode_hw(data, context, format, phys, c_phys,
+			width, height, pitch, &outputs[i], quality, NULL, NULL);
+
+    context->encode_last_quality = quality;
+
+ unlock:
+    /* Unlocking JPU using lockf(3) */
+    if ( !data->jpu_held && lockf(data->jpu_uio_fd, F_ULOCK, 0 ) < 0 ) {
+	ret = -1;
 	D_PERROR( "libshjpeg: Could not unlock JPEG engine!");
     }
 
-    close(fd);
+    return ret;
+}
+
+/*
+ * Encode a single image to the stream of the context.
+ */
+
+static int
+encode_image(shjpeg_context_t	*context,
+	     shjpeg_pixelformat	 format,
+	     unsigned long	 phys,
+	     unsigned long	 c_phys,
+	     int		 width,
+	     int		 height,
+	     int		 pitch)
+{
+    shjpeg_encode_output_t output;
+    int ret;
+
+    output.width	   = context->encode_width;
+    output.height	   = context->encode_height;
+    output.sops		   = context->sops;
+    output.private	   = context->private;
+    output.restart_offsets = context->encode_restart_offsets;
+    output.max_restarts	   = context->encode_max_restarts;
+    output.num_restarts	   = 0;
+
+    ret = encode_outputs(context, format, phys, c_phys, width, height, pitch,
+			 &output, 1);
+
+    context->encode_num_restarts = output.num_restarts;
 
     return ret;
 }
@@ -295,8 +1519,97 @@ shjpeg_encode(shjpeg_context_t	*context,
 	      int		 width,
 	      int		 height,
 	      int		 pitch)
+{
+    if (!context) {
+	D_ERROR("libjpeg: invalid context passed.");
+	return -1;
+    }
+
+    return encode_image(context, format, phys, 0, width, height, pitch);
+}
+
+/*
+ * shpjpeg_encode_frame()
+ */
+
+int
+shjpeg_encode_frame(shjpeg_context_t	 *context,
+		    shjpeg_pixelformat	  format,
+		    const shjpeg_frame_t *frame,
+		    int			  width,
+		    int			  height)
+{
+    shjpeg_internal_t *data;
+    const shjpeg_format_t *fmt;
+
+    if (!context) {
+	D_ERROR("libjpeg: invalid context passed.");
+	return -1;
+    }
+
+    data = (shjpeg_internal_t*)context->internal_data;
+
+    /* check ref counter */
+    if (!data->ref_count) {
+        D_ERROR("libshjpeg: not initialized yet.");
+        return -1;
+    }
+
+    fmt = shjpeg_format_get(format);
+    if (!fmt) {
+	D_ERROR("libshjpeg: unsupported source format %08x.", format);
+	return -1;
+    }
+
+    if (shjpeg_format_check_frame(data, fmt, frame))
+	return -1;
+
+    return encode_image(context, format, frame->phys, frame->c_phys,
+			width, height, frame->pitch);
+}
+
+/*
+ * shpjpeg_encode_multi()
+ */
+
+int
+shjpeg_encode_multi(shjpeg_context_t	   *context,
+		    shjpeg_pixelformat	    format,
+		    unsigned long	    phys,
+		    int			    width,
+		    int			    height,
+		    int			    pitch,
+		    shjpeg_encode_output_t *outputs,
+		    int			    num_outputs)
+{
+    if (!outputs || (num_outputs <= 0)) {
+	D_ERROR("libshjpeg: no output to encode.");
+	return -1;
+    }
+
+    return encode_outputs(context, format, phys, 0, width, height, pitch,
+			  outputs, num_outputs);
+}
+
+/*
+ * shpjpeg_encode_bands()
+ */
+
+int
+shjpeg_encode_bands(shjpeg_context_t	*context,
+		    shjpeg_pixelformat	 format,
+		    int			 width,
+		    int			 height,
+		    int			 pitch,
+		    shjpeg_band_func	 func,
+		    void		*private)
 {
     shjpeg_internal_t *data;
+    const shjpeg_format_t *fmt;
+    shjpeg_encode_output_t output;
+    shjpeg_rect_t crop;
+    encode_band_t band;
+    int ret;
 
     if (!context) {
 	D_ERROR("libjpeg: invalid context passed.");
@@ -311,24 +1624,479 @@ shjpeg_encode(shjpeg_context_t	*context,
         return -1;
     }
 
+    fmt = shjpeg_format_get(format);
+    if (!fmt || (fmt->base != format)) {
+	D_ERROR("libshjpeg: Unsupported band format.");
+	return -1;
+    }
+
+    if (!func) {
+	D_ERROR("libshjpeg: no callback to fill the bands.");
+	return -1;
+    }
+
+    if ((width <= 0) || (height <= 0)) {
+	D_ERROR("libshjpeg: invalid image size %dx%d.", width, height);
+	return -1;
+    }
+
+    /* bands are read through the line buffers, and can't be tiled */
+    if ((format != SHJPEG_PF_GRAY8) && (width > SHJPEG_JPU_LINEBUFFER_PITCH)) {
+	D_ERROR("libshjpeg: can't encode bands wider than %d pixels.",
+		SHJPEG_JPU_LINEBUFFER_PITCH);
+	return -1;
+    }
+
+    if (!pitch)
+	pitch = (width * fmt->info.bytes_per_pixel + 7) & ~7;
+
+    if ((width * fmt->info.bytes_per_pixel > pitch) || (pitch & 0x7)) {
+	D_ERROR("libshjpeg: pitch %d doesn't fit.", pitch);
+	return -1;
+    }
+
+    /* GRAY8 shares a line buffer of neutral chroma with JPU */
+    if ((format == SHJPEG_PF_GRAY8) &&
+	(pitch * SHJPEG_JPU_LINEBUFFER_HEIGHT / 2 > SHJPEG_JPU_LINEBUFFER_SIZE_Y)) {
+	D_ERROR("libshjpeg: pitch %d is too large for GRAY8.", pitch);
+	return -1;
+    }
+
+    if (encode_check_settings(context))
+	return -1;
+
+    memset(&band, 0, sizeof(band));
+    band.func	      = func;
+    band.private      = private;
+    band.band.format  = format;
+    band.band.width   = width;
+    band.band.pitch   = pitch;
+    band.c_offset     = pitch * SHJPEG_JPU_LINEBUFFER_HEIGHT;
+    band.size	      = (shjpeg_get_frame_size(format, pitch,
+					       SHJPEG_JPU_LINEBUFFER_HEIGHT)
+			 + 7) & ~7;
+    band.phys	      = data->jpeg_data;
+    band.virt	      = data->jpeg_virt + (data->jpeg_data - data->jpeg_phys);
+
+    /* two band buffers must fit in the contiguous memory */
+    if (band.size * 2 > data->jpeg_size - SHJPEG_JPU_SIZE) {
+	D_ERROR("libshjpeg: no memory for bands of pitch %d.", pitch);
+	return -1;
+    }
+
+    output.width	   = 0;
+    output.height	   = 0;
+    output.sops		   = context->sops;
+    output.private	   = context->private;
+    output.restart_offsets = context->encode_restart_offsets;
+    output.max_restarts	   = context->encode_max_restarts;
+    output.num_restarts	   = 0;
+
+    D_DEBUG_AT( SH7722_JPEG, "	 -> locking JPU...");
+
+    /* Locking JPU using lockf(3) */
+    if ( !data->jpu_held && lockf( data->jpu_uio_fd, F_LOCK, 0 ) < 0 ) {
+	D_PERROR( "libshjpeg: Could not lock JPEG engine!");
+	return -1;
+    }
+
+    /* the whole image is encoded */
+    crop = context->encode_crop;
+    memset(&context->encode_crop, 0, sizeof(context->encode_crop));
+
+    ret = encode_hw(data, context, format, band.phys, 0, width, height,
+		    pitch, &output, context->encode_quality, NULL, &band);
+
+    context->encode_crop	 = crop;
+    context->encode_last_quality = context->encode_quality;
+    context->encode_num_restarts = output.num_restarts;
+
+    /* Unlocking JPU using lockf(3) */
+    if ( !data->jpu_held && lockf(data->jpu_uio_fd, F_ULOCK, 0 ) < 0 ) {
+	ret = -1;
+	D_PERROR( "libshjpeg: Could not unlock JPEG engine!");
+    }
+
+    return ret;
+}
+
+/*
+ * Motion JPEG encoder
+ *
+ * Frames of a stream share the format, the geometry and the encoding
+ * settings, so the JPU is programmed once and only the source address
+ * changes. The JPU is programmed again only when someone else has run
+ * it in between, or it may have been when the JPU is locked per frame.
+ * Each frame is written to one of two buffers in turn, so that it can
+ * be sent while the next one is encoded.
+ */
+
+typedef struct {
+    u8			*buf;
+    size_t		 size;
+    size_t		 len;
+    int			 error;
+} mjpeg_buffer_t;
+
+struct shjpeg_mjpeg_struct {
+    shjpeg_context_t	*context;
+    shjpeg_internal_t	*data;
+    shjpeg_mjpeg_lock	 lock;
+    int			 jpu_held;	// of the library when opened
+
+    /* settings taken when opened */
+    bool		 mode420;
+    int			 interval;
+    int			 width, height;	// encoded size
+    int			 pitch;
+    unsigned long	 y_offset;	// region in the source frame
+    unsigned long	 c_offset;
+    const unsigned int *const *quant_tables;
+
+    /* rate control state of the stream */
+    shjpeg_rc_t		 rc;
+
+    /* JPU state */
+    bool		 programmed;	// registers hold the settings
+    unsigned int	 jpu_starts;	// JPU runs when programmed
+    int			 quality;	// in the QT registers
+
+    mjpeg_buffer_t	 buffers[2];
+    unsigned int	 sequence;
+};
+
+static int
+mjpeg_buffer_init(void *private)
+{
+    mjpeg_buffer_t *buffer = (mjpeg_buffer_t*)private;
+
+    buffer->len   = 0;
+    buffer->error = 0;
+
+    return 0;
+}
+
+static int
+mjpeg_buffer_write(void *private, size_t *nbytes, void *dataptr)
+{
+    mjpeg_buffer_t *buffer = (mjpeg_buffer_t*)private;
+
+    if (buffer->size - buffer->len < *nbytes) {
+	size_t size = (buffer->len + *nbytes + SHJPEG_JPU_RELOAD_SIZE - 1) &
+	    ~(SHJPEG_JPU_RELOAD_SIZE - 1);
+	void *buf = realloc(buffer->buf, size);
+
+	if (!buf) {
+	    buffer->error = 1;
+	    return -1;
+	}
+
+	buffer->buf  = buf;
+	buffer->size = size;
+    }
+
+    memcpy(buffer->buf + buffer->len, dataptr, *nbytes);
+    buffer->len += *nbytes;
+
+    return 0;
+}
+
+static shjpeg_sops mjpeg_buffer_sops = {
+    .init     = mjpeg_buffer_init,
+    .read     = NULL,
+    .write    = mjpeg_buffer_write,
+    .finalize = NULL,
+};
+
+/*
+ * Encode a frame at phys with quality. JPU must be locked by the
+ * caller.
+ */
+
+static int
+mjpeg_encode(shjpeg_mjpeg_t	    *mjpeg,
+	     unsigned long	     phys,
+	     int		     quality,
+	     shjpeg_encode_output_t *output,
+	     int		    *size)
+{
+    shjpeg_context_t  *context = mjpeg->context;
+    shjpeg_internal_t *data    = mjpeg->data;
+    u32			yaddr	= phys + mjpeg->y_offset;
+    u32			caddr	= phys + mjpeg->c_offset;
+    encode_index_t	index;
+    shjpeg_jpu_t	jpeg;
+    int			ret;
+
+    if (!mjpeg->programmed || (mjpeg->jpu_starts != data->jpu_starts) ||
+	(mjpeg->lock == SHJPEG_MJPEG_LOCK_FRAME)) {
+	D_DEBUG_AT(SH7722_JPEG, "	 -> programming...");
+
+	encode_hw_setup(data, mjpeg->mode420, mjpeg->interval,
+			mjpeg->width, mjpeg->height);
+	encode_hw_direct(data, mjpeg->mode420, yaddr, caddr, mjpeg->pitch);
+	shjpeg_jpu_init_quantization_table(data, quality,
+					   mjpeg->quant_tables);
+	shjpeg_jpu_init_huffman_table(data);
+    }
+    else {
+	/* the JPU still holds the settings of the previous frame */
+	shjpeg_jpu_setreg32(data, JPU_JIFESYA1, yaddr);
+	shjpeg_jpu_setreg32(data, JPU_JIFESCA1, caddr);
+
+	if (quality != mjpeg->quality)
+	    shjpeg_jpu_init_quantization_table(data, quality,
+					       mjpeg->quant_tables);
+    }
+
+    mjpeg_buffer_init(output->private);
+    encode_index_init(&index, output);
+
+    jpeg.state	 = SHJPEG_JPU_START;
+    jpeg.flags	 = SHJPEG_JPU_FLAG_ENCODE | SHJPEG_JPU_FLAG_RELOAD;
+    jpeg.buffers = 3;
+
+    ret = encode_hw_run(data, context, output, output->sops, &index,
+			&jpeg, size);
+
+    /* start from reset after an error */
+    mjpeg->programmed = !ret;
+    mjpeg->jpu_starts = data->jpu_starts;
+    mjpeg->quality    = quality;
+
+    return ret;
+}
+
+/*
+ * shjpeg_mjpeg_open()
+ */
+
+shjpeg_mjpeg_t *
+shjpeg_mjpeg_open(shjpeg_context_t	*context,
+		  shjpeg_pixelformat	 format,
+		  int			 width,
+		  int			 height,
+		  int			 pitch,
+		  shjpeg_mjpeg_lock	 lock)
+{
+    shjpeg_internal_t *data;
+    shjpeg_encode_output_t output;
+    shjpeg_mjpeg_t *mjpeg;
+    shjpeg_rect_t rect;
+    int out_width, out_height;
+
+    if (!context)
+	return NULL;
+
+    data = (shjpeg_internal_t*)context->internal_data;
+
+    /* check ref counter */
+    if (!data->ref_count) {
+        D_ERROR("libshjpeg: not initialized yet.");
+        return NULL;
+    }
+
+    /* frames are read by the JPU directly */
+    if ((format != SHJPEG_PF_NV12) && (format != SHJPEG_PF_NV16)) {
+	D_ERROR("libshjpeg: can't encode %08x as Motion JPEG.", format);
+	return NULL;
+    }
+
+    if ((lock != SHJPEG_MJPEG_LOCK_FRAME) &&
+	(lock != SHJPEG_MJPEG_LOCK_SESSION)) {
+	D_ERROR("libshjpeg: invalid lock policy %d.", lock);
+	return NULL;
+    }
+
+    if (encode_check_settings(context))
+	return NULL;
+
+    encode_region(context, width, height, &rect);
+
+    if ((rect.w <= 0) || (rect.h <= 0)) {
+	D_ERROR("libshjpeg: crop region is outside of the image.");
+	return NULL;
+    }
+
+    memset(&output, 0, sizeof(output));
+    output.width  = context->encode_width;
+    output.height = context->encode_height;
+    encode_output_size(&output, &rect, &out_width, &out_height);
+
+    /* JPU reads directly only 8 bytes aligned */
+    if ((out_width != rect.w) || (out_height != rect.h) || (rect.x & 0x7) ||
+	(pitch & 0x7)) {
+	D_ERROR("libshjpeg: Motion JPEG can't be resized, "
+		"and must be 8 pixels aligned.");
+	return NULL;
+    }
+
+    if (!(mjpeg = calloc(1, sizeof(shjpeg_mjpeg_t)))) {
+	D_ERROR("libshjpeg: no memory for Motion JPEG encoder.");
+	return NULL;
+    }
+
+    mjpeg->context	= context;
+    mjpeg->data		= data;
+    mjpeg->lock		= lock;
+    mjpeg->mode420	= (format == SHJPEG_PF_NV12);
+    mjpeg->interval	= encode_restart_interval(context, out_width);
+    mjpeg->width	= out_width;
+    mjpeg->height	= out_height;
+    mjpeg->pitch	= pitch;
+    mjpeg->y_offset	= rect.y * pitch + rect.x;
+    mjpeg->c_offset	= pitch * height + rect.x +
+	(mjpeg->mode420 ? rect.y / 2 : rect.y) * pitch;
+    mjpeg->quant_tables = context->encode_quant_tables;
+
+    mjpeg->jpu_held = data->jpu_held;
+
+    if (lock == SHJPEG_MJPEG_LOCK_SESSION) {
+	D_DEBUG_AT( SH7722_JPEG, "	 -> locking JPU...");
+
+	if (!mjpeg->jpu_held && lockf(data->jpu_uio_fd, F_LOCK, 0) < 0) {
+	    D_PERROR( "libshjpeg: Could not lock JPEG engine!");
+	    free(mjpeg);
+	    return NULL;
+	}
+
+	/* other calls on the context run while the session holds JPU */
+	data->jpu_held = 1;
+    }
+
+    return mjpeg;
+}
+
+/*
+ * shjpeg_mjpeg_encode_frame()
+ */
+
+int
+shjpeg_mjpeg_encode_frame(shjpeg_mjpeg_t	*mjpeg,
+			  unsigned long		 phys,
+			  int64_t		 timestamp,
+			  shjpeg_mjpeg_frame_t	*frame)
+{
+    shjpeg_context_t	  *context;
+    shjpeg_internal_t	  *data;
+    mjpeg_buffer_t	  *buffer;
+    shjpeg_encode_output_t output;
+    struct timeval	   start, end;
+    bool		   rc;
+    int			   target = 0, retries = 0;
+    int			   quality, size = 0, scale = 0;
+    int			   ret = 0;
+
+    if (!mjpeg || !frame)
+	return -1;
+
+    context = mjpeg->context;
+    data    = mjpeg->data;
+    buffer  = &mjpeg->buffers[mjpeg->sequence & 1];
+
     /* if physical address is not given, use the default */
     if (phys == SHJPEG_USE_DEFAULT_BUFFER)
 	phys = data->jpeg_data;
 
-    switch (format) {
-    case SHJPEG_PF_NV12:
-    case SHJPEG_PF_NV16:
-    case SHJPEG_PF_RGB16:
-    case SHJPEG_PF_RGB32:
-    case SHJPEG_PF_RGB24:
-	break;
+    memset(&output, 0, sizeof(output));
+    output.sops	   = &mjpeg_buffer_sops;
+    output.private = buffer;
 
-    default:
+    /* the quality is chosen as by shjpeg_encode() */
+    rc = rc_enabled(context);
+    if (rc) {
+	target	= rc_target(context, &mjpeg->rc);
+	retries = context->encode_max_retries;
+
+	if (!mjpeg->rc.scale)
+	    mjpeg->rc.scale = rc_quality_to_scale(context->encode_quality ?
+						  context->encode_quality :
+						  RC_DEFAULT_QUALITY);
+    }
+
+    if ((mjpeg->lock == SHJPEG_MJPEG_LOCK_FRAME) && !data->jpu_held &&
+	lockf(data->jpu_uio_fd, F_LOCK, 0) < 0) {
+	D_PERROR( "libshjpeg: Could not lock JPEG engine!");
 	return -1;
     }
 
-    /* TODO: Support for clipping and resize */
+    gettimeofday(&start, NULL);
 
-    /* start hardware encoding */
-    return encode_hw(data, context, format, phys, width, height, pitch);
+    for (;;) {
+	quality = rc ? rc_scale_to_quality(mjpeg->rc.scale) :
+	    context->encode_quality;
+
+	ret = mjpeg_encode(mjpeg, phys, quality, &output, &size);
+	if (ret || !rc)
+	    break;
+
+	scale = rc_next_scale(mjpeg->rc.scale, size, target);
+
+	if ((retries-- <= 0) || (quality == 1) ||
+	    ((long)size * 100 <= (long)target * (100 + RC_TOLERANCE)))
+	    break;
+
+	mjpeg->rc.scale = scale;
+    }
+
+    gettimeofday(&end, NULL);
+
+    if ((mjpeg->lock == SHJPEG_MJPEG_LOCK_FRAME) && !data->jpu_held &&
+	lockf(data->jpu_uio_fd, F_ULOCK, 0) < 0) {
+	ret = -1;
+	D_PERROR( "libshjpeg: Could not unlock JPEG engine!");
+    }
+
+    if (!ret && buffer->error) {
+	D_ERROR("libshjpeg: no memory to hold the encoded frame.");
+	ret = -1;
+    }
+
+    if (ret)
+	return -1;
+
+    if (rc) {
+	mjpeg->rc.scale = scale;
+	rc_update_debt(context, &mjpeg->rc, size);
+    }
+
+    context->encode_last_quality = quality;
+
+    frame->data	       = buffer->buf;
+    frame->size	       = buffer->len;
+    frame->timestamp   = timestamp;
+    frame->encode_time = (int64_t)(end.tv_sec - start.tv_sec) * 1000000 +
+	(end.tv_usec - start.tv_usec);
+    frame->sequence    = mjpeg->sequence++;
+    frame->quality     = quality;
+
+    return 0;
+}
+
+/*
+ * shjpeg_mjpeg_close()
+ */
+
+void
+shjpeg_mjpeg_close(shjpeg_mjpeg_t *mjpeg)
+{
+    shjpeg_context_t  *context;
+    shjpeg_internal_t *data;
+
+    if (!mjpeg)
+	return;
+
+    context = mjpeg->context;
+    data    = mjpeg->data;
+
+    if (mjpeg->lock == SHJPEG_MJPEG_LOCK_SESSION) {
+	data->jpu_held = mjpeg->jpu_held;
+
+	if (!mjpeg->jpu_held && lockf(data->jpu_uio_fd, F_ULOCK, 0) < 0)
+	    D_PERROR( "libshjpeg: Could not unlock JPEG engine!");
+    }
+
+    free(mjpeg->buffers[0].buf);
+    free(mjpeg->buffers[1].buf);
+    free(mjpeg);
 }
@@ -0,0 +1,545 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ * Copyright (C) 2008,2009 Renesas Technology Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA	 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <shjpeg/shjpeg.h>
+#include "shjpeg_internal.h"
+#include "shjpeg_format.h"
+
+/*
+ * Line converters
+ *
+ * Each converts one line of the image between a format and its base
+ * format. Source and destination may be the same memory if the two
+ * formats have the same layout.
+ */
+
+static inline void
+copy_line(u8 *dst, const u8 *src, int len)
+{
+    if (dst != src)
+	memcpy(dst, src, len);
+}
+
+static inline void
+copy_y(const shjpeg_planes_t *src, int sy,
+       const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    copy_line(dst->y + dy * dst->pitch + x,
+	      src->y + sy * src->pitch + x, w);
+}
+
+/* YUYV (yo = 0, co = 1) or UYVY (yo = 1, co = 0) from or to NV16 */
+static inline void
+packed_to_nv16(const shjpeg_planes_t *src, int sy,
+	       const shjpeg_planes_t *dst, int dy, int x, int w,
+	       int yo, int co)
+{
+    const u8 *s  = src->y + sy * src->pitch + x * 2;
+    u8	     *yy = dst->y + dy * dst->pitch + x;
+    u8	     *uv = dst->cb + dy * dst->c_pitch + x;
+    int	      i;
+
+    for (i = 0; i < w; i += 2) {
+	yy[i]	  = s[i * 2 + yo];
+	yy[i + 1] = s[i * 2 + yo + 2];
+	uv[i]	  = s[i * 2 + co];
+	uv[i + 1] = s[i * 2 + co + 2];
+    }
+}
+
+static inline void
+nv16_to_packed(const shjpeg_planes_t *src, int sy,
+	       const shjpeg_planes_t *dst, int dy, int x, int w,
+	       int yo, int co)
+{
+    const u8 *yy = src->y + sy * src->pitch + x;
+    const u8 *uv = src->cb + sy * src->c_pitch + x;
+    u8	     *d	 = dst->y + dy * dst->pitch + x * 2;
+    int	      i;
+
+    for (i = 0; i < w; i += 2) {
+	d[i * 2 + yo]	  = yy[i];
+	d[i * 2 + yo + 2] = yy[i + 1];
+	d[i * 2 + co]	  = uv[i];
+	d[i * 2 + co + 2] = uv[i + 1];
+    }
+}
+
+static void
+yuyv_to_nv16(const shjpeg_planes_t *src, int sy,
+	     const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    packed_to_nv16(src, sy, dst, dy, x, w, 0, 1);
+}
+
+static void
+nv16_to_yuyv(const shjpeg_planes_t *src, int sy,
+	     const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    nv16_to_packed(src, sy, dst, dy, x, w, 0, 1);
+}
+
+static void
+uyvy_to_nv16(const shjpeg_planes_t *src, int sy,
+	     const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    packed_to_nv16(src, sy, dst, dy, x, w, 1, 0);
+}
+
+static void
+nv16_to_uyvy(const shjpeg_planes_t *src, int sy,
+	     const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    nv16_to_packed(src, sy, dst, dy, x, w, 1, 0);
+}
+
+/* NV12 <-> NV21 (v_shift = 1), or NV16 <-> NV61 (v_shift = 0) */
+static inline void
+swap_cbcr(const shjpeg_planes_t *src, int sy,
+	  const shjpeg_planes_t *dst, int dy, int x, int w, int v_shift)
+{
+    const u8 *s;
+    u8	     *d;
+    int	      i;
+
+    copy_y(src, sy, dst, dy, x, w);
+
+    if (sy & ((1 << v_shift) - 1))
+	return;
+
+    s = src->cb + (sy >> v_shift) * src->c_pitch + x;
+    d = dst->cb + (dy >> v_shift) * dst->c_pitch + x;
+
+    for (i = 0; i < w; i += 2) {
+	u8 cb = s[i];
+	u8 cr = s[i + 1];
+
+	d[i]	 = cr;
+	d[i + 1] = cb;
+    }
+}
+
+static void
+swap_cbcr_420(const shjpeg_planes_t *src, int sy,
+	      const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    swap_cbcr(src, sy, dst, dy, x, w, 1);
+}
+
+static void
+swap_cbcr_422(const shjpeg_planes_t *src, int sy,
+	      const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    swap_cbcr(src, sy, dst, dy, x, w, 0);
+}
+
+static void
+i420_to_nv12(const shjpeg_planes_t *src, int sy,
+	     const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    const u8 *u, *v;
+    u8	     *uv;
+    int	      i;
+
+    copy_y(src, sy, dst, dy, x, w);
+
+    if (sy & 1)
+	return;
+
+    u  = src->cb + sy / 2 * src->c_pitch + x / 2;
+    v  = src->cr + sy / 2 * src->c_pitch + x / 2;
+    uv = dst->cb + dy / 2 * dst->c_pitch + x;
+
+    for (i = 0; i < w / 2; i++) {
+	uv[i * 2]     = u[i];
+	uv[i * 2 + 1] = v[i];
+    }
+}
+
+static void
+nv12_to_i420(const shjpeg_planes_t *src, int sy,
+	     const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    const u8 *uv;
+    u8	     *u, *v;
+    int	      i;
+
+    copy_y(src, sy, dst, dy, x, w);
+
+    if (sy & 1)
+	return;
+
+    uv = src->cb + sy / 2 * src->c_pitch + x;
+    u  = dst->cb + dy / 2 * dst->c_pitch + x / 2;
+    v  = dst->cr + dy / 2 * dst->c_pitch + x / 2;
+
+    for (i = 0; i < w / 2; i++) {
+	u[i] = uv[i * 2];
+	v[i] = uv[i * 2 + 1];
+    }
+}
+
+/* RGB24 <-> BGR24 */
+static void
+swap_rb_24(const shjpeg_planes_t *src, int sy,
+	   const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    const u8 *s = src->y + sy * src->pitch + x * 3;
+    u8	     *d = dst->y + dy * dst->pitch + x * 3;
+    int	      i;
+
+    for (i = 0; i < w; i++) {
+	u8 r = s[i * 3];
+	u8 g = s[i * 3 + 1];
+	u8 b = s[i * 3 + 2];
+
+	d[i * 3]     = b;
+	d[i * 3 + 1] = g;
+	d[i * 3 + 2] = r;
+    }
+}
+
+/* RGB32 <-> BGR32 */
+static void
+swap_rb_32(const shjpeg_planes_t *src, int sy,
+	   const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    const u32 *s = (const u32*)(src->y + sy * src->pitch) + x;
+    u32	      *d = (u32*)(dst->y + dy * dst->pitch) + x;
+    int	       i;
+
+    for (i = 0; i < w; i++) {
+	u32 p = s[i];
+
+	d[i] = ((p & 0xff) << 16) | (p & 0xff00ff00) | ((p >> 16) & 0xff);
+    }
+}
+
+/* RGB32 -> ARGB32 */
+static void
+set_alpha(const shjpeg_planes_t *src, int sy,
+	  const shjpeg_planes_t *dst, int dy, int x, int w)
+{
+    const u32 *s = (const u32*)(src->y + sy * src->pitch) + x;
+    u32	      *d = (u32*)(dst->y + dy * dst->pitch) + x;
+    int	       i;
+
+    for (i = 0; i < w; i++)
+	d[i] = s[i] | 0xff000000;
+}
+
+/*
+ * Format table
+ *
+ * VEU converts the native formats. The others are converted by CPU
+ * to or from the base format, which VEU handles instead.
+ */
+
+#define YUV	true
+#define RGB	false
+
+static const shjpeg_format_t formats[] = {
+    { { SHJPEG_PF_RGB16,  "RGB16",  1, 2, 16, 0, 0, RGB, true },
+      SHJPEG_PF_RGB16, NULL, NULL,
+      0x76, (3 << 8) | 3, 0x60, (6 << 16) | 2 },
+
+    { { SHJPEG_PF_RGB24,  "RGB24",  1, 3, 24, 0, 0, RGB, true },
+      SHJPEG_PF_RGB24, NULL, NULL,
+      0x77, (2 << 8) | 3, 0x70, (21 << 16) | 2 },
+
+    { { SHJPEG_PF_RGB32,  "RGB32",  1, 4, 32, 0, 0, RGB, true },
+      SHJPEG_PF_RGB32, NULL, NULL,
+      0x44, (0 << 8) | 3, 0x40, (19 << 16) | 2 },
+
+    { { SHJPEG_PF_NV12,	  "NV12",   2, 1, 12, 1, 1, YUV, true },
+      SHJPEG_PF_NV12, NULL, NULL,
+      0x66, 0, 0x70, 0 },
+
+    { { SHJPEG_PF_NV16,	  "NV16",   2, 1, 16, 1, 0, YUV, true },
+      SHJPEG_PF_NV16, NULL, NULL,
+      0x77, (1 << 14), 0x70, (1 << 22) },
+
+    /* not converted by VEU, see encode_hw() and decode_hw() */
+    { { SHJPEG_PF_GRAY8,  "GRAY8",  1, 1,  8, 0, 0, YUV, true },
+      SHJPEG_PF_GRAY8, NULL, NULL,
+      0, 0, 0, 0 },
+
+    { { SHJPEG_PF_YUYV,	  "YUYV",   1, 2, 16, 1, 0, YUV, false },
+      SHJPEG_PF_NV16, yuyv_to_nv16, nv16_to_yuyv },
+
+    { { SHJPEG_PF_UYVY,	  "UYVY",   1, 2, 16, 1, 0, YUV, false },
+      SHJPEG_PF_NV16, uyvy_to_nv16, nv16_to_uyvy },
+
+    { { SHJPEG_PF_NV21,	  "NV21",   2, 1, 12, 1, 1, YUV, false },
+      SHJPEG_PF_NV12, swap_cbcr_420, swap_cbcr_420 },
+
+    { { SHJPEG_PF_NV61,	  "NV61",   2, 1, 16, 1, 0, YUV, false },
+      SHJPEG_PF_NV16, swap_cbcr_422, swap_cbcr_422 },
+
+    { { SHJPEG_PF_I420,	  "I420",   3, 1, 12, 1, 1, YUV, false },
+      SHJPEG_PF_NV12, i420_to_nv12, nv12_to_i420 },
+
+    { { SHJPEG_PF_BGR24,  "BGR24",  1, 3, 24, 0, 0, RGB, false },
+      SHJPEG_PF_RGB24, swap_rb_24, swap_rb_24 },
+
+    { { SHJPEG_PF_BGR32,  "BGR32",  1, 4, 32, 0, 0, RGB, false },
+      SHJPEG_PF_RGB32, swap_rb_32, swap_rb_32 },
+
+    /* VEU ignores the top byte of RGB32, only decoding sets alpha */
+    { { SHJPEG_PF_ARGB32, "ARGB32", 1, 4, 32, 0, 0, RGB, false },
+      SHJPEG_PF_RGB32, NULL, set_alpha },
+};
+
+const shjpeg_format_t *
+shjpeg_format_get(shjpeg_pixelformat format)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+	if (formats[i].info.format == format)
+	    return &formats[i];
+
+    return NULL;
+}
+
+/*
+ * Set up the planes of a frame at addr. Chroma planes follow the
+ * first plane as described in shjpeg_pixelformat_info_t.
+ */
+void
+shjpeg_format_planes(const shjpeg_format_t *fmt, void *addr,
+		     int pitch, int height, shjpeg_planes_t *planes)
+{
+    int v_shift  = fmt->info.v_shift;
+    int c_height = (height + (1 << v_shift) - 1) >> v_shift;
+
+    planes->y	    = addr;
+    planes->cb	    = NULL;
+    planes->cr	    = NULL;
+    planes->pitch   = pitch;
+    planes->c_pitch = 0;
+
+    if (fmt->info.planes > 1) {
+	planes->cb	= planes->y + pitch * height;
+	planes->c_pitch = (fmt->info.planes > 2) ?
+	    (pitch >> fmt->info.h_shift) : pitch;
+    }
+
+    if (fmt->info.planes > 2)
+	planes->cr = planes->cb + planes->c_pitch * c_height;
+}
+
+/*
+ * Pitch of the base format that fits in the memory of a frame in the
+ * given format, or -1 if it doesn't meet the alignment of the
+ * hardware.
+ */
+int
+shjpeg_format_base_pitch(const shjpeg_format_t *fmt, int pitch)
+{
+    const shjpeg_format_t *base = shjpeg_format_get(fmt->base);
+
+    if (base->info.bytes_per_pixel != fmt->info.bytes_per_pixel)
+	pitch = pitch / fmt->info.bytes_per_pixel *
+	    base->info.bytes_per_pixel;
+
+    return (pitch & 0x7) ? -1 : pitch;
+}
+
+/*
+ * Save the lines [y, y + h) of all planes of the frame to buf, or
+ * restore them from buf. buf is laid out as a frame of h lines, and
+ * must hold shjpeg_get_frame_size(format, pitch, h) bytes.
+ */
+void
+shjpeg_format_copy_rows(const shjpeg_format_t *fmt,
+			const shjpeg_planes_t *frame, int y, int h,
+			void *buf, bool save)
+{
+    shjpeg_planes_t rows;
+    int v_shift = fmt->info.v_shift;
+    int cy	= y >> v_shift;
+    int ch	= ((y + h + (1 << v_shift) - 1) >> v_shift) - cy;
+    u8 *frame_p[3] = { frame->y, frame->cb, frame->cr };
+    u8 *rows_p[3];
+    int i;
+
+    shjpeg_format_planes(fmt, buf, frame->pitch, h, &rows);
+    rows_p[0] = rows.y;
+    rows_p[1] = rows.cb;
+    rows_p[2] = rows.cr;
+
+    for (i = 0; i < fmt->info.planes; i++) {
+	u8 *p	= frame_p[i] + (i ? cy * frame->c_pitch : y * frame->pitch);
+	int len = i ? frame->c_pitch * ch : frame->pitch * h;
+
+	if (save)
+	    memcpy(rows_p[i], p, len);
+	else
+	    memcpy(p, rows_p[i], len);
+    }
+}
+
+/*
+ * Convert a region of a frame with height lines. The line src_y of
+ * the frame is the first line of src. The region is extended to whole
+ * chroma samples of fmt.
+ */
+void
+shjpeg_format_convert(const shjpeg_format_t *fmt,
+		      shjpeg_convert_t convert,
+		      const shjpeg_planes_t *src, int src_y,
+		      const shjpeg_planes_t *dst,
+		      const shjpeg_rect_t *rect, int height)
+{
+    int mx = (1 << fmt->info.h_shift) - 1;
+    int my = (1 << fmt->info.v_shift) - 1;
+    int x0 = rect->x & ~mx;
+    int x1 = (rect->x + rect->w + mx) & ~mx;
+    int y0 = rect->y & ~my;
+    int y1 = MIN((rect->y + rect->h + my) & ~my, height);
+    int y;
+
+    for (y = y0; y < y1; y++)
+	convert(src, y - src_y, dst, y, x0, x1 - x0);
+}
+
+/*
+ * Check the planes of a frame passed by the user. Returns -1 if the
+ * JPU and VEU can't access the frame.
+ */
+int
+shjpeg_format_check_frame(shjpeg_internal_t *data, const shjpeg_format_t *fmt,
+			  const shjpeg_frame_t *frame)
+{
+    shjpeg_context_t *context = data->context;
+
+    if (!frame || (frame->phys == SHJPEG_USE_DEFAULT_BUFFER)) {
+	D_ERROR("libshjpeg: no frame given.");
+	return -1;
+    }
+
+    if (frame->c_phys &&
+	(fmt->info.format != SHJPEG_PF_NV12) &&
+	(fmt->info.format != SHJPEG_PF_NV16)) {
+	D_ERROR("libshjpeg: %s can't have a separate chroma plane.",
+		fmt->info.name);
+	return -1;
+    }
+
+    if (frame->c_pitch && (frame->c_pitch != frame->pitch)) {
+	D_ERROR("libshjpeg: chroma pitch %d differs from pitch %d.",
+		frame->c_pitch, frame->pitch);
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Map physical memory for CPU access. The contiguous buffer of the
+ * library is mapped already, anything else is mapped via /dev/mem.
+ */
+int
+shjpeg_map(shjpeg_internal_t *data, unsigned long phys, size_t len,
+	   shjpeg_map_t *map)
+{
+    shjpeg_context_t *context = data->context;
+    unsigned long     offset  = phys & (_PAGE_SIZE - 1);
+    int		      fd;
+
+    map->map = NULL;
+    map->len = 0;
+
+    if ((phys >= data->jpeg_phys) &&
+	(phys + len <= data->jpeg_phys + data->jpeg_size)) {
+	map->addr = data->jpeg_virt + (phys - data->jpeg_phys);
+	return 0;
+    }
+
+    fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0) {
+	D_PERROR("libshjpeg: Could not open /dev/mem!");
+	return -1;
+    }
+
+    map->len = _PAGE_ALIGN(len + offset);
+    map->map = mmap(NULL, map->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		    phys - offset);
+    close(fd);
+
+    if (map->map == MAP_FAILED) {
+	D_PERROR("libshjpeg: Could not map /dev/mem at 0x%08lx (length %zu)!",
+		 phys, len);
+	map->map = NULL;
+	return -1;
+    }
+
+    map->addr = map->map + offset;
+
+    return 0;
+}
+
+void
+shjpeg_unmap(shjpeg_map_t *map)
+{
+    if (map->map)
+	munmap(map->map, map->len);
+
+    map->map  = NULL;
+    map->addr = NULL;
+}
+
+/*
+ * Public pixel format information
+ */
+
+const shjpeg_pixelformat_info_t *
+shjpeg_get_pixelformat_info(shjpeg_pixelformat format)
+{
+    const shjpeg_format_t *fmt = shjpeg_format_get(format);
+
+    return fmt ? &fmt->info : NULL;
+}
+
+int
+shjpeg_get_frame_size(shjpeg_pixelformat format, int pitch, int height)
+{
+    const shjpeg_format_t *fmt = shjpeg_format_get(format);
+    int c_pitch, c_height;
+
+    if (!fmt)
+	return -1;
+
+    if (fmt->info.planes == 1)
+	return pitch * height;
+
+    c_pitch  = (fmt->info.planes > 2) ? (pitch >> fmt->info.h_shift) : pitch;
+    c_height = (height + (1 << fmt->info.v_shift) - 1) >> fmt->info.v_shift;
+
+    return pitch * height + (fmt->info.planes - 1) * c_pitch * c_height;
+}
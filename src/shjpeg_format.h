@@ -0,0 +1,88 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ * Copyright (C) 2008,2009 Renesas Technology Corp.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA	 02110-1301 USA
+ */
+
+#ifndef __shjpeg_format_h__
+#define __shjpeg_format_h__
+
+#include "shjpeg_utils.h"
+
+/* planes of a frame in memory */
+typedef struct {
+    u8		*y;		/* Y or RGB plane */
+    u8		*cb;		/* CbCr plane, or Cb plane if planar */
+    u8		*cr;		/* Cr plane if planar */
+    int		 pitch;		/* pitch of the first plane */
+    int		 c_pitch;	/* pitch of the chroma planes */
+} shjpeg_planes_t;
+
+/* convert w pixels from x of the line sy in src to the line dy in dst */
+typedef void (*shjpeg_convert_t)(const shjpeg_planes_t *src, int sy,
+				 const shjpeg_planes_t *dst, int dy,
+				 int x, int w);
+
+typedef struct {
+    shjpeg_pixelformat_info_t info;
+
+    /*
+     * Format the hardware reads or writes in place of this one, and
+     * CPU converters from and to it. A NULL converter means the base
+     * format is read or written as is.
+     */
+    shjpeg_pixelformat	base;
+    shjpeg_convert_t	to_base;
+    shjpeg_convert_t	from_base;
+
+    /* VEU settings, valid if base is the format itself */
+    u32			vswpin;		/* VEU_VSWPR to read the format */
+    u32			vtrcrin;	/* VEU_VTRCR to read the format */
+    u32			vswpout;	/* VEU_VSWPR to write the format */
+    u32			vtrcrout;	/* VEU_VTRCR to write the format */
+} shjpeg_format_t;
+
+/* physical memory mapped for CPU access */
+typedef struct {
+    void		*addr;		/* virtual address of phys */
+    void		*map;		/* own mapping, NULL if none */
+    size_t		 len;		/* length of own mapping */
+} shjpeg_map_t;
+
+/* external function */
+const shjpeg_format_t *shjpeg_format_get(shjpeg_pixelformat format);
+void shjpeg_format_planes(const shjpeg_format_t *fmt, void *addr,
+			  int pitch, int height, shjpeg_planes_t *planes);
+int shjpeg_format_base_pitch(const shjpeg_format_t *fmt, int pitch);
+int shjpeg_format_check_frame(shjpeg_internal_t *data,
+			      const shjpeg_format_t *fmt,
+			      const shjpeg_frame_t *frame);
+void shjpeg_format_copy_rows(const shjpeg_format_t *fmt,
+			     const shjpeg_planes_t *frame, int y, int h,
+			     void *buf, bool save);
+void shjpeg_format_convert(const shjpeg_format_t *fmt,
+			   shjpeg_convert_t convert,
+			   const shjpeg_planes_t *src, int src_y,
+			   const shjpeg_planes_t *dst,
+			   const shjpeg_rect_t *rect, int height);
+
+int shjpeg_map(shjpeg_internal_t *data, unsigned long phys, size_t len,
+	       shjpeg_map_t *map);
+void shjpeg_unmap(shjpeg_map_t *map);
+
+#endif /* !__shjpeg_format_h__ */
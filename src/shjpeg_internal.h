@@ -38,6 +38,26 @@ typedef enum {
  * private data struct of SH7722_JPEG
  */
 
+/* number of quantization table images kept for reuse */
+#define SHJPEG_QT_CACHE_SIZE	4
+
+/* register images of JCQTBL0/1 made for a quality and base tables */
+typedef struct {
+    int			 quality;	// 0 if the entry is not used
+    unsigned int	 tables[2][64];	// base tables in natural order
+    uint32_t		 regs[2][16];	// scaled tables in zigzag order
+} shjpeg_qt_cache_t;
+
+/* rate control state of a stream, see encode_rc of the context */
+typedef struct {
+    int			 scale;		// scale of the last image, 0 if none
+    long		 debt;		// bytes over the bitrate budget
+    void		*buf;		// image held back for retries
+    size_t		 buf_size;
+    size_t		 buf_len;
+    int			 buf_error;
+} shjpeg_rc_t;
+
 typedef struct {
     int                  ref_count;	// reference counter
 
@@ -86,11 +106,17 @@ typedef struct {
     int                  jpeg_line;
 
     int                  jpu_running;
+    int			 jpu_held;	// JPU locked by the caller
+    unsigned int	 jpu_starts;	// runs started, to see if JPU was used
     int			 jpu_lb_first_irq;
 
     int                  veu_linebuf;
     int                  veu_running;
 
+    /* quantization tables */
+    shjpeg_qt_cache_t	 qt_cache[SHJPEG_QT_CACHE_SIZE];
+    int			 qt_cache_next;
+
     /* internal data */
     shjpeg_context_t    *context;
 } shjpeg_internal_t;
@@ -55,6 +55,268 @@ shjpeg_jpu_reset(shjpeg_internal_t *data)
 	usleep(1);
 }
 
+/*
+ * Release the line buffer converted by VEU, and restart JPU if it
+ * waits for the buffer.
+ */
+static void
+jpu_veu_done(shjpeg_internal_t *data)
+{
+    D_INFO("libshjpeg: veu: done w/ LB%d", data->veu_linebuf);
+
+    data->jpeg_linebufs &= ~(1 << data->veu_linebuf);
+
+    /* count lines passed through the line buffers */
+    data->jpeg_line += SHJPEG_JPU_LINEBUFFER_HEIGHT;
+
+    /* if JPU is not running - start */
+    if (!data->jpeg_end && !data->jpu_running &&
+	(!(data->jpeg_linebufs & (1 << data->jpeg_linebuf)))) {
+	D_INFO("libshjpeg: jpu: process LB%d", data->jpeg_linebuf);
+
+	if (data->jpu_lb_first_irq)
+	    data->jpu_lb_first_irq = 0;
+	else 
+	    shjpeg_jpu_setreg32(data, JPU_JCCMD,
+				JPU_JCCMD_LCMD1 | JPU_JCCMD_LCMD2);
+	data->jpu_running = 1;
+    } else {
+	D_INFO("libshjpeg: jpu: wait for LB%d", data->jpeg_linebuf);
+    }
+
+    /* point to the other buffer */
+    shjpeg_veu_stop(data);
+    data->veu_linebuf = (data->veu_linebuf + 1) % 2;
+}
+
+/*
+ * Start VEU on the lines of the line buffer inside the crop region.
+ * Each line buffer is converted as a frame of its own. Returns 0 if
+ * the line buffer is outside the region, and nothing is converted.
+ * With band set, the lines go to the top of the band buffer of the
+ * line buffer instead.
+ */
+static int
+jpu_veu_crop(shjpeg_internal_t *data, shjpeg_jpu_crop_t *crop, bool band)
+{
+    shjpeg_veu_plane_t src, dst;
+    int top    = data->jpeg_line;
+    int first  = MAX(top, crop->y);
+    int last   = MIN(top + SHJPEG_JPU_LINEBUFFER_HEIGHT, crop->y + crop->h);
+    int o_first, o_last, x, y;
+
+    if (first >= last)
+	return 0;
+
+    /* lines of the destination covered by this line buffer */
+    o_first = (long long)(first - crop->y) * crop->out_h / crop->h;
+    o_last  = (long long)(last  - crop->y) * crop->out_h / crop->h;
+
+    /* subsampled chroma must start on an even line */
+    if (crop->c_shift) {
+	o_first &= ~1;
+	if (last < crop->y + crop->h)
+	    o_last &= ~1;
+    }
+
+    if (o_first >= o_last)
+	return 0;
+
+    src.width  = crop->w;
+    src.height = last - first;
+    src.yaddr  = shjpeg_jpu_getreg32(data, (data->veu_linebuf) ?
+				     JPU_JIFDDYA2 : JPU_JIFDDYA1) +
+	(first - top) * SHJPEG_JPU_LINEBUFFER_PITCH + crop->x;
+    src.caddr  = shjpeg_jpu_getreg32(data, (data->veu_linebuf) ?
+				     JPU_JIFDDCA2 : JPU_JIFDDCA1) +
+	((first - top) >> crop->lb_c_shift) * SHJPEG_JPU_LINEBUFFER_PITCH +
+	crop->x;
+
+    /*
+     * Top left corner of the lines in the destination. Mirrored
+     * lines are placed from the bottom, and rotated lines become
+     * columns.
+     */
+    if (crop->rotate) {
+	x = (crop->vflip) ? o_first : crop->out_h - o_last;
+	y = 0;
+    } else {
+	x = 0;
+	y = (crop->vflip) ? crop->out_h - o_last : o_first;
+    }
+
+    dst.width  = crop->out_w;
+    dst.height = o_last - o_first;
+    dst.yaddr  = crop->yaddr + y * crop->pitch + x * crop->bpp;
+    dst.caddr  = crop->caddr + (y >> crop->c_shift) * crop->pitch + x;
+
+    if (band) {
+	dst.yaddr = crop->yaddr + data->veu_linebuf * crop->band_size;
+	dst.caddr = crop->caddr + data->veu_linebuf * crop->band_size;
+
+	crop->band_y = o_first;
+	crop->band_h = o_last - o_first;
+    }
+
+    shjpeg_veu_set_planes(data, &src, &dst);
+    shjpeg_veu_start(data, 0);
+
+    return 1;
+}
+
+/*
+ * Start VEU on the line buffer for the next output from jpeg->output
+ * the line buffer covers. VEU is set up for each output, as they
+ * differ in format, size and pitch. Returns 0 if no output is left,
+ * and the line buffer can be released.
+ */
+static int
+jpu_veu_multi(shjpeg_internal_t *data, shjpeg_jpu_t *jpeg)
+{
+    for (; jpeg->output < jpeg->num_outputs; jpeg->output++) {
+	shjpeg_jpu_output_t *output = &jpeg->outputs[jpeg->output];
+
+	shjpeg_veu_init(data, &output->veu);
+	if (jpu_veu_crop(data, &output->crop, false))
+	    return 1;
+    }
+
+    jpeg->output = 0;
+
+    return 0;
+}
+
+/*
+ * Start VEU to resize the source lines for the line buffer into it
+ * while encoding. The source lines are chosen for each line buffer,
+ * as the ratio of the sizes is not a multiple of the line buffer
+ * height. Returns 0 if the whole image has been converted.
+ */
+static int
+jpu_veu_scale_src(shjpeg_internal_t *data, shjpeg_jpu_crop_t *crop)
+{
+    shjpeg_veu_plane_t src, dst;
+    int o_first = data->jpeg_line;
+    int o_last  = MIN(o_first + SHJPEG_JPU_LINEBUFFER_HEIGHT, crop->out_h);
+    int first, last;
+
+    if (o_first >= o_last)
+	return 0;
+
+    /* source lines (from the top of the region) for this line buffer */
+    first = (long long)o_first * crop->h / crop->out_h;
+    last  = (long long)o_last  * crop->h / crop->out_h;
+
+    /* subsampled chroma must start on an even line */
+    if (crop->c_shift) {
+	first &= ~1;
+	if (o_last < crop->out_h)
+	    last &= ~1;
+    }
+    if (last <= first)
+	last = MIN(first + 2, crop->h);
+
+    src.width  = crop->w;
+    src.height = last - first;
+    src.yaddr  = crop->yaddr + first * crop->pitch;
+    src.caddr  = crop->caddr + (first >> crop->c_shift) * crop->pitch;
+
+    dst.width  = crop->out_w;
+    dst.height = o_last - o_first;
+    dst.yaddr  = shjpeg_jpu_getreg32(data, (data->veu_linebuf) ?
+				     JPU_JIFESYA2 : JPU_JIFESYA1);
+    dst.caddr  = shjpeg_jpu_getreg32(data, (data->veu_linebuf) ?
+				     JPU_JIFESCA2 : JPU_JIFESCA1);
+
+    shjpeg_veu_set_planes(data, &src, &dst);
+    shjpeg_veu_start(data, 0);
+
+    return 1;
+}
+
+/*
+ * Let the caller fill the band buffer of the line buffer with the
+ * source lines for it while encoding in bands. Returns 0 if the whole
+ * image has been passed, -1 if the caller aborted.
+ */
+static int
+jpu_band_fill(shjpeg_internal_t *data, shjpeg_jpu_t *jpeg)
+{
+    int line = data->jpeg_line;
+
+    if (line >= jpeg->crop.out_h)
+	return 0;
+
+    if (jpeg->band(jpeg->band_private, data->veu_linebuf, line,
+		   MIN(SHJPEG_JPU_LINEBUFFER_HEIGHT, jpeg->crop.out_h - line)))
+	return -1;
+
+    return 1;
+}
+
+/*
+ * Start VEU on the band buffer filled for the line buffer while
+ * encoding in bands. Returns 0 if the whole image has been converted,
+ * -1 if the caller aborted.
+ */
+static int
+jpu_veu_band_src(shjpeg_internal_t *data, shjpeg_jpu_t *jpeg)
+{
+    u32 offset = data->veu_linebuf * jpeg->crop.band_size;
+    int ret = jpu_band_fill(data, jpeg);
+
+    if (ret <= 0)
+	return ret;
+
+    shjpeg_veu_set_src(data, jpeg->crop.yaddr + offset,
+		       jpeg->crop.caddr + offset);
+    shjpeg_veu_set_dst_jpu(data);
+    shjpeg_veu_start(data, 0);
+
+    return 1;
+}
+
+/*
+ * Move the line buffer released by JPU to the next band of the image,
+ * when JPU reads or writes the Y plane of the image directly and the
+ * chroma goes to a scratch area (e.g. GRAY8). No VEU is involved.
+ * Returns 0 if the whole image has been passed to JPU for encoding,
+ * -1 if the caller aborted encoding in bands.
+ */
+static int
+jpu_direct_next(shjpeg_internal_t *data, shjpeg_jpu_t *jpeg)
+{
+    shjpeg_jpu_crop_t *crop = &jpeg->crop;
+    int line = data->jpeg_line;
+    u32 reg, addr = crop->yaddr + line * crop->pitch;
+    int ret;
+
+    if (data->jpeg_encode) {
+	/* the released line buffer takes the next band to encode */
+	if (jpeg->flags & SHJPEG_JPU_FLAG_BAND) {
+	    ret = jpu_band_fill(data, jpeg);
+	    if (ret <= 0)
+		return ret;
+	    addr = crop->yaddr + data->veu_linebuf * crop->band_size;
+	}
+	else if (line >= crop->out_h)
+	    return 0;
+	reg = (data->veu_linebuf) ? JPU_JIFESYA2 : JPU_JIFESYA1;
+    } else {
+	/* the other line buffer holds the following band */
+	line += SHJPEG_JPU_LINEBUFFER_HEIGHT * 2;
+	addr  = crop->yaddr + line * crop->pitch;
+	reg   = (data->veu_linebuf) ? JPU_JIFDDYA2 : JPU_JIFDDYA1;
+    }
+
+    if (line < crop->out_h)
+	shjpeg_jpu_setreg32(data, reg, addr);
+
+    jpu_veu_done(data);
+
+    return 1;
+}
+
 /*
  * Main JPU control
  */
@@ -98,6 +360,7 @@ shjpeg_jpu_run(shjpeg_context_t	 *context,
 
 	data->jpu_running		= (encode) ? 0 : 1;
 	data->jpu_lb_first_irq	        = (encode) ? 0 : 1;
+	data->jpu_starts++;
 
 	data->veu_linebuf	    	= 0;
 	data->veu_running	    	= 0;
@@ -130,12 +393,29 @@ shjpeg_jpu_run(shjpeg_context_t	 *context,
      * bootstrap
      */
     if (data->jpeg_encode) {
-	if (convert) {
+	if (convert && (jpeg->flags & SHJPEG_JPU_FLAG_DIRECT)) {
+	    while (data->jpeg_linebufs & (1 << data->veu_linebuf)) {
+		ret = jpu_direct_next(data, jpeg);
+		if (ret < 0)
+		    data->jpeg_error = SHJPEG_JPU_ERROR_ABORTED;
+		if (ret <= 0)
+		    break;
+	    }
+	}
+	else if (convert) {
 	    if (!data->veu_running && 
 		(data->jpeg_linebufs & (1 << data->veu_linebuf))) {
 		D_INFO("veu: start veu on %d", data->veu_linebuf);
-		shjpeg_veu_set_dst_jpu(data);
-		shjpeg_veu_start(data, 0);
+		if (jpeg->flags & SHJPEG_JPU_FLAG_BAND) {
+		    if (jpu_veu_band_src(data, jpeg) < 0)
+			data->jpeg_error = SHJPEG_JPU_ERROR_ABORTED;
+		}
+		else if (jpeg->flags & SHJPEG_JPU_FLAG_CROP)
+		    jpu_veu_scale_src(data, &jpeg->crop);
+		else {
+		    shjpeg_veu_set_dst_jpu(data);
+		    shjpeg_veu_start(data, 0);
+		}
 	    }
 	}
 
@@ -158,6 +438,11 @@ shjpeg_jpu_run(shjpeg_context_t	 *context,
     // Read from UIO dev here to wait for IRQ....
     done = 0;
     for(;;) {
+	/* the caller aborted coding in bands */
+	if (data->jpeg_error == SHJPEG_JPU_ERROR_ABORTED &&
+	    !data->veu_running)
+	    break;
+
 	// wait for IRQ. time out set to 1sec.
 	fds[0].revents = fds[1].revents = 0;
 	ret = poll(fds, 2, 1000);
@@ -325,28 +610,20 @@ shjpeg_jpu_run(shjpeg_context_t	 *context,
           
 	    /* sanity check */
 	    D_INFO("libshjpeg: VEU IRQ counts = %d", val);
-	    D_INFO("libshjpeg: veu: done w/ LB%d", data->veu_linebuf);
-
-	    data->jpeg_linebufs &= ~(1 << data->veu_linebuf);
-
-	    /* if JPU is not running - start */
-	    if (!data->jpeg_end && !data->jpu_running &&
-		(!(data->jpeg_linebufs & (1 << data->jpeg_linebuf)))) {
-		D_INFO("libshjpeg: jpu: process LB%d", data->jpeg_linebuf);
-
-		if (data->jpu_lb_first_irq)
-		    data->jpu_lb_first_irq = 0;
-		else 
-		    shjpeg_jpu_setreg32(data, JPU_JCCMD,
-					JPU_JCCMD_LCMD1 | JPU_JCCMD_LCMD2);
-		data->jpu_running = 1;
-	    } else {
-		D_INFO("libshjpeg: jpu: wait for LB%d", data->jpeg_linebuf);
-	    }
 
-	    /* point to the other buffer */
-	    shjpeg_veu_stop(data);
-	    data->veu_linebuf = (data->veu_linebuf + 1) % 2;
+	    /* pass the band converted to the caller, who may abort */
+	    if (!data->jpeg_encode && (jpeg->flags & SHJPEG_JPU_FLAG_BAND) &&
+		jpeg->band(jpeg->band_private, data->veu_linebuf,
+			   jpeg->crop.band_y, jpeg->crop.band_h))
+		data->jpeg_error = SHJPEG_JPU_ERROR_ABORTED;
+
+	    /* the line buffer is converted for the next output below */
+	    if (jpeg->flags & SHJPEG_JPU_FLAG_MULTI) {
+		shjpeg_veu_stop(data);
+		jpeg->output++;
+	    }
+	    else
+		jpu_veu_done(data);
 
 	    /* re-enable IRQ */
 	    val = 1;
@@ -359,24 +636,54 @@ shjpeg_jpu_run(shjpeg_context_t	 *context,
 	/*
 	 * ready to start veu?
 	 */
-	if (convert) {
-	    if (!data->veu_running && 
-		(data->jpeg_linebufs & (1 << data->veu_linebuf))) {
+	if (convert && (data->jpeg_error != SHJPEG_JPU_ERROR_ABORTED)) {
+	    while (!data->veu_running && 
+		   (data->jpeg_linebufs & (1 << data->veu_linebuf))) {
 		D_INFO("libshjpeg: veu: process LB%d", data->veu_linebuf);
-		if (data->jpeg_encode) {
+		if (jpeg->flags & SHJPEG_JPU_FLAG_DIRECT) {
+		    /* nothing more to encode */
+		    ret = jpu_direct_next(data, jpeg);
+		    if (ret < 0)
+			data->jpeg_error = SHJPEG_JPU_ERROR_ABORTED;
+		    if (ret <= 0)
+			break;
+		} else if (data->jpeg_encode &&
+			   (jpeg->flags & SHJPEG_JPU_FLAG_BAND)) {
+		    /* nothing more to convert, or aborted */
+		    ret = jpu_veu_band_src(data, jpeg);
+		    if (ret < 0)
+			data->jpeg_error = SHJPEG_JPU_ERROR_ABORTED;
+		    if (ret <= 0)
+			break;
+		} else if (data->jpeg_encode &&
+			   (jpeg->flags & SHJPEG_JPU_FLAG_CROP)) {
+		    /* nothing more to convert */
+		    if (!jpu_veu_scale_src(data, &jpeg->crop))
+			break;
+		} else if (data->jpeg_encode) {
 		    jpeg->sa_y += jpeg->sa_inc;
 		    jpeg->sa_c += jpeg->sa_inc;
 		    
 		    shjpeg_veu_set_src(data, jpeg->sa_y, jpeg->sa_c);
 		    shjpeg_veu_set_dst_jpu(data);
 		    shjpeg_veu_start(data, 0);
+		} else if (jpeg->flags & SHJPEG_JPU_FLAG_MULTI) {
+		    /* line buffers outside all the regions are dropped */
+		    if (!jpu_veu_multi(data, jpeg))
+			jpu_veu_done(data);
+		} else if (jpeg->flags & SHJPEG_JPU_FLAG_CROP) {
+		    /* line buffers outside the region are just dropped */
+		    if (!jpu_veu_crop(data, &jpeg->crop,
+				      (jpeg->flags & SHJPEG_JPU_FLAG_BAND)))
+			jpu_veu_done(data);
 		} else {
 		    shjpeg_veu_set_src_jpu(data);
 		    shjpeg_veu_start(data, 1);
 		}
-	    } else {
-		D_INFO("libshjpeg: veu: wait for LB%d", data->veu_linebuf);
 	    }
+
+	    if (!data->veu_running)
+		D_INFO("libshjpeg: veu: wait for LB%d", data->veu_linebuf);
 	}
 
 	/* are we done? */
@@ -417,46 +724,146 @@ shjpeg_jpu_run(shjpeg_context_t	 *context,
     return 0;
 }
 
+/*
+ * Quantization tables
+ */
+
+/* fixed register images used when no quality is given */
+static const uint32_t jpu_default_qt[2][16] = {
+    {
+	0x100B0B0E, 0x0C0A100E, 0x0D0E1211, 0x10131828,
+	0x1A181616, 0x18312325, 0x1D283A33, 0x3D3C3933,
+	0x38374048, 0x5C4E4044, 0x57453738, 0x506D5157,
+	0x5F626768, 0x673E4D71, 0x79706478, 0x5C656763
+    },
+    {
+	0x11121218, 0x15182F1A, 0x1A2F6342, 0x38426363,
+	0x63636363, 0x63636363, 0x63636363, 0x63636363,
+	0x63636363, 0x63636363, 0x63636363, 0x63636363,
+	0x63636363, 0x63636363, 0x63636363, 0x63636363
+    }
+};
+
+/* standard tables (JPEG Annex K) in natural order */
+static const unsigned int jpu_std_qt[2][64] = {
+    {
+	16,  11,  10,  16,  24,  40,  51,  61,
+	12,  12,  14,  19,  26,  58,  60,  55,
+	14,  13,  16,  24,  40,  57,  69,  56,
+	14,  17,  22,  29,  51,  87,  80,  62,
+	18,  22,  37,  56,  68, 109, 103,  77,
+	24,  35,  55,  64,  81, 104, 113,  92,
+	49,  64,  78,  87, 103, 121, 120, 101,
+	72,  92,  95,  98, 112, 100, 103,  99
+    },
+    {
+	17,  18,  24,  47,  99,  99,  99,  99,
+	18,  21,  26,  66,  99,  99,  99,  99,
+	24,  26,  56,  99,  99,  99,  99,  99,
+	47,  66,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99,
+	99,  99,  99,  99,  99,  99,  99,  99
+    }
+};
+
+/* natural order index of each coefficient in zigzag order */
+static const int jpu_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+/*
+ * Scale a table as jpeg_set_quality() does, and pack it into the
+ * register image. JCQTBL holds four 8 bit entries per word, the
+ * first one in the most significant byte.
+ */
+static void
+jpu_scale_qt(uint32_t *regs, const unsigned int *table, int quality)
+{
+    int scale = (quality < 50) ? 5000 / quality : 200 - quality * 2;
+    int i;
+
+    memset(regs, 0, 16 * sizeof(uint32_t));
+
+    for (i = 0; i < 64; i++) {
+	long value = ((long)table[jpu_zigzag[i]] * scale + 50) / 100;
+
+	if (value < 1)
+	    value = 1;
+	if (value > 255)
+	    value = 255;
+
+	regs[i / 4] |= (uint32_t)value << (24 - (i % 4) * 8);
+    }
+}
+
+/*
+ * Look up the register images for the quality and the tables. Scaled
+ * images are kept in a small cache, as an application usually encodes
+ * many images with the same settings.
+ */
+static shjpeg_qt_cache_t *
+jpu_lookup_qt(shjpeg_internal_t *data, int quality,
+	      const unsigned int *const *tables)
+{
+    shjpeg_qt_cache_t *entry;
+    const unsigned int *base[2];
+    int i;
+
+    for (i = 0; i < 2; i++)
+	base[i] = (tables && tables[i]) ? tables[i] : jpu_std_qt[i];
+
+    for (i = 0; i < SHJPEG_QT_CACHE_SIZE; i++) {
+	entry = &data->qt_cache[i];
+
+	if ((entry->quality == quality) &&
+	    !memcmp(entry->tables[0], base[0], sizeof(entry->tables[0])) &&
+	    !memcmp(entry->tables[1], base[1], sizeof(entry->tables[1])))
+	    return entry;
+    }
+
+    /* replace the oldest entry */
+    entry = &data->qt_cache[data->qt_cache_next];
+    data->qt_cache_next = (data->qt_cache_next + 1) % SHJPEG_QT_CACHE_SIZE;
+
+    entry->quality = quality;
+    for (i = 0; i < 2; i++) {
+	memcpy(entry->tables[i], base[i], sizeof(entry->tables[i]));
+	jpu_scale_qt(entry->regs[i], base[i], quality);
+    }
+
+    return entry;
+}
+
 /*
  * Init quantization table
+ *
+ * JPU writes DQT segments from these registers, thus the tables in
+ * the stream always match the ones used for quantization.
  */
 
-void shjpeg_jpu_init_quantization_table(shjpeg_internal_t *data)
+void shjpeg_jpu_init_quantization_table(shjpeg_internal_t *data, int quality,
+					const unsigned int *const *tables)
 {
-    /* Init quantization tables. */
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 0), 0x100B0B0E);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 1), 0x0C0A100E);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 2), 0x0D0E1211);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 3), 0x10131828);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 4), 0x1A181616);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 5), 0x18312325);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 6), 0x1D283A33);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 7), 0x3D3C3933);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 8), 0x38374048);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0( 9), 0x5C4E4044);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0(10), 0x57453738);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0(11), 0x506D5157);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0(12), 0x5F626768);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0(13), 0x673E4D71);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0(14), 0x79706478);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL0(15), 0x5C656763);
-
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 0), 0x11121218);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 1), 0x15182F1A);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 2), 0x1A2F6342);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 3), 0x38426363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 4), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 5), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 6), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 7), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 8), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1( 9), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1(10), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1(11), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1(12), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1(13), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1(14), 0x63636363);
-    shjpeg_jpu_setreg32(data, JPU_JCQTBL1(15), 0x63636363);
+    const uint32_t (*regs)[16] = jpu_default_qt;
+    int i;
+
+    if (quality || (tables && (tables[0] || tables[1])))
+	regs = (const uint32_t (*)[16])
+	    jpu_lookup_qt(data, quality ? quality : 50, tables)->regs;
+
+    for (i = 0; i < 16; i++) {
+	shjpeg_jpu_setreg32(data, JPU_JCQTBL0(i), regs[0][i]);
+	shjpeg_jpu_setreg32(data, JPU_JCQTBL1(i), regs[1][i]);
+    }
 }
 
 /*
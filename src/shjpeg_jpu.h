@@ -25,6 +25,7 @@
 
 #include "shjpeg_regs.h"
 #include "shjpeg_utils.h"
+#include "shjpeg_veu.h"
 
 #define SHJPEG_JPU_RELOAD_SIZE       (64 * 1024)
 #define SHJPEG_JPU_LINEBUFFER_PITCH  (2560)
@@ -33,6 +34,9 @@
 #define SHJPEG_JPU_LINEBUFFER_SIZE_Y (SHJPEG_JPU_LINEBUFFER_PITCH * SHJPEG_JPU_LINEBUFFER_HEIGHT)
 #define SHJPEG_JPU_SIZE              (SHJPEG_JPU_LINEBUFFER_SIZE * 2 + SHJPEG_JPU_RELOAD_SIZE * 2)
 
+/* error reported when the band callback aborted */
+#define SHJPEG_JPU_ERROR_ABORTED     (0x100)
+
 typedef enum {
     SHJPEG_JPU_START,
     SHJPEG_JPU_RUN,
@@ -42,9 +46,45 @@ typedef enum {
 typedef enum {
     SHJPEG_JPU_FLAG_RELOAD  = 0x00000001, /* enable reload mode */
     SHJPEG_JPU_FLAG_CONVERT = 0x00000002, /* enable conversion through VEU */
-    SHJPEG_JPU_FLAG_ENCODE  = 0x00000004  /* set encoding mode */
+    SHJPEG_JPU_FLAG_ENCODE  = 0x00000004, /* set encoding mode */
+    SHJPEG_JPU_FLAG_CROP    = 0x00000008, /* convert line buffers one by one */
+    SHJPEG_JPU_FLAG_DIRECT  = 0x00000010, /* line buffers are in the image */
+    SHJPEG_JPU_FLAG_BAND    = 0x00000020, /* convert line buffers to bands */
+    SHJPEG_JPU_FLAG_MULTI   = 0x00000040  /* convert line buffers to outputs */
 } shjpeg_jpu_flags_t;
 
+typedef struct {
+    /* region in the decoded image, or in the source when encoding */
+    int		    x, y, w, h;
+    /* size of the region in the destination, or the encoded size */
+    int		    out_w, out_h;
+    /* top left corner of the destination, or of the source region */
+    u32		    yaddr;
+    u32		    caddr;
+    u32		    pitch;
+    u32		    bpp;	/* bytes per pixel of Y or RGB plane */
+    /* orientation programmed in VEU_VFMCR */
+    bool	    rotate;
+    bool	    vflip;
+    /* 1 if chroma is subsampled vertically, 0 otherwise */
+    int		    c_shift;	/* destination */
+    int		    lb_c_shift;	/* line buffer */
+    /*
+     * valid if SHJPEG_JPU_FLAG_BAND is set: each line buffer is
+     * converted to the top of its own band buffer, which follows
+     * the previous one at band_size
+     */
+    u32		    band_size;
+    int		    band_y;	/* lines converted last */
+    int		    band_h;
+} shjpeg_jpu_crop_t;
+
+/* one of the destinations each line buffer is converted to */
+typedef struct {
+    shjpeg_veu_t      veu;
+    shjpeg_jpu_crop_t crop;
+} shjpeg_jpu_output_t;
+
 typedef struct {
     /* starting, running or ended (done/error) */
     shjpeg_jpu_state_t state;   
@@ -62,6 +102,25 @@ typedef struct {
     u32	     sa_y;
     u32	     sa_c;
     u32	     sa_inc;
+
+    /* valid if SHJPEG_JPU_FLAG_CROP is set */
+    shjpeg_jpu_crop_t crop;
+
+    /*
+     * valid if SHJPEG_JPU_FLAG_BAND is set, called for each band
+     * converted when decoding, or to fill the band buffer buf with
+     * the lines to convert next when encoding. Non-zero aborts.
+     */
+    int		   (*band)(void *private, int buf, int y, int h);
+    void	    *band_private;
+
+    /*
+     * valid if SHJPEG_JPU_FLAG_MULTI is set: VEU converts each line
+     * buffer once for each output, and then releases it
+     */
+    shjpeg_jpu_output_t *outputs;
+    int		    num_outputs;
+    int		    output;	/* output being converted */
 } shjpeg_jpu_t;
 
 /* read/write from/to registers */
@@ -99,7 +158,8 @@ void shjpeg_jpu_reset(shjpeg_internal_t *data);
 int shjpeg_jpu_run(shjpeg_context_t *context, shjpeg_internal_t *data,
 		   shjpeg_jpu_t *jpeg);
 
-void shjpeg_jpu_init_quantization_table(shjpeg_internal_t *data);
+void shjpeg_jpu_init_quantization_table(shjpeg_internal_t *data, int quality,
+					const unsigned int *const *tables);
 void shjpeg_jpu_init_huffman_table(shjpeg_internal_t *data);
 
 #endif /* !__shjpeg_jpu_h__ */
@@ -0,0 +1,643 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA	 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#include <shjpeg/shjpeg.h>
+#include <jerror.h>
+#include "shjpeg_internal.h"
+#include "shjpeg_transform.h"
+
+/*
+ * Lossless optimization of encoded images
+ *
+ * JPU always codes with the standard Huffman tables. libjpeg reads
+ * the DCT coefficients of the image, and writes them again with
+ * Huffman tables computed for the image, optionally as a progressive
+ * JPEG. The coefficients are not touched, so is the image, unless
+ * the image is transformed losslessly in between.
+ */
+
+#define OPTIMIZE_BUF_CHUNK	(64 * 1024)
+
+/*
+ * libjpeg source manager reading from memory
+ */
+
+static void
+mem_init_source(j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+mem_fill_input_buffer(j_decompress_ptr cinfo)
+{
+    static const JOCTET eoi[2] = { 0xff, JPEG_EOI };
+
+    /* the image is truncated - insert a fake EOI */
+    WARNMS(cinfo, JWRN_JPEG_EOF);
+
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+
+    return TRUE;
+}
+
+static void
+mem_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+    struct jpeg_source_mgr *src = cinfo->src;
+
+    if (num_bytes <= 0)
+	return;
+
+    if ((size_t)num_bytes > src->bytes_in_buffer) {
+	(void)mem_fill_input_buffer(cinfo);
+	return;
+    }
+
+    src->next_input_byte += num_bytes;
+    src->bytes_in_buffer -= num_bytes;
+}
+
+static void
+mem_term_source(j_decompress_ptr cinfo)
+{
+}
+
+/*
+ * libjpeg destination manager writing into a growing buffer
+ */
+
+typedef struct {
+    struct jpeg_destination_mgr pub;	/* public fields */
+    JOCTET			*data;	/* start of buffer */
+    size_t			 size;	/* size of buffer */
+    size_t			 len;	/* bytes written when done */
+} optimize_dest_mgr;
+
+static void
+mem_init_destination(j_compress_ptr cinfo)
+{
+    optimize_dest_mgr *dest = (optimize_dest_mgr*)cinfo->dest;
+
+    dest->pub.next_output_byte = dest->data;
+    dest->pub.free_in_buffer   = dest->size;
+}
+
+static boolean
+mem_empty_output_buffer(j_compress_ptr cinfo)
+{
+    optimize_dest_mgr *dest = (optimize_dest_mgr*)cinfo->dest;
+    JOCTET *data = realloc(dest->data, dest->size + OPTIMIZE_BUF_CHUNK);
+
+    if (!data)
+	ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+
+    dest->pub.next_output_byte = data + dest->size;
+    dest->pub.free_in_buffer   = OPTIMIZE_BUF_CHUNK;
+    dest->data		       = data;
+    dest->size		      += OPTIMIZE_BUF_CHUNK;
+
+    return TRUE;
+}
+
+static void
+mem_term_destination(j_compress_ptr cinfo)
+{
+    optimize_dest_mgr *dest = (optimize_dest_mgr*)cinfo->dest;
+
+    dest->len = dest->size - dest->pub.free_in_buffer;
+}
+
+/*
+ * libjpeg destination manager writing through shjpeg_sops
+ */
+
+typedef struct {
+    struct jpeg_destination_mgr pub;	/* public fields */
+    shjpeg_sops			*sops;
+    void			*private;
+    JOCTET			*buf;	/* OPTIMIZE_BUF_CHUNK bytes */
+} sops_dest_mgr;
+
+static void
+sops_init_destination(j_compress_ptr cinfo)
+{
+    sops_dest_mgr *dest = (sops_dest_mgr*)cinfo->dest;
+
+    if (dest->sops->init)
+	dest->sops->init(dest->private);
+
+    dest->pub.next_output_byte = dest->buf;
+    dest->pub.free_in_buffer   = OPTIMIZE_BUF_CHUNK;
+}
+
+static void
+sops_write(j_compress_ptr cinfo, size_t len)
+{
+    sops_dest_mgr *dest = (sops_dest_mgr*)cinfo->dest;
+    size_t written = len;
+
+    if (dest->sops->write(dest->private, &written, dest->buf) ||
+	(written != len))
+	ERREXIT(cinfo, JERR_FILE_WRITE);
+}
+
+static boolean
+sops_empty_output_buffer(j_compress_ptr cinfo)
+{
+    sops_dest_mgr *dest = (sops_dest_mgr*)cinfo->dest;
+
+    sops_write(cinfo, OPTIMIZE_BUF_CHUNK);
+
+    dest->pub.next_output_byte = dest->buf;
+    dest->pub.free_in_buffer   = OPTIMIZE_BUF_CHUNK;
+
+    return TRUE;
+}
+
+static void
+sops_term_destination(j_compress_ptr cinfo)
+{
+    sops_dest_mgr *dest = (sops_dest_mgr*)cinfo->dest;
+    size_t len = OPTIMIZE_BUF_CHUNK - dest->pub.free_in_buffer;
+
+    if (len)
+	sops_write(cinfo, len);
+}
+
+struct optimize_error_mgr {
+    struct jpeg_error_mgr pub;	    /* "public" fields */
+    jmp_buf  setjmp_buffer;	      /* for return to caller */
+};
+
+static void
+optimize_panic(j_common_ptr cinfo)
+{
+    struct optimize_error_mgr *myerr = (struct optimize_error_mgr*) cinfo->err;
+    longjmp(myerr->setjmp_buffer, 1);
+}
+
+/*
+ * Read the coefficients of the image, transform them if asked, and
+ * write them to dest.
+ */
+
+static int
+optimize_run(shjpeg_context_t		  *context,
+	     const void			  *src,
+	     size_t			   src_size,
+	     const shjpeg_transform_t	  *transform,
+	     int			   flags,
+	     struct jpeg_destination_mgr  *dest)
+{
+    struct jpeg_decompress_struct  dinfo;
+    struct jpeg_compress_struct	   cinfo;
+    struct jpeg_source_mgr	   source;
+    struct optimize_error_mgr	   jerr;
+    jvirt_barray_ptr		  *coefs;
+    jpeg_saved_marker_ptr	   marker;
+    shjpeg_orientation		   orientation = SHJPEG_ROTATE_0;
+
+    /* both objects share the error handler */
+    dinfo.err = jpeg_std_error(&jerr.pub);
+    cinfo.err = &jerr.pub;
+    jerr.pub.error_exit = optimize_panic;
+
+    jpeg_create_decompress(&dinfo);
+    jpeg_create_compress(&cinfo);
+
+    if (setjmp(jerr.setjmp_buffer)) {
+	D_ERROR("libshjpeg: failed to optimize the image.");
+	goto fail;
+    }
+
+    source.init_source	     = mem_init_source;
+    source.fill_input_buffer = mem_fill_input_buffer;
+    source.skip_input_data   = mem_skip_input_data;
+    source.resync_to_restart = jpeg_resync_to_restart;
+    source.term_source	     = mem_term_source;
+    source.next_input_byte   = (const JOCTET*)src;
+    source.bytes_in_buffer   = src_size;
+    dinfo.src = &source;
+
+    /* keep the markers the application may rely on */
+    jpeg_save_markers(&dinfo, JPEG_COM, 0xffff);
+    jpeg_save_markers(&dinfo, JPEG_APP0 + 1, 0xffff);
+
+    jpeg_read_header(&dinfo, TRUE);
+
+    /* the saved EXIF orientation no longer applies once transformed */
+    if (transform) {
+	orientation = transform->orientation;
+	if (orientation & SHJPEG_ORIENTATION_EXIF)
+	    orientation = shjpeg_exif_orientation(&dinfo, true);
+    }
+
+    coefs = jpeg_read_coefficients(&dinfo);
+
+    cinfo.dest = dest;
+
+    jpeg_copy_critical_parameters(&dinfo, &cinfo);
+
+    if (transform) {
+	coefs = shjpeg_transform_coefs(&dinfo, &cinfo, coefs, orientation,
+				       &transform->crop);
+	if (!coefs) {
+	    D_ERROR("libshjpeg: nothing is left of %dx%d image to transform.",
+		    dinfo.image_width, dinfo.image_height);
+	    goto fail;
+	}
+    }
+
+    if (flags & SHJPEG_OPTIMIZE_HUFFMAN)
+	cinfo.optimize_coding = TRUE;
+
+    /* progressive scans always use optimal tables */
+    if (flags & SHJPEG_OPTIMIZE_PROGRESSIVE)
+	jpeg_simple_progression(&cinfo);
+
+    jpeg_write_coefficients(&cinfo, coefs);
+
+    /* copy the saved markers */
+    for (marker = dinfo.marker_list; marker; marker = marker->next)
+	jpeg_write_marker(&cinfo, marker->marker,
+			  marker->data, marker->data_length);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_finish_decompress(&dinfo);
+
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    return 0;
+
+ fail:
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    return -1;
+}
+
+/*
+ * Optimize or transform the image into memory.
+ */
+
+static int
+optimize_image(shjpeg_context_t		 *context,
+	       const void		 *src,
+	       size_t			  src_size,
+	       const shjpeg_transform_t	 *transform,
+	       int			  flags,
+	       void			**dst,
+	       size_t			 *dst_size)
+{
+    optimize_dest_mgr dest;
+
+    memset(&dest, 0, sizeof(dest));
+
+    /* the optimized image is usually smaller than the source */
+    dest.size = src_size ? src_size : OPTIMIZE_BUF_CHUNK;
+    if (!(dest.data = malloc(dest.size))) {
+	D_ERROR("libshjpeg: no memory to optimize the image.");
+	return -1;
+    }
+
+    dest.pub.init_destination	 = mem_init_destination;
+    dest.pub.empty_output_buffer = mem_empty_output_buffer;
+    dest.pub.term_destination	 = mem_term_destination;
+
+    if (optimize_run(context, src, src_size, transform, flags, &dest.pub)) {
+	free(dest.data);
+	return -1;
+    }
+
+    D_INFO("libshjpeg: optimized %lu -> %lu bytes.",
+	   (unsigned long)src_size, (unsigned long)dest.len);
+
+    *dst      = dest.data;
+    *dst_size = dest.len;
+
+    return 0;
+}
+
+/*
+ * shjpeg_optimize()
+ */
+
+int
+shjpeg_optimize(shjpeg_context_t *context,
+		const void	 *src,
+		size_t		  src_size,
+		void		**dst,
+		size_t		 *dst_size,
+		int		  flags)
+{
+    if (!context || !src || !dst || !dst_size) {
+	return -1;
+    }
+
+    return optimize_image(context, src, src_size, NULL, flags,
+			  dst, dst_size);
+}
+
+/*
+ * shjpeg_transform()
+ */
+
+int
+shjpeg_transform(shjpeg_context_t	  *context,
+		 const void		  *src,
+		 size_t			   src_size,
+		 const shjpeg_transform_t *transform,
+		 int			   flags,
+		 shjpeg_sops		  *sops,
+		 void			  *private)
+{
+    sops_dest_mgr dest;
+    int ret;
+
+    if (!context || !src || !transform || !sops || !sops->write) {
+	return -1;
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    dest.sops	 = sops;
+    dest.private = private;
+    if (!(dest.buf = malloc(OPTIMIZE_BUF_CHUNK))) {
+	D_ERROR("libshjpeg: no memory to transform the image.");
+	return -1;
+    }
+
+    dest.pub.init_destination	 = sops_init_destination;
+    dest.pub.empty_output_buffer = sops_empty_output_buffer;
+    dest.pub.term_destination	 = sops_term_destination;
+
+    ret = optimize_run(context, src, src_size, transform, flags, &dest.pub);
+
+    free(dest.buf);
+
+    return ret;
+}
+
+/*
+ * Background optimizer
+ *
+ * Jobs are queued in the submitted order and processed by a pool of
+ * worker threads. The completion callback is called from the worker.
+ */
+
+typedef struct optimize_job_struct optimize_job_t;
+
+struct optimize_job_struct {
+    optimize_job_t	   *next;
+    const void		   *data;
+    size_t		    size;
+    int			    flags;
+    shjpeg_transform_t	    transform;
+    bool		    transformed;	// transform is valid
+    shjpeg_optimize_done_t  done;
+    void		   *private;
+};
+
+struct shjpeg_optimizer_struct {
+    shjpeg_context_t	*context;
+    pthread_mutex_t	 lock;
+    pthread_cond_t	 queued;	// signaled when a job is queued
+    pthread_cond_t	 idle;		// signaled when a job is done
+    optimize_job_t	*head, *tail;
+    int			 pending;	// jobs queued or being processed
+    bool		 quit;
+    int			 num_threads;
+    pthread_t		*threads;
+};
+
+static void *
+optimizer_worker(void *arg)
+{
+    shjpeg_optimizer_t *opt = (shjpeg_optimizer_t*)arg;
+    optimize_job_t *job;
+    void *data;
+    size_t size;
+    int ret;
+
+    pthread_mutex_lock(&opt->lock);
+
+    for (;;) {
+	while (!opt->head && !opt->quit)
+	    pthread_cond_wait(&opt->queued, &opt->lock);
+
+	/* queued jobs are finished before quitting */
+	if (!(job = opt->head))
+	    break;
+
+	if (!(opt->head = job->next))
+	    opt->tail = NULL;
+
+	pthread_mutex_unlock(&opt->lock);
+
+	data = NULL;
+	size = 0;
+	ret = optimize_image(opt->context, job->data, job->size,
+			     job->transformed ? &job->transform : NULL,
+			     job->flags, &data, &size);
+	job->done(job->private, ret, data, size);
+	free(job);
+
+	pthread_mutex_lock(&opt->lock);
+
+	if (!--opt->pending)
+	    pthread_cond_broadcast(&opt->idle);
+    }
+
+    pthread_mutex_unlock(&opt->lock);
+
+    return NULL;
+}
+
+/*
+ * shjpeg_optimizer_create()
+ */
+
+shjpeg_optimizer_t *
+shjpeg_optimizer_create(shjpeg_context_t *context, int num_threads)
+{
+    shjpeg_optimizer_t *opt;
+
+    if (!context || (num_threads <= 0))
+	return NULL;
+
+    if (!(opt = calloc(1, sizeof(shjpeg_optimizer_t))))
+	return NULL;
+
+    if (!(opt->threads = calloc(num_threads, sizeof(pthread_t)))) {
+	free(opt);
+	return NULL;
+    }
+
+    opt->context = context;
+    pthread_mutex_init(&opt->lock, NULL);
+    pthread_cond_init(&opt->queued, NULL);
+    pthread_cond_init(&opt->idle, NULL);
+
+    for (; opt->num_threads < num_threads; opt->num_threads++) {
+	if (pthread_create(&opt->threads[opt->num_threads], NULL,
+			   optimizer_worker, opt)) {
+	    D_ERROR("libshjpeg: can't create optimizer thread.");
+	    shjpeg_optimizer_destroy(opt);
+	    return NULL;
+	}
+    }
+
+    return opt;
+}
+
+/*
+ * Queue a job for the worker threads.
+ */
+
+static int
+optimizer_queue(shjpeg_optimizer_t	  *opt,
+		const void		  *data,
+		size_t			   size,
+		const shjpeg_transform_t  *transform,
+		int			   flags,
+		shjpeg_optimize_done_t	   done,
+		void			  *private)
+{
+    optimize_job_t *job;
+
+    if (!opt || !data || !done)
+	return -1;
+
+    if (!(job = calloc(1, sizeof(optimize_job_t))))
+	return -1;
+
+    job->data	 = data;
+    job->size	 = size;
+    job->flags	 = flags;
+    job->done	 = done;
+    job->private = private;
+
+    if (transform) {
+	job->transform	 = *transform;
+	job->transformed = true;
+    }
+
+    pthread_mutex_lock(&opt->lock);
+
+    if (opt->tail)
+	opt->tail->next = job;
+    else
+	opt->head = job;
+    opt->tail = job;
+    opt->pending++;
+
+    pthread_cond_signal(&opt->queued);
+    pthread_mutex_unlock(&opt->lock);
+
+    return 0;
+}
+
+/*
+ * shjpeg_optimizer_submit()
+ */
+
+int
+shjpeg_optimizer_submit(shjpeg_optimizer_t	*opt,
+			const void		*data,
+			size_t			 size,
+			int			 flags,
+			shjpeg_optimize_done_t	 done,
+			void			*private)
+{
+    return optimizer_queue(opt, data, size, NULL, flags, done, private);
+}
+
+/*
+ * shjpeg_optimizer_submit_transform()
+ */
+
+int
+shjpeg_optimizer_submit_transform(shjpeg_optimizer_t	    *opt,
+				  const void		    *data,
+				  size_t		     size,
+				  const shjpeg_transform_t  *transform,
+				  int			     flags,
+				  shjpeg_optimize_done_t     done,
+				  void			    *private)
+{
+    if (!transform)
+	return -1;
+
+    return optimizer_queue(opt, data, size, transform, flags, done, private);
+}
+
+/*
+ * shjpeg_optimizer_wait()
+ */
+
+void
+shjpeg_optimizer_wait(shjpeg_optimizer_t *opt)
+{
+    if (!opt)
+	return;
+
+    pthread_mutex_lock(&opt->lock);
+
+    while (opt->pending)
+	pthread_cond_wait(&opt->idle, &opt->lock);
+
+    pthread_mutex_unlock(&opt->lock);
+}
+
+/*
+ * shjpeg_optimizer_destroy()
+ */
+
+void
+shjpeg_optimizer_destroy(shjpeg_optimizer_t *opt)
+{
+    int i;
+
+    if (!opt)
+	return;
+
+    pthread_mutex_lock(&opt->lock);
+    opt->quit = true;
+    pthread_cond_broadcast(&opt->queued);
+    pthread_mutex_unlock(&opt->lock);
+
+    for (i = 0; i < opt->num_threads; i++)
+	pthread_join(opt->threads[i], NULL);
+
+    pthread_cond_destroy(&opt->idle);
+    pthread_cond_destroy(&opt->queued);
+    pthread_mutex_destroy(&opt->lock);
+
+    free(opt->threads);
+    free(opt);
+}
@@ -173,6 +173,13 @@
 #define JPU_JINTS_INS13_LOADED		0x00002000
 #define JPU_JINTS_INS14_RELOAD		0x00004000
 
+/*
+ * VEU_VFMCR values (mirroring is applied before rotation)
+ */
+#define VEU_VFMCR_ROT90			0x00000001
+#define VEU_VFMCR_HMIR			0x00010000
+#define VEU_VFMCR_VMIR			0x00020000
+
 /*
  * For Debug Purpose (defined in shjpu_regs.h)
  */
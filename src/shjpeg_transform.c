@@ -0,0 +1,355 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA	 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <shjpeg/shjpeg.h>
+#include "shjpeg_internal.h"
+#include "shjpeg_transform.h"
+
+/*
+ * Lossless transforms of encoded images
+ *
+ * The image is rotated, mirrored and cropped by moving the DCT blocks,
+ * and transposing or negating the coefficients within each block, as
+ * jpegtran does. Nothing is decoded or quantized again, thus the image
+ * is not degraded.
+ */
+
+#define DIV_ROUND_UP(a, b)	(((a) + (b) - 1) / (b))
+#define ROUND_UP(a, b)		(DIV_ROUND_UP(a, b) * (b))
+
+/*
+ * Find the orientation in the EXIF data saved by libjpeg. If reset is
+ * true, the orientation tag is set to top left, as the image is
+ * transformed.
+ */
+
+static unsigned int
+exif_get16(const JOCTET *p, bool motorola)
+{
+    return motorola ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static unsigned int
+exif_get32(const JOCTET *p, bool motorola)
+{
+    return motorola ?
+	(exif_get16(p, true) << 16) | exif_get16(p + 2, true) :
+	(exif_get16(p + 2, false) << 16) | exif_get16(p, false);
+}
+
+static void
+exif_put16(JOCTET *p, unsigned int value, bool motorola)
+{
+    p[motorola ? 0 : 1] = value >> 8;
+    p[motorola ? 1 : 0] = value & 0xff;
+}
+
+shjpeg_orientation
+shjpeg_exif_orientation(j_decompress_ptr cinfo, bool reset)
+{
+    static const shjpeg_orientation exif[] = {
+	SHJPEG_ROTATE_0,			/* 1: top left */
+	SHJPEG_FLIP_H,				/* 2: top right */
+	SHJPEG_ROTATE_180,			/* 3: bottom right */
+	SHJPEG_FLIP_V,				/* 4: bottom left */
+	SHJPEG_FLIP_H | SHJPEG_ROTATE_270,	/* 5: left top */
+	SHJPEG_ROTATE_90,			/* 6: right top */
+	SHJPEG_FLIP_H | SHJPEG_ROTATE_90,	/* 7: right bottom */
+	SHJPEG_ROTATE_270,			/* 8: left bottom */
+    };
+    jpeg_saved_marker_ptr marker;
+
+    for (marker = cinfo->marker_list; marker; marker = marker->next) {
+	JOCTET *tiff = marker->data + 6;
+	unsigned int len, ifd, entries, i;
+	bool motorola;
+
+	/* "Exif\0\0" followed by TIFF header */
+	if ((marker->marker != JPEG_APP0 + 1) ||
+	    (marker->data_length < 6 + 8) ||
+	    memcmp(marker->data, "Exif\0\0", 6))
+	    continue;
+
+	len = marker->data_length - 6;
+	if (!memcmp(tiff, "MM", 2))
+	    motorola = true;
+	else if (!memcmp(tiff, "II", 2))
+	    motorola = false;
+	else
+	    continue;
+
+	/* look for the orientation tag in IFD0 */
+	ifd = exif_get32(tiff + 4, motorola);
+	if (ifd > len - 2)
+	    continue;
+
+	entries = exif_get16(tiff + ifd, motorola);
+	for (i = 0; i < entries && ifd + 2 + (i + 1) * 12 <= len; i++) {
+	    JOCTET *entry = tiff + ifd + 2 + i * 12;
+	    unsigned int value;
+
+	    if (exif_get16(entry, motorola) != 0x0112)
+		continue;
+
+	    value = exif_get16(entry + 8, motorola);
+	    if ((value < 1) || (value > 8))
+		break;
+
+	    if (reset)
+		exif_put16(entry + 8, 1, motorola);
+
+	    return exif[value - 1];
+	}
+    }
+
+    return SHJPEG_ROTATE_0;
+}
+
+/*
+ * Any orientation is a transposition followed by mirroring.
+ */
+
+typedef struct {
+    bool	transpose;
+    bool	hflip;
+    bool	vflip;
+} transform_op_t;
+
+static void
+transform_op(shjpeg_orientation orientation, transform_op_t *op)
+{
+    int i;
+
+    op->transpose = false;
+    op->hflip	  = (orientation & SHJPEG_FLIP_H) != 0;
+    op->vflip	  = (orientation & SHJPEG_FLIP_V) != 0;
+
+    /*
+     * Rotating by 90 degrees is transposing and mirroring horizontally.
+     * Mirroring before transposing is mirroring the other direction
+     * after it.
+     */
+    for (i = 0; i < (orientation & SHJPEG_ROTATE_270); i++) {
+	bool hflip = op->hflip;
+
+	op->transpose = !op->transpose;
+	op->hflip     = !op->vflip;
+	op->vflip     = hflip;
+    }
+}
+
+/*
+ * Transform the coefficients of a block. Mirroring a block negates the
+ * odd frequencies in that direction.
+ */
+
+static void
+transform_block(JCOEFPTR dst, const JCOEF *src, const transform_op_t *op)
+{
+    int u, v;
+
+    for (v = 0; v < DCTSIZE; v++) {
+	for (u = 0; u < DCTSIZE; u++) {
+	    JCOEF coef = op->transpose ?
+		src[u * DCTSIZE + v] : src[v * DCTSIZE + u];
+
+	    if ((op->hflip && (u & 1)) != (op->vflip && (v & 1)))
+		coef = -coef;
+
+	    dst[v * DCTSIZE + u] = coef;
+	}
+    }
+}
+
+/*
+ * Transform the coefficients read from src into new arrays for dst,
+ * after jpeg_copy_critical_parameters(). The crop region is given in
+ * the transformed image, and its top left corner is moved to an iMCU
+ * boundary. Edges of partial iMCUs that would be moved inside the
+ * image are trimmed, as jpegtran -trim does. Returns NULL if nothing
+ * is left.
+ */
+
+jvirt_barray_ptr *
+shjpeg_transform_coefs(j_decompress_ptr	  src,
+		       j_compress_ptr	  dst,
+		       jvirt_barray_ptr	 *coefs,
+		       shjpeg_orientation orientation,
+		       const shjpeg_rect_t *crop)
+{
+    jvirt_barray_ptr *out;
+    transform_op_t op;
+    int max_h = src->max_h_samp_factor;
+    int max_v = src->max_v_samp_factor;
+    int width, height, out_max_h, out_max_v;
+    int x, y, w, h, ci, i;
+
+    transform_op(orientation, &op);
+
+    /* the source edges mirrored in the transformed image */
+    width  = src->image_width;
+    height = src->image_height;
+
+    if (op.transpose ? op.vflip : op.hflip)
+	width  -= width  % (max_h * DCTSIZE);
+    if (op.transpose ? op.hflip : op.vflip)
+	height -= height % (max_v * DCTSIZE);
+
+    if (op.transpose) {
+	int tmp = width;
+	width  = height;
+	height = tmp;
+    }
+
+    out_max_h = op.transpose ? max_v : max_h;
+    out_max_v = op.transpose ? max_h : max_v;
+
+    /* the region to keep, starting at an iMCU */
+    x = 0;
+    y = 0;
+    w = width;
+    h = height;
+
+    if (crop && (crop->w > 0) && (crop->h > 0)) {
+	x = MAX(crop->x, 0);
+	y = MAX(crop->y, 0);
+	w = MIN(x + crop->w, width)  - x;
+	h = MIN(y + crop->h, height) - y;
+
+	w += x % (out_max_h * DCTSIZE);
+	h += y % (out_max_v * DCTSIZE);
+	x -= x % (out_max_h * DCTSIZE);
+	y -= y % (out_max_v * DCTSIZE);
+    }
+
+    if ((w <= 0) || (h <= 0))
+	return NULL;
+
+    dst->image_width  = w;
+    dst->image_height = h;
+
+    /* sampling factors and quantization tables are transposed too */
+    if (op.transpose) {
+	for (ci = 0; ci < dst->num_components; ci++) {
+	    jpeg_component_info *comp = &dst->comp_info[ci];
+	    int tmp = comp->h_samp_factor;
+
+	    comp->h_samp_factor = comp->v_samp_factor;
+	    comp->v_samp_factor = tmp;
+	}
+
+	for (i = 0; i < NUM_QUANT_TBLS; i++) {
+	    JQUANT_TBL *qtbl = dst->quant_tbl_ptrs[i];
+	    int u, v;
+
+	    if (!qtbl)
+		continue;
+
+	    for (v = 0; v < DCTSIZE; v++) {
+		for (u = v + 1; u < DCTSIZE; u++) {
+		    UINT16 tmp = qtbl->quantval[v * DCTSIZE + u];
+
+		    qtbl->quantval[v * DCTSIZE + u] =
+			qtbl->quantval[u * DCTSIZE + v];
+		    qtbl->quantval[u * DCTSIZE + v] = tmp;
+		}
+	    }
+	}
+    }
+
+    out = (*src->mem->alloc_small)((j_common_ptr)src, JPOOL_IMAGE,
+				   sizeof(jvirt_barray_ptr) *
+				   dst->num_components);
+
+    for (ci = 0; ci < dst->num_components; ci++) {
+	jpeg_component_info *comp = &dst->comp_info[ci];
+	int blocks_w = DIV_ROUND_UP(DIV_ROUND_UP(w * comp->h_samp_factor,
+						 out_max_h), DCTSIZE);
+	int blocks_h = DIV_ROUND_UP(DIV_ROUND_UP(h * comp->v_samp_factor,
+						 out_max_v), DCTSIZE);
+
+	out[ci] = (*src->mem->request_virt_barray)
+	    ((j_common_ptr)src, JPOOL_IMAGE, FALSE,
+	     ROUND_UP(blocks_w, comp->h_samp_factor),
+	     ROUND_UP(blocks_h, comp->v_samp_factor), comp->v_samp_factor);
+    }
+
+    (*src->mem->realize_virt_arrays)((j_common_ptr)src);
+
+    for (ci = 0; ci < dst->num_components; ci++) {
+	jpeg_component_info *comp     = &dst->comp_info[ci];
+	jpeg_component_info *src_comp = &src->comp_info[ci];
+	int h_samp = comp->h_samp_factor;
+	int v_samp = comp->v_samp_factor;
+
+	/* blocks of the transformed image, and of the source arrays */
+	int full_w = DIV_ROUND_UP(width  * h_samp, out_max_h * DCTSIZE);
+	int full_h = DIV_ROUND_UP(height * v_samp, out_max_v * DCTSIZE);
+	int src_w  = ROUND_UP(src_comp->width_in_blocks,
+			      src_comp->h_samp_factor);
+	int src_h  = ROUND_UP(src_comp->height_in_blocks,
+			      src_comp->v_samp_factor);
+
+	/* first block of the region */
+	int off_x  = x * h_samp / (out_max_h * DCTSIZE);
+	int off_y  = y * v_samp / (out_max_v * DCTSIZE);
+	int rows   = ROUND_UP(DIV_ROUND_UP(DIV_ROUND_UP(h * v_samp, out_max_v),
+					   DCTSIZE), v_samp);
+	int cols   = ROUND_UP(DIV_ROUND_UP(DIV_ROUND_UP(w * h_samp, out_max_h),
+					   DCTSIZE), h_samp);
+	int row, col;
+
+	for (row = 0; row < rows; row++) {
+	    JBLOCKROW dst_row = (*src->mem->access_virt_barray)
+		((j_common_ptr)src, out[ci], row, 1, TRUE)[0];
+
+	    for (col = 0; col < cols; col++) {
+		int bx = off_x + col;
+		int by = off_y + row;
+		int sx, sy;
+
+		if (op.hflip)
+		    bx = full_w - 1 - bx;
+		if (op.vflip)
+		    by = full_h - 1 - by;
+
+		sx = op.transpose ? by : bx;
+		sy = op.transpose ? bx : by;
+
+		/* padding beyond the source is left blank */
+		if ((sx < 0) || (sy < 0) || (sx >= src_w) || (sy >= src_h)) {
+		    memset(dst_row[col], 0, sizeof(JBLOCK));
+		    continue;
+		}
+
+		transform_block(dst_row[col],
+				(*src->mem->access_virt_barray)
+				((j_common_ptr)src, coefs[ci], sy, 1,
+				 FALSE)[0][sx], &op);
+	    }
+	}
+    }
+
+    return out;
+}
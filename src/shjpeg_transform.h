@@ -0,0 +1,35 @@
+/*
+ * libshjpeg: A library for controlling SH-Mobile JPEG hardware codec
+ *
+ * Copyright (C) 2009 IGEL Co.,Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA	 02110-1301 USA
+ */
+
+#ifndef __shjpeg_transform_h__
+#define __shjpeg_transform_h__
+
+#include <shjpeg/shjpeg_types.h>
+
+/* external function */
+shjpeg_orientation shjpeg_exif_orientation(j_decompress_ptr cinfo,
+					   bool reset);
+jvirt_barray_ptr *shjpeg_transform_coefs(j_decompress_ptr	  src,
+					 j_compress_ptr		  dst,
+					 jvirt_barray_ptr	 *coefs,
+					 shjpeg_orientation	  orientation,
+					 const shjpeg_rect_t	 *crop);
+
+#endif /* !__shjpeg_transform_h__ */
@@ -86,7 +86,7 @@ int shjpeg_veu_init(shjpeg_internal_t *data, shjpeg_veu_t *veu)
     shjpeg_veu_setreg32(data, VEU_VTRCR, veu->vtrcr);
     
     /* set resize register */
-    shjpeg_veu_setreg32(data, VEU_VRFCR, 0);	/* XXX: no resize for now */
+    shjpeg_veu_setreg32(data, VEU_VRFCR, veu->vrfcr);
     shjpeg_veu_setreg32(data, VEU_VRFSR, 
 			(veu->dst.height << 16) | veu->dst.width);
 
@@ -118,6 +118,66 @@ int shjpeg_veu_init(shjpeg_internal_t *data, shjpeg_veu_t *veu)
     return 0 ;
 }
 
+/*
+ * Calculate resize factor for VRFCR. Returns the 4.12 fixed point
+ * ratio of source to destination size for one direction.
+ */
+
+u32 shjpeg_veu_resize_factor(u32 src, u32 dst)
+{
+    u32 factor;
+
+    if (src == dst)
+	return 0;
+
+    factor = (4096 * (src - 1)) / (dst + 1);
+
+    /* fraction must be a multiple of 8 */
+    if (factor & 0x07) {
+	factor &= ~0x07;
+	if (dst < src)
+	    factor += 8;	/* round up if scaling down */
+	else if (factor >= 8)
+	    factor -= 8;	/* round down if scaling up */
+    }
+
+    return factor;
+}
+
+/*
+ * Check if the size can be resized by VEU
+ */
+
+bool shjpeg_veu_can_resize(u32 src, u32 dst)
+{
+    return (dst > 0) &&
+	(dst * SHJPEG_VEU_RESIZE_MAX >= src) &&
+	(dst <= src * SHJPEG_VEU_RESIZE_MAX);
+}
+
+/*
+ * Set source and destination of a frame, and the resize factor
+ * between them. Strides are left as set by shjpeg_veu_init().
+ */
+
+void shjpeg_veu_set_planes(shjpeg_internal_t  *data,
+			   shjpeg_veu_plane_t *src,
+			   shjpeg_veu_plane_t *dst)
+{
+    shjpeg_veu_setreg32(data, VEU_VESSR, (src->height << 16) | src->width);
+    shjpeg_veu_setreg32(data, VEU_VSAYR, src->yaddr);
+    shjpeg_veu_setreg32(data, VEU_VSACR, src->caddr);
+
+    shjpeg_veu_setreg32(data, VEU_VDAYR, dst->yaddr);
+    shjpeg_veu_setreg32(data, VEU_VDACR, dst->caddr);
+
+    shjpeg_veu_setreg32(data, VEU_VRFCR,
+			(shjpeg_veu_resize_factor(src->height,
+						  dst->height) << 16) |
+			shjpeg_veu_resize_factor(src->width, dst->width));
+    shjpeg_veu_setreg32(data, VEU_VRFSR, (dst->height << 16) | dst->width);
+}
+
 /*
  * Set JPU as the destination of VEU
  */
@@ -39,6 +39,7 @@ typedef struct {
     shjpeg_veu_plane_t	dst;		/* destination plane setting */
     u32			vbssr;		/* # of lines for bundle read mode */
     u32			vtrcr;		/* transform register */
+    u32			vrfcr;		/* resize factor */
     u32			venhr;
     u32			vfmcr;
     u32			vapcr;		/* chroma key */
@@ -74,8 +75,15 @@ shjpeg_veu_setreg32(shjpeg_internal_t	*data,
 #endif
 }
 
+/* limit of resize ratio */
+#define SHJPEG_VEU_RESIZE_MAX	16
+
 /* external function */
 int shjpeg_veu_init(shjpeg_internal_t *data, shjpeg_veu_t *veu);
+u32 shjpeg_veu_resize_factor(u32 src, u32 dst);
+bool shjpeg_veu_can_resize(u32 src, u32 dst);
+void shjpeg_veu_set_planes(shjpeg_internal_t*, shjpeg_veu_plane_t*,
+			   shjpeg_veu_plane_t*);
 void shjpeg_veu_set_dst_jpu(shjpeg_internal_t*);
 void shjpeg_veu_set_src_jpu(shjpeg_internal_t*);
 void shjpeg_veu_set_src(shjpeg_internal_t*, u32, u32);
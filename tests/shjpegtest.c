@@ -286,6 +286,8 @@ print_usage() {
 	    "  -D[<bmp>], --bmp[=<bmp>]  dump decoded image in BMP (default: test.bmp).\n"
 	    "  -b <bpp>, --bpp=<bpp>     Bits-per-pixel for BMP image (default: 24)"
 	    "  -p <phys>, --phys=<phys>  specify physical memory to use.\n"
+	    "  -s <n>, --scale=<n>       decode at 1/<n> scale (1, 2, 4 or 8).\n"
+	    "  -t, --transcode           decode and re-encode in one call.\n"
 	    "  -n, --no-libjpeg          disable fallback to libjpeg.\n");
 }
 
@@ -308,7 +310,9 @@ main(int argc, char *argv[])
     int			   dump = 0;
     int			   bpp = 24;
     int			   disable_libjpeg = 0;
+    int			   scale = 1;
     int			   quiet = 0;
+    int			   transcode = 0;
     int			   error = 0;
 
     argv0 = argv[0];
@@ -325,10 +329,12 @@ main(int argc, char *argv[])
 	    {"bpp", 1, 0, 'b'},
 	    {"phys", 1, 0, 'p'},
 	    {"no-libjpeg", 0, 0, 'n'},
+	    {"scale", 1, 0, 's'},
+	    {"transcode", 0, 0, 't'},
 	    {0, 0, 0, 0}
 	};
 	
-	if ((c = getopt_long(argc, argv, "hvd::D::b:nqp:",
+	if ((c = getopt_long(argc, argv, "hvd::D::b:nqp:s:t",
 			     long_options, &option_index)) == -1)
 	    break;
 
@@ -369,6 +375,14 @@ main(int argc, char *argv[])
 	    phys = strtol(optarg, NULL, 0);
 	    break;
 
+	case 's':
+	    scale = strtol(optarg, NULL, 0);
+	    break;
+
+	case 't':
+	    transcode = 1;
+	    break;
+
 	default:
 	    fprintf(stderr, "unknown option 0%x.\n", c);
 	    print_usage();
@@ -415,6 +429,7 @@ main(int argc, char *argv[])
     context->sops = &my_sops;
     context->private = (void*)&fd;
     context->libjpeg_disabled = disable_libjpeg;
+    context->scale_denom = scale;
 
     /* init decoding */
     if (shjpeg_decode_init(context) < 0) {
@@ -449,6 +464,37 @@ main(int argc, char *argv[])
     }
     pitch  = (SHJPEG_PF_PITCH_MULTIPLY(format) * context->width + 7) & ~7;
 
+    /* decode and re-encode without touching the image */
+    if (transcode && !dump) {
+	shjpeg_encode_output_t out;
+	int out_fd;
+
+	if ((out_fd = open(output, O_RDWR | O_CREAT, 0644)) < 0) {
+	    fprintf(stderr, "%s: Can't open '%s'.\n", argv[0], output);
+	    return 1;
+	}
+
+	memset(&out, 0, sizeof(out));
+	out.sops    = &my_sops;
+	out.private = (void*)&out_fd;
+
+	if (shjpeg_transcode(context, format, &out) < 0) {
+	    fprintf(stderr, "%s: shjpeg_transcode() failed.\n", argv[0]);
+	    error = 1;
+	}
+
+	if (!quiet && !error)
+	    printf("Decoded by: %s\n",
+		   context->libjpeg_used ? "libjpeg" : "JPU");
+
+	shjpeg_decode_shutdown(context);
+	close(out_fd);
+	close(fd);
+	shjpeg_shutdown(context);
+
+	return error;
+    }
+
     /* start decoding */
     if (shjpeg_decode_run(context, format, phys,
 			  context->width, context->height, pitch) < 0) {
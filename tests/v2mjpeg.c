@@ -58,57 +58,6 @@ int getinfo(int vd)
     return 0;
 }
 
-#define DATASIZE	64 * 1024
-
-typedef struct {
-    void *data;
-    size_t offset;
-    size_t size;
-} sops_data_t;
-
-int sops_init(void *private)
-{
-    sops_data_t *data = (sops_data_t*)private;
-
-    if (data->data)
-    	free(data->data);
-
-    data->data = malloc(DATASIZE);
-    if (!data->data)
-    	return -1;
-
-    data->size = DATASIZE;
-    data->offset = 0L;
-
-    return 0;
-}
-
-int sops_write(void *private, size_t *nbytes, void *dataptr)
-{
-    sops_data_t *data = (sops_data_t*)private;
-
-    if (data->size - data->offset < *nbytes) {
-    	data->size = ((data->offset + *nbytes) + DATASIZE - 1) & ~(DATASIZE - 1);
-	data->data = realloc(data->data, data->size);
-    }
-
-    memcpy(data->data + data->offset, dataptr, *nbytes);
-    data->offset += *nbytes;
-
-    return 0;
-}
-
-void sops_finalize(void *private)
-{
-}
-
-shjpeg_sops my_sops = {
-    .init     = sops_init,
-    .read     = NULL,
-    .write    = sops_write,
-    .finalize = sops_finalize,
-};
-
 static char *argv0;
 static struct timeval start_tv;
 static int frame_count = 0;
@@ -129,9 +78,18 @@ void print_usage() {
 	    "  -s <w>x<h>, --size=<w>x<h>         capture size.\n"
 	    "  -o [<prefix>], --output[=<prefix>] dump to the file.\n"
 	    "  -S, --single			  single buffered (default: double).\n"
+	    "  -l, --lock-frame                   lock JPU for each frame (default:\n"
+	    "                                     while encoding).\n"
 	    "  -c <count>, --count=<count>        # of JPEGs to capture.\n"
 	    "                                     (Default: 0(=infinite))\n"
-	    "  -i <n>, --interval=<n>             xmit at <n> msec interval. (Default: 0msec)\n");
+	    "  -i <n>, --interval=<n>             xmit at <n> msec interval. (Default: 0msec)\n"
+	    "  -Q <n>, --quality=<n>              JPEG quality 1-100 (initial one\n"
+	    "                                     with rate control).\n"
+	    "  -t <n>, --target-size=<n>          keep each JPEG within <n> bytes.\n"
+	    "  -b <n>, --bitrate=<n>              keep stream around <n> kbit/s.\n"
+	    "  -r <n>, --framerate=<n>            frame rate for -b. (Default: 30fps)\n"
+	    "  -R <n>, --retries=<n>              re-encode oversized JPEGs up to <n>\n"
+	    "                                     times. (Default: 0)\n");
 }
 
 void show_fps(int dummy)
@@ -175,7 +133,8 @@ int main(int argc, char *argv[])
     struct v4l2_format fmt;
     unsigned int page_size = getpagesize();
     shjpeg_context_t *ctx;
-    sops_data_t data = { .data = NULL, .size = 0L };
+    shjpeg_mjpeg_t *mjpeg;
+    shjpeg_mjpeg_lock lock = SHJPEG_MJPEG_LOCK_SESSION;
     int verbose = 0;
     int interval = 0;
     int quiet = 0;
@@ -186,6 +145,11 @@ int main(int argc, char *argv[])
     unsigned int width = 640;
     unsigned int height = 480;
     int reqbuf_count = 2;
+    int quality = 0;
+    int target_size = 0;
+    int bitrate = 0;
+    int framerate = 30;
+    int retries = 0;
 
     argv0 = argv[0];
 
@@ -202,10 +166,16 @@ int main(int argc, char *argv[])
 	    {"size", 1, 0, 's'},
 	    {"interval", 1, 0, 'i'},
 	    {"single", 0, 0, 'S'},
+	    {"lock-frame", 0, 0, 'l'},
+	    {"quality", 1, 0, 'Q'},
+	    {"target-size", 1, 0, 't'},
+	    {"bitrate", 1, 0, 'b'},
+	    {"framerate", 1, 0, 'r'},
+	    {"retries", 1, 0, 'R'},
 	    {0, 0, 0, 0}
 	};
 
-	if ((c = getopt_long(argc, argv, "hvqfo::c:i:s:S",
+	if ((c = getopt_long(argc, argv, "hvqfo::c:i:s:SlQ:t:b:r:R:",
 			     long_options, &option_index)) == -1)
 	    break;
 
@@ -258,6 +228,34 @@ int main(int argc, char *argv[])
 	    reqbuf_count = 1;
 	    break;
 
+	case 'l':
+	    lock = SHJPEG_MJPEG_LOCK_FRAME;
+	    break;
+
+	case 'Q':
+	    quality = strtol(optarg, NULL, 0);
+	    if ((quality < 1) || (quality > 100)) {
+	    	fprintf(stderr, "quality must be 1 to 100.\n");
+		return 1;
+	    }
+	    break;
+
+	case 't':
+	    target_size = strtol(optarg, NULL, 0);
+	    break;
+
+	case 'b':
+	    bitrate = strtol(optarg, NULL, 0) * 1000;
+	    break;
+
+	case 'r':
+	    framerate = strtol(optarg, NULL, 0);
+	    break;
+
+	case 'R':
+	    retries = strtol(optarg, NULL, 0);
+	    break;
+
 	default:
 	    fprintf(stderr, "unknown option 0%x.\n", c);
 	    print_usage();
@@ -382,9 +380,20 @@ int main(int argc, char *argv[])
 	return 1;
     }
 
-    /* set sops callbacks */
-    ctx->sops = &my_sops;
-    ctx->private = &data;
+    /* set quality and rate control */
+    ctx->encode_quality	    = quality;
+    ctx->encode_target_size = target_size;
+    ctx->encode_bitrate	    = bitrate;
+    ctx->encode_framerate   = framerate;
+    ctx->encode_max_retries = retries;
+
+    /* frames are encoded with the JPU programmed once */
+    mjpeg = shjpeg_mjpeg_open(ctx, SHJPEG_PF_NV16, fmt.fmt.pix.width,
+			      fmt.fmt.pix.height, fmt.fmt.pix.width, lock);
+    if (!mjpeg) {
+	fprintf(stderr, "Can't open Motion JPEG encoder\n");
+	return 1;
+    }
 
     /* now ready to capture */
     if (!quiet)
@@ -394,6 +403,7 @@ int main(int argc, char *argv[])
     gettimeofday(&start_tv, NULL);
     while(1) {
 	struct v4l2_buffer buffer;
+	shjpeg_mjpeg_frame_t frame;
 
 	/* capture */
 	memset(&buffer, 0, sizeof(buffer));
@@ -404,10 +414,13 @@ int main(int argc, char *argv[])
 	    return 1;
 	}
 
-	shjpeg_encode(ctx, SHJPEG_PF_NV16, buffers[buffer.index].start,
-		      fmt.fmt.pix.width, fmt.fmt.pix.height, 
-		      fmt.fmt.pix.width);
-		
+	if (shjpeg_mjpeg_encode_frame(mjpeg, buffers[buffer.index].start,
+				      (int64_t)buffer.timestamp.tv_sec * 1000000 +
+				      buffer.timestamp.tv_usec, &frame)) {
+	    fprintf(stderr, "Encoding failed\n");
+	    return 1;
+	}
+
 	/* queue again */
 	if (ioctl(vd, VIDIOC_QBUF, &buffer) < 0) {
 	    perror("ioctl - VIDIOC_QBUF");
@@ -425,17 +438,20 @@ int main(int argc, char *argv[])
 	    	fprintf(stderr, "Can't create file: %s\n", fn);
 		return 1;
 	    }
-	    fwrite(data.data, data.offset, 1, fp);
+	    fwrite(frame.data, frame.size, 1, fp);
 	    fclose(fp);
 	} else {
 	    printf("\r\n\r\n--%s\r\n", MJPEG_BOUNDARY);
 	    printf("Content-Type: image/jpeg\r\n");
-	    printf("Content-length: %d\r\n\r\n", data.offset);
-	    fwrite(data.data, data.offset, 1, stdout);
+	    printf("Content-length: %d\r\n\r\n", frame.size);
+	    fwrite(frame.data, frame.size, 1, stdout);
 //	    printf("\r\n");
 	}
 
-	if (!quiet)
+	if (verbose)
+	    fprintf(stderr, "[q=%d, %d bytes, %lldus]",
+		    frame.quality, frame.size, (long long)frame.encode_time);
+	else if (!quiet)
 	    fprintf(stderr, "+");
 	fflush(stderr);
 
@@ -447,6 +463,8 @@ int main(int argc, char *argv[])
 	    usleep(interval * 1000);
     }
 
+    shjpeg_mjpeg_close(mjpeg);
+
     if (fps)
     	show_fps(0);
 